@@ -0,0 +1,261 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Sensor acquisition thread
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "Acquisition.h"
+#include "timing.h"
+#include "Metrics.h"
+
+/********************
+ * PUBLIC FUNCTIONS
+ ********************/
+
+SensorAcquisition::SensorAcquisition() : track_bias(1), running(0), cycles(0), read_errors(0), overruns(0) {
+	rate = ACQ_DEFAULT_RATE;
+	have_gyro = 0;
+	have_compass = 0;
+	have_ranger = 0;
+	have_drdy = 0;
+	bus = NULL;
+	recorder = NULL;
+}
+
+SensorAcquisition::~SensorAcquisition() {
+	this->stop();
+	if (bus) bus->release();
+}
+
+int SensorAcquisition::init(int i2c_bus) {
+	if (bus) return 0;	// Already init
+	if (!accel.init(i2c_bus)) {
+		if (!ACQ_QUIET) fprintf(stderr, "Error Acquisition: Init of the accelerometer failed\n");
+		return 0;
+	}
+	have_gyro = gyro.init(i2c_bus);
+	if (!have_gyro && !ACQ_QUIET) {
+		fprintf(stderr, "Warning Acquisition: No gyroscope, the attitude follows the accelerometer only\n");
+	}
+	have_compass = compass.init(i2c_bus);
+	if (!have_compass && !ACQ_QUIET) {
+		fprintf(stderr, "Warning Acquisition: No compass, the yaw drifts with the gyro\n");
+	}
+	have_ranger = ranger.init(i2c_bus);
+	if (!have_ranger && !ACQ_QUIET) {
+		fprintf(stderr, "Warning Acquisition: No ultrasound ranger, continuing without height\n");
+	}
+	bus = I2CBus::open(i2c_bus);
+	return (bus != NULL);
+}
+
+int SensorAcquisition::useDataReady(int gpio_chip, int gpio_line) {
+	if (!bus || running.load() || have_drdy) return 0;
+	if (!drdy.open(gpio_chip, gpio_line)) return 0;
+	return this->enableDataReady();
+}
+
+int SensorAcquisition::useDataReadyFd(int fd) {
+	if (!bus || running.load() || have_drdy) return 0;
+	if (!drdy.attach(fd)) return 0;
+	return this->enableDataReady();
+}
+
+int SensorAcquisition::start() {
+	if (!bus || running.load()) return 0;
+	running.store(1);
+	int res = pthread_create(&thread, NULL, SensorAcquisition::run, this);
+	if (res != 0) {
+		if (!ACQ_QUIET) fprintf(stderr, "Error Acquisition: Could not start thread: %s\n", strerror(res));
+		running.store(0);
+		return 0;
+	}
+	return 1;
+}
+
+void SensorAcquisition::stop() {
+	if (!running.exchange(0)) return;
+	pthread_join(thread, NULL);
+}
+
+sample_ring* SensorAcquisition::getRing() {
+	return &ring;
+}
+
+void SensorAcquisition::setRecorder(FlightRecorder* recorder) {
+	this->recorder = recorder;
+}
+
+void SensorAcquisition::setTrackBias(int on) {
+	track_bias.store(on, std::memory_order_relaxed);
+}
+
+unsigned long SensorAcquisition::getCycles() const {
+	return cycles.load(std::memory_order_relaxed);
+}
+
+unsigned long SensorAcquisition::getReadErrors() const {
+	return read_errors.load(std::memory_order_relaxed);
+}
+
+unsigned long SensorAcquisition::getOverruns() const {
+	return overruns.load(std::memory_order_relaxed);
+}
+
+/********************
+ * PRIVATE FUNCTIONS
+ ********************/
+
+int SensorAcquisition::enableDataReady() {
+	// New data comes at twice the bandwidth
+	static const int bandwidths[7] = {1500, 750, 375, 190, 100, 50, 25};
+	int bandwidth = 25;
+	for (int i=0; i<7; i++) {
+		if (2*bandwidths[i] <= rate) {
+			bandwidth = bandwidths[i];
+			break;
+		}
+	}
+	accel.setBandwidth(bandwidth);
+	if (accel.getBandwidth() != bandwidth || !accel.setDataReadyInterrupt(1)) {
+		if (!ACQ_QUIET) fprintf(stderr, "Error Acquisition: Could not enable the data-ready interrupt\n");
+		drdy.close();
+		return 0;
+	}
+	have_drdy = 1;
+	return 1;
+}
+
+void SensorAcquisition::readGyro(int queued) {
+	Vec3 rates[ITG3200_FIFO_BATCH];
+	int n = queued ? gyro.getQueuedMeasurements(rates, ITG3200_FIFO_BATCH)
+		: gyro.getMeasurements(rates, ITG3200_FIFO_BATCH);
+	if (n < 0) {
+		read_errors.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	// One gyro period apart, the newest one as old as the samples still in the FIFO behind it
+	uint64_t now = monotonic_ns();
+	uint64_t period = 1000000000ull / (gyro.getRate() > 0 ? gyro.getRate() : ITG3200_DEFAULT_RATE);
+	int behind = gyro.getBacklog();
+	sensor_sample sample;
+	sample.sensor = SENSOR_GYRO;
+	for (int i=0; i<n; i++) {
+		sample.timestamp = now - (behind + n - 1 - i)*period;
+		sample.value = rates[i];
+		ring.push(sample);
+		if (recorder) recorder->record(RECORD_GYRO, sample.timestamp, sample.value[0], sample.value[1], sample.value[2]);
+	}
+}
+
+void SensorAcquisition::readCompass(int queued) {
+	Vec3 field;
+	int res = queued ? compass.getQueuedMeasurement(&field)
+		: (compass.read_mode == HMC5883L_READ_WORD ? compass.getMeasurement(&field) : 0);
+	if (res < 0) read_errors.fetch_add(1, std::memory_order_relaxed);
+	if (res <= 0) return;
+	sensor_sample sample;
+	sample.timestamp = monotonic_ns();
+	sample.sensor = SENSOR_COMPASS;
+	sample.value = field;
+	ring.push(sample);
+	if (recorder) recorder->record(RECORD_COMPASS, sample.timestamp, field[0], field[1], field[2]);
+}
+
+void* SensorAcquisition::run(void* self) {
+	((SensorAcquisition*)self)->loop();
+	return NULL;
+}
+
+void SensorAcquisition::loop() {
+	// Absolute deadlines, so the schedule does not drift with the time spent on the bus
+	uint64_t period = 1000000000ull / (rate > 0 ? rate : ACQ_DEFAULT_RATE);
+	uint64_t deadline = monotonic_ns();
+	unsigned int tick = 0;
+	sensor_sample sample;
+	uint64_t stale;
+	if (have_drdy) drdy.wait(0, &stale);	// Edges from before the start, nobody read their samples
+	
+	while (running.load(std::memory_order_relaxed)) {
+		// With the data-ready line, the edge starts the cycle and dates the accel sample
+		uint64_t edge = 0;
+		if (have_drdy) {
+			int edges = drdy.wait(ACQ_DRDY_TIMEOUT, &edge);
+			if (edges < 0) {
+				metrics_log("Error Acquisition: Lost the data-ready line, polling from now on");
+				have_drdy = 0;
+				deadline = monotonic_ns();
+			} else if (edges == 0) {
+				metrics_log("Warning Acquisition: No data-ready edge in %d ms", ACQ_DRDY_TIMEOUT);
+			} else if (edges > 1) {
+				// The previous cycle ran into this one's edge: samples lost
+				overruns.fetch_add(edges - 1, std::memory_order_relaxed);
+				metrics_count(METRIC_ACQ_OVERRUNS, edges - 1);
+			}
+		}
+		uint64_t start = monotonic_ns();
+		gyro.track_bias = track_bias.load(std::memory_order_relaxed);
+		// All reads of this cycle in one bus transaction. The gyro FIFO holds every sample,
+		// so it is only read every ACQ_GYRO_DIVIDER cycles; without FIFO it is read each cycle.
+		// The compass paces itself, queueing its reads only when a new sample is due, and
+		// goes in the cycles between FIFO reads: both in one cycle would not fit the period.
+		int fifo = have_gyro && gyro.read_mode == ITG3200_READ_FIFO;
+		int gyro_queued = 0;
+		if (have_gyro && (!fifo || (tick % ACQ_GYRO_DIVIDER) == 0))
+			gyro_queued = gyro.queueMeasurement();
+		int compass_queued = 0;
+		if (have_compass && (!fifo || (tick % ACQ_GYRO_DIVIDER) != 0))
+			compass_queued = compass.queueMeasurement();
+		int accel_queued = accel.queueMeasurement();
+		bus->flush();
+		int accel_read = accel_queued ? accel.getQueuedMeasurement(&sample.value)
+			: accel.getMeasurement(&sample.value);
+		sample.timestamp = edge ? edge : monotonic_ns();
+		sample.sensor = SENSOR_ACCEL;
+		if (accel_read) {
+			ring.push(sample);
+			if (have_gyro) gyro.addAccel(sample.value);		// For the bias tracker
+			if (edge) metrics_latency(METRIC_LAT_DRDY, monotonic_ns() - edge);
+			if (recorder) recorder->record(RECORD_ACCEL, sample.timestamp, sample.value[0], sample.value[1], sample.value[2]);
+		} else {
+			read_errors.fetch_add(1, std::memory_order_relaxed);
+		}
+		if (have_gyro && (gyro_queued || gyro.read_mode == ITG3200_READ_WORD)) this->readGyro(gyro_queued);
+		if (have_compass) this->readCompass(compass_queued);
+		
+		if (have_ranger && (tick % ACQ_RANGE_DIVIDER) == 0) {
+			// Never blocks, only a new range goes in the ring, stamped with when it was measured
+			int ranged = ranger.poll();
+			if (ranged > 0) {
+				sample.timestamp = ranger.getTimestamp();
+				sample.sensor = SENSOR_RANGE;
+				sample.value = Vec3(ranger.getRange(), 0, 0);
+				ring.push(sample);
+				if (recorder) recorder->record(RECORD_RANGE, sample.timestamp, sample.value.data, 1);
+			} else if (ranged < 0) {
+				read_errors.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+		tick++;
+		cycles.fetch_add(1, std::memory_order_relaxed);
+		
+		uint64_t now = monotonic_ns();
+		metrics_latency(METRIC_LAT_ACQ_CYCLE, now - start);
+		if (have_drdy) continue;		// The next edge sets the pace
+		deadline += period;
+		if (now >= deadline) {
+			// Late: count it and restart the schedule from now instead of bursting to catch up
+			overruns.fetch_add(1, std::memory_order_relaxed);
+			metrics_count(METRIC_ACQ_OVERRUNS);
+			deadline = now;
+			continue;
+		}
+		struct timespec ts;
+		ts.tv_sec = deadline / 1000000000ull;
+		ts.tv_nsec = deadline % 1000000000ull;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+	}
+}
@@ -0,0 +1,103 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Sensor acquisition thread
+ * Polls the sensors on a fixed schedule and hands timestamped samples to the
+ * estimator through a wait-free ring, so a slow i2c transaction never stalls
+ * the control loop. Optionally the accelerometer's data-ready line sets the pace
+ * instead of a timer (useDataReady()).
+ */
+ 
+#ifndef _ACQUISITION_H
+#define _ACQUISITION_H
+
+#define ACQ_QUIET 0
+#define ACQ_RING_SIZE 512			// Samples, power of two. 512 = 1/4 s of accel and gyro data at 1 kHz
+#define ACQ_DEFAULT_RATE 1000		// Accelerometer poll rate [Hz]
+#define ACQ_RANGE_DIVIDER 5		// Poll the ultrasound ranger every N accel samples, cheap while it waits
+#define ACQ_GYRO_DIVIDER 2			// Read the gyro FIFO every N accel samples, N samples in one read
+#define ACQ_DRDY_TIMEOUT 20			// No data-ready edge for this long: read anyway [ms]
+
+// Sample types
+#define SENSOR_ACCEL 0				// value: acceleration [g]
+#define SENSOR_RANGE 1				// value[0]: range [cm]
+#define SENSOR_GYRO 2				// value: angular velocity [rad/s], bias removed
+#define SENSOR_COMPASS 3			// value: magnetic field [gauss], calibrated
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include "BMA020.h"
+#include "ITG3200.h"
+#include "HMC5883L.h"
+#include "SRF02.h"
+#include "GpioEdge.h"
+#include "I2CBus.h"
+#include "SpscRing.h"
+#include "Recorder.h"
+#include "matrix.h"
+
+struct sensor_sample {
+	uint64_t timestamp;		// CLOCK_MONOTONIC [ns], taken right after the bus read
+	int sensor;				// SENSOR_*
+	Vec3 value;
+};
+
+typedef SpscRing<sensor_sample, ACQ_RING_SIZE> sample_ring;
+
+class SensorAcquisition {
+	public:
+		SensorAcquisition();
+		~SensorAcquisition();			// Stops the thread
+		// init(): Connect to the sensors. Returns 1 if successful, 0 if not.
+		// The gyro, compass and ranger are optional, without them only accel samples are produced.
+		int init(int i2c_bus);
+		// useDataReady(): Start every cycle at a rising edge of the accelerometer's INT line, on
+		// /dev/gpiochip<chip>, instead of every 1/rate: each sample is read once, right after its
+		// conversion, and stamped with the edge. The accelerometer gets the highest output rate
+		// not above rate. After init(), before start(). Returns 1 if successful, 0 if not (then
+		// the timer stays in charge).
+		int useDataReady(int gpio_chip, int gpio_line);
+		int useDataReadyFd(int fd);		// Same, with the edge events from fd (I2CSimEdge)
+		int start();					// Start the thread, 1 if successful
+		void stop();
+		
+		sample_ring* getRing();			// Consumer side belongs to the estimator
+		void setRecorder(FlightRecorder* recorder);	// Record every sample (NULL: off), before start()
+		// setTrackBias(): Gyro bias tracking at rest on (default) or off, any thread. Turn it off
+		// whenever the quad may turn, e.g. once it leaves the ground (ITG3200.h).
+		void setTrackBias(int on);
+		unsigned long getCycles() const;
+		unsigned long getReadErrors() const;
+		unsigned long getOverruns() const;	// Cycles that started late because the previous one ran long,
+											// or data-ready edges missed
+		
+		int rate;						// Poll rate [Hz], set before start()
+		
+	private:
+		static void* run(void* self);
+		void loop();
+		
+		BMA020_ACCEL accel;
+		ITG3200_GYRO gyro;
+		HMC5883L_COMPASS compass;
+		SRF02_US ranger;
+		int have_gyro;
+		int have_compass;
+		int have_ranger;
+		GpioEdge drdy;
+		int have_drdy;
+		int enableDataReady();			// Accelerometer side of useDataReady()
+		void readGyro(int queued);		// Push the gyro samples of this cycle
+		void readCompass(int queued);	// Push the compass sample of this cycle, if there is a new one
+		I2CBus* bus;
+		sample_ring ring;
+		FlightRecorder* recorder;
+		std::atomic<int> track_bias;	// Copied to the gyro by the thread, every cycle
+		pthread_t thread;
+		std::atomic<int> running;
+		std::atomic<unsigned long> cycles;
+		std::atomic<unsigned long> read_errors;
+		std::atomic<unsigned long> overruns;
+};
+
+#endif
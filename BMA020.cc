@@ -3,32 +3,32 @@
  * BMA020 accelerometer driver (i2c)
  */
 
-#include <sys/ioctl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <linux/i2c-dev-user.h>
 #include "BMA020.h"
+#include "Calibration.h"
+#include "I2CBus.h"
 #include "matrix.h"
+#include "Metrics.h"
+#include "timing.h"
 
 /********************
  * PUBLIC FUNCTIONS
  ********************/
  
 BMA020_ACCEL::BMA020_ACCEL() {
-	this->calibration_matrix = new matrix(3,3);
-  this->calibration_offset = new vector(3);
-	handle = 0;
+	bus = NULL;
 	scale = 0;
   bandwidth = 0;
   use_calibration = 1;
+  read_mode = BMA020_READ_WORD;
+  queue_status = 0;
 }
 
 BMA020_ACCEL::~BMA020_ACCEL() {
-	if (this->handle > 0) close(this->handle);
+	if (this->bus) this->bus->release();
 }
 
 int BMA020_ACCEL::init(int i2c_bus) {
@@ -37,52 +37,28 @@ int BMA020_ACCEL::init(int i2c_bus) {
 	
 	// Return: 1 if successful, 0 if not
 	
-	char filename[20];
-	
-	if (this->handle) return 0; // Already init
-	snprintf(filename, 20, "/dev/i2c/%d", i2c_bus);
-	filename[19] = '\0';
-
-	// Find the correct file and open it
-	this->handle = open(filename, O_RDWR);
-
-	if (this->handle < 0 && (errno == ENOENT || errno == ENOTDIR)) {
-		sprintf(filename, "/dev/i2c-%d", i2c_bus);
-		this->handle = open(filename, O_RDWR);
-	}
-
-	if (this->handle < 0 && !BMA020_QUIET) {
-		if (errno == ENOENT) {
-			fprintf(stderr, "Error BMA020: Could not open handle "
-				"`/dev/i2c-%d' or `/dev/i2c/%d': %s\n",
-				i2c_bus, i2c_bus, strerror(ENOENT));
-		} else {
-			fprintf(stderr, "Error BMA020: Could not open handle "
-				"`%s': %s\n", filename, strerror(errno));
-			if (errno == EACCES)
-				fprintf(stderr, "Run as root?\n");
-		}
-	}
-	if (this->handle < 0) return 0;
+	if (this->bus) return 0; // Already init
+	this->bus = I2CBus::open(i2c_bus);
+	if (!this->bus) return 0;
 	
 	// Set the address of the slave
-	/* With force, let the user read from/write to the registers
-	   even when a driver is also running */
-	if (ioctl(this->handle, BMA020_FORCE ? I2C_SLAVE_FORCE : I2C_SLAVE, BMA020_ADDRESS) < 0) {
+	if (this->bus->setSlave(BMA020_ADDRESS, BMA020_FORCE) < 0) {
 		if (!BMA020_QUIET) {
-			fprintf(stderr,
-				"Error BMA020: Could not set address to 0x%02x: %s\n",
-				BMA020_ADDRESS, strerror(errno));
+			fprintf(stderr, "Error BMA020: Could not set address to 0x%02x\n", BMA020_ADDRESS);
 		}
+		this->bus->release();
+		this->bus = NULL;
 		return 0;
 	}
 
 	// Read the chip-id, compare it with predefined value (BMA020_CHIP_ID) as a check
-	int res = i2c_smbus_read_byte_data(this->handle, 0x00);
+	int res = this->bus->readByte(BMA020_ADDRESS, 0x00);
 	if (res < 0) {
 		if (!BMA020_QUIET) {
 			fprintf(stderr, "Error BMA020: Reading the chip-id (address 0x00) failed\n");
 		}
+		this->bus->release();
+		this->bus = NULL;
 		return 0;
 	}
 	if (res != BMA020_CHIP_ID) {
@@ -91,9 +67,14 @@ int BMA020_ACCEL::init(int i2c_bus) {
 				"Error BMA020: Chip-id does not match. Read 0x%02x, should be 0x%02x.\n", 
 				res, BMA020_CHIP_ID);
 		}
+		this->bus->release();
+		this->bus = NULL;
 		return 0;
 	}
 	
+	// Read all data registers in one transaction if the adapter can
+	this->read_mode = this->bus->supportsBurst() ? BMA020_READ_BURST : BMA020_READ_WORD;
+	
 	this->setRange(BMA020_DEFAULT_RANGE);
   this->setBandwidth(BMA020_DEFAULT_BANDWIDTH);
   this->loadCalibration();
@@ -149,34 +130,47 @@ int BMA020_ACCEL::getBandwidth() {
   return this->bandwidth;
 }
 
-int BMA020_ACCEL::getMeasurement(vector* measurement) {
-	if (!(this->handle>0)) return 0;	// Not connected to sensor
-	if (!(this->scale>0)) return 0;		// No valid scale
+int BMA020_ACCEL::setDataReadyInterrupt(int enable) {
+	// Unlatched, so the pin drops again by itself and every sample gives a fresh edge
+	int control = this->readByte(BMA020_CONTROL);
+	if (control<0) return 0;
+	control &= ~(BMA020_NEW_DATA_INT | BMA020_LATCH_INT);
+	if (enable) control |= BMA020_NEW_DATA_INT;
+	return (this->writeByte(BMA020_CONTROL, (unsigned char)control) > 0);
+}
+
+int BMA020_ACCEL::getMeasurement(Vec3* measurement) {
+	if (!this->bus) return 0;	// Not connected to sensor
+	uint64_t start = monotonic_ns();
 	
-	// Read the data in parts of 2 bytes
-	int x = i2c_smbus_read_word_data(this->handle, BMA020_ADDR_X);
-	int y = i2c_smbus_read_word_data(this->handle, BMA020_ADDR_Y);
-	int z = i2c_smbus_read_word_data(this->handle, BMA020_ADDR_Z);
-	if (x<0 || y<0 || z<0) {
-		if (!BMA020_QUIET) {
-			fprintf(stderr, "Error BMA020: Could not read some data register on the sensor.\n");
-		}
-		return 0;
+	// All three axes from one conversion cycle, ideally in one bus transaction
+	unsigned char buffer[BMA020_DATA_LENGTH];
+	int res = this->readData(buffer) && this->decode(buffer, measurement);
+	metrics_latency(METRIC_LAT_BMA020, monotonic_ns() - start);
+	metrics_count(METRIC_BMA020_READS);
+	if (!res) {
+		metrics_count(METRIC_BMA020_ERRORS);
+		if (!BMA020_QUIET) metrics_log("Error BMA020: Could not read the data registers on the sensor.");
 	}
-	
-	x = x>>6;	// Those are now values from 0...1023 (10 bit two's complement)
-	y = y>>6;
-	z = z>>6;
-	// Convert values to signed:
-	if (x&0x200) x = -1024 + x; // Those are now values from -512...511
-	if (y&0x200) y = -1024 + y; // Those are now values from -512...511
-	if (z&0x200) z = -1024 + z; // Those are now values from -512...511
-	
-	vector data = new vector(x*this->scale, y*this->scale, z*this->scale);
-	if (this->use_calibration) {
-		*measurement = (*this->calibration_matrix)*data + (*this->calibration_offset);
-	} else {
-		*measurement = data;	
+	return res;
+}
+
+int BMA020_ACCEL::queueMeasurement() {
+	// Word reads cannot be queued: flush() sends each queued read as one burst
+	if (!this->bus || this->read_mode != BMA020_READ_BURST) return 0;
+	return this->bus->queueRead(BMA020_ADDRESS, BMA020_ADDR_X,
+		this->queue_buffer, BMA020_DATA_LENGTH, &this->queue_status);
+}
+
+int BMA020_ACCEL::getQueuedMeasurement(Vec3* measurement) {
+	int status = this->queue_status;
+	this->queue_status = 0;
+	if (status == 0) return 0;		// Not flushed yet
+	metrics_count(METRIC_BMA020_READS);
+	if (status < 0 || !this->decode(this->queue_buffer, measurement)) {
+		metrics_count(METRIC_BMA020_ERRORS);
+		if (!BMA020_QUIET) metrics_log("Error BMA020: Could not read the data registers on the sensor.");
+		return 0;
 	}
 	return 1;
 }
@@ -186,30 +180,12 @@ int BMA020_ACCEL::getMeasurement(vector* measurement) {
  ********************/
 
 void BMA020_ACCEL::loadCalibration() {
-	FILE * cFile;
-  cFile = fopen ("calibrate/accel.txt","r");
-  // Calibration matrix
-  for (int i=0; i<3; i++) {
-  	for (int j=0; j<3; j++) {
-  		fscanf (cFile, "%f", &(this->calibration_matrix->data[i][j]));
-  	}
-  }
-  // Calibration offset
-  float temp;
-  fscanf (cFile, "%f", &temp);
-  this->calibration_offset->set(0,temp);
-  fscanf (cFile, "%f", &temp);
-  this->calibration_offset->set(0,temp);
-  fscanf (cFile, "%f", &temp);
-	this->calibration_offset->set(0,temp);
-	
-  fclose (cFile);
-  
+	calibration_open();
 }
 
 int BMA020_ACCEL::readByte(int address) {
-	if (!(this->handle>0)) return 0;	// Not connected to sensor
-	int res = i2c_smbus_read_byte_data(this->handle, address);
+	if (!this->bus) return 0;	// Not connected to sensor
+	int res = this->bus->readByte(BMA020_ADDRESS, address);
 	if (res<0) {
 		if (!BMA020_QUIET) {
 			fprintf(stderr, 
@@ -223,8 +199,8 @@ int BMA020_ACCEL::readByte(int address) {
 }
 
 int BMA020_ACCEL::writeByte(int address, unsigned char data) {
-	if (!(this->handle>0)) return 0;	// Not connected to sensor
-	int res = i2c_smbus_write_word_data(this->handle, address, data);
+	if (!this->bus) return 0;	// Not connected to sensor
+	int res = this->bus->writeByte(BMA020_ADDRESS, address, data);
 	if (res<0) {
 		if (!BMA020_QUIET) {
 			fprintf(stderr, 
@@ -236,3 +212,38 @@ int BMA020_ACCEL::writeByte(int address, unsigned char data) {
 		return 1;
 	}
 }
+
+int BMA020_ACCEL::readData(unsigned char* buffer) {
+	// Read X, Y and Z (LSB, MSB each) into buffer. Returns 1 on success, 0 if not.
+	if (this->read_mode == BMA020_READ_BURST) {
+		return (this->bus->readBlock(BMA020_ADDRESS, BMA020_ADDR_X, buffer, BMA020_DATA_LENGTH)
+			== BMA020_DATA_LENGTH);
+	}
+	// Per-word fallback: three transactions, the axes may come from different conversions
+	int addresses[3] = {BMA020_ADDR_X, BMA020_ADDR_Y, BMA020_ADDR_Z};
+	for (int i=0; i<3; i++) {
+		int word = this->bus->readWord(BMA020_ADDRESS, addresses[i]);
+		if (word<0) return 0;
+		buffer[2*i] = word & 0xFF;
+		buffer[2*i+1] = (word>>8) & 0xFF;
+	}
+	return 1;
+}
+
+int BMA020_ACCEL::decode(const unsigned char* buffer, Vec3* measurement) {
+	if (!(this->scale>0)) return 0;		// No valid scale
+	
+	// Each axis is LSB, MSB: bits 7:6 of the LSB and the whole MSB form a
+	// 10 bit left-justified two's complement value
+	int x = ((buffer[1]<<8) | buffer[0]) >> 6;	// Those are now values from 0...1023
+	int y = ((buffer[3]<<8) | buffer[2]) >> 6;
+	int z = ((buffer[5]<<8) | buffer[4]) >> 6;
+	// Convert values to signed:
+	if (x&0x200) x = -1024 + x; // Those are now values from -512...511
+	if (y&0x200) y = -1024 + y; // Those are now values from -512...511
+	if (z&0x200) z = -1024 + z; // Those are now values from -512...511
+	
+	Vec3 data(x*this->scale, y*this->scale, z*this->scale);
+	*measurement = calibration_correct(CALIB_ACCEL, this->use_calibration, data);
+	return 1;
+}
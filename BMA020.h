@@ -14,11 +14,20 @@
 #define BMA020_ADDR_X 0x2		// Address of the register containing the LSB of the X value
 #define BMA020_ADDR_Y 0x4	
 #define BMA020_ADDR_Z 0x6
+#define BMA020_DATA_LENGTH 6	// X, Y, Z LSB/MSB pairs, read in one go starting at BMA020_ADDR_X
+#define BMA020_CONTROL 0x15		// SPI4, enable_adv_INT, new_data_INT (bit 5), latch_INT, ...
+#define BMA020_NEW_DATA_INT 0x20
+#define BMA020_LATCH_INT 0x10
+
+// How the data registers are read, picked in init() from what the adapter supports
+#define BMA020_READ_BURST 1		// One transaction: I2C_RDWR or SMBus i2c-block read
+#define BMA020_READ_WORD 0		// Three SMBus word reads, fallback for basic adapters
 
 #define BMA020_DEFAULT_RANGE 2 // Default range of sensor (+/- 2g, 4g or 8g)
 #define BMA020_DEFAULT_BANDWIDTH 100 // Bandwidth of low-pass filter [Hz]
 
 #include "matrix.h"
+#include "I2CBus.h"
 
 class BMA020_ACCEL {
 	public:
@@ -28,7 +37,12 @@ class BMA020_ACCEL {
     // Always call before doing other things
 		int init(int i2c_bus);
     // getMeasurement(): Measure, calculate forces and write to data
-		int getMeasurement(vector* measurement);
+		int getMeasurement(Vec3* measurement);
+    // queueMeasurement(): Add the data read to the bus queue, so it goes out together
+    // with other devices on the next I2CBus::flush(). Then call getQueuedMeasurement().
+    // Returns 0 if nothing was queued: BMA020_READ_WORD, use getMeasurement() then.
+		int queueMeasurement();
+		int getQueuedMeasurement(Vec3* measurement);
 		// setRange(): Set the range of the sensor to +/- 2g, 4g or 8g. Avoid clipping!
     // Optional, only call if you don't want to use the default setting (BMA020_DEFAULT_RANGE)
 		void setRange(unsigned char range);
@@ -38,18 +52,26 @@ class BMA020_ACCEL {
     void setBandwidth(int bandwidth);
     // Read the current bandwidth setting [Hz]:
     int getBandwidth();
+    // setDataReadyInterrupt(): Pulse the INT pin with every new sample (twice per bandwidth period),
+    // to be waited on through a GPIO (GpioEdge.h) instead of polling. Returns 1 if successful.
+    int setDataReadyInterrupt(int enable);
+    // decode(): Convert BMA020_DATA_LENGTH raw bytes, as read from BMA020_ADDR_X, to [g] with the
+    // current range, calibrated if use_calibration is set. Returns 1 if successful, 0 if no range set.
+    int decode(const unsigned char* buffer, Vec3* measurement);
   
   	// Variables:
   	int use_calibration;
+  	int read_mode;			// BMA020_READ_*, may be lowered to force a slower path
 	private:
-		int handle;							// Handle to the bus
+		I2CBus* bus;						// Shared bus, NULL if not connected
     int bandwidth;          // Bandwidth for low-pass filter
 		float scale;						// Scaling factor for calculating forces. Depends on the range.
-		void loadCalibration();	// Fill calibration data from file
+		void loadCalibration();	// Open the calibration store (Calibration.h)
 		int readByte(int address);
 		int writeByte(int address, unsigned char data);
-		matrix* calibration_matrix;		// Will be read from calibration_accel.txt, first 9 entries
-		vector* calibration_offset;		// Will be read from calibration_accel.txt, last 3 entries
+		int readData(unsigned char* buffer);	// BMA020_DATA_LENGTH bytes from BMA020_ADDR_X
+		unsigned char queue_buffer[BMA020_DATA_LENGTH];
+		int queue_status;
 };
 
 #endif
\ No newline at end of file
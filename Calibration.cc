@@ -0,0 +1,292 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Calibration store
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <atomic>
+#include "Calibration.h"
+
+static const char* text_files[CALIB_SENSORS] = {"accel.txt", "gyro.txt", "compass.txt"};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;	// Everything but current
+static std::atomic<calibration_blob*> current(NULL);
+static calibration_blob* active = NULL;				// Heap copy, of the file or the text files
+static calibration_blob* retired[CALIBRATION_RETIRED];	// Replaced ones, readers may still be in them
+static unsigned int num_retired = 0;				// Ever, retired[num_retired % CALIBRATION_RETIRED] is next
+static char directory[256];
+static int opened = 0;
+static int watch_fd = -1;
+static pthread_t watcher;
+static std::atomic<int> watching(0);
+
+static uint32_t crc32(const unsigned char* data, size_t length) {
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t i=0; i<length; i++) {
+		crc ^= data[i];
+		for (int k=0; k<8; k++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static uint32_t checksum(const calibration_blob* blob) {
+	const unsigned char* start = (const unsigned char*)&blob->checksum + sizeof(blob->checksum);
+	return crc32(start, (const unsigned char*)(blob + 1) - start);
+}
+
+static int valid(const calibration_blob* blob, const char* path) {
+	if (memcmp(blob->magic, CALIBRATION_MAGIC, sizeof(blob->magic)) != 0
+		|| blob->version != CALIBRATION_VERSION || blob->size != sizeof(calibration_blob)) {
+		if (!CALIBRATION_QUIET) fprintf(stderr, "Error Calibration: %s is not a version %d calibration\n",
+			path, CALIBRATION_VERSION);
+		return 0;
+	}
+	if (blob->checksum != checksum(blob)) {
+		if (!CALIBRATION_QUIET) fprintf(stderr, "Error Calibration: %s is corrupt (checksum)\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+static calibration_blob* readFile(const char* path) {
+	// Into a private copy on the heap, NULL if missing or not valid. Never mapped: a file
+	// truncated while mapped would take down whoever reads the entry (SIGBUS).
+	int handle = open(path, O_RDONLY);
+	if (handle < 0) return NULL;
+	calibration_blob* blob = (calibration_blob*)malloc(sizeof(calibration_blob));
+	ssize_t length = read(handle, blob, sizeof(calibration_blob));
+	char extra;
+	int longer = (length == (ssize_t)sizeof(calibration_blob) && read(handle, &extra, 1) > 0);
+	close(handle);
+	if (length != (ssize_t)sizeof(calibration_blob) || longer) {
+		if (!CALIBRATION_QUIET) fprintf(stderr, "Error Calibration: %s has the wrong size\n", path);
+		free(blob);
+		return NULL;
+	}
+	if (!valid(blob, path)) {
+		free(blob);
+		return NULL;
+	}
+	return blob;
+}
+
+static int readText(const char* path, calibration_entry* entry) {
+	// 3x3 matrix row by row, then the offset. Returns 1 if all 12 values are there.
+	FILE* file = fopen(path, "r");
+	if (file == NULL) return 0;
+	float values[12];
+	int n = 0;
+	while (n < 12 && fscanf(file, "%f", &values[n]) == 1) n++;
+	fclose(file);
+	if (n != 12) {
+		if (!CALIBRATION_QUIET) fprintf(stderr, "Error Calibration: %s has %d values, should be 12\n", path, n);
+		return 0;
+	}
+	for (int i=0; i<3; i++) {
+		for (int j=0; j<3; j++) entry->matrix[i][j] = values[3*i + j];
+		entry->offset[i] = values[9 + i];
+	}
+	entry->valid = 1;
+	return 1;
+}
+
+static calibration_blob* readTextFiles(const char* dir) {
+	// NULL if there is none at all
+	calibration_blob* blob = (calibration_blob*)calloc(1, sizeof(calibration_blob));
+	int found = 0;
+	for (int s=0; s<CALIB_SENSORS; s++) {
+		char path[300];
+		snprintf(path, sizeof(path), "%s/%s", dir, text_files[s]);
+		found += readText(path, &blob->sensors[s]);
+	}
+	if (!found) {
+		free(blob);
+		return NULL;
+	}
+	memcpy(blob->magic, CALIBRATION_MAGIC, sizeof(blob->magic));
+	blob->version = CALIBRATION_VERSION;
+	blob->size = sizeof(calibration_blob);
+	return blob;
+}
+
+static void install(calibration_blob* blob) {
+	// Caller holds lock. Readers don't announce when they are done, so a replaced blob is only
+	// freed CALIBRATION_RETIRED reloads later (or by calibration_close()).
+	if (active) {
+		calibration_blob** slot = &retired[num_retired++ % CALIBRATION_RETIRED];
+		free(*slot);
+		*slot = active;
+	}
+	active = blob;
+	current.store(blob, std::memory_order_release);
+}
+
+static void reload() {
+	char path[300];
+	snprintf(path, sizeof(path), "%s/%s", directory, CALIBRATION_FILE);
+	calibration_blob* blob = readFile(path);
+	if (blob == NULL) return;		// Keep what we have
+	pthread_mutex_lock(&lock);
+	uint32_t old = active ? active->generation : 0;
+	install(blob);
+	pthread_mutex_unlock(&lock);
+	if (!CALIBRATION_QUIET) fprintf(stderr, "Calibration: reloaded %s, generation %u -> %u\n",
+		path, old, blob->generation);
+}
+
+static void* watch(void* arg) {
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = {watch_fd, POLLIN, 0};
+	while (watching.load(std::memory_order_relaxed)) {
+		if (poll(&pfd, 1, (int)(CALIBRATION_WATCH_INTERVAL*1000)) <= 0) continue;
+		ssize_t length = read(watch_fd, buffer, sizeof(buffer));
+		int changed = 0;
+		for (char* p = buffer; length > 0 && p < buffer + length; ) {
+			struct inotify_event* event = (struct inotify_event*)p;
+			if (event->len && strcmp(event->name, CALIBRATION_FILE) == 0) changed = 1;
+			p += sizeof(struct inotify_event) + event->len;
+		}
+		if (changed) reload();
+	}
+	return NULL;
+}
+
+/********************
+ * PUBLIC FUNCTIONS
+ ********************/
+
+int calibration_open(const char* dir) {
+	pthread_mutex_lock(&lock);
+	if (opened) {
+		int res = (active != NULL);
+		pthread_mutex_unlock(&lock);
+		return res;
+	}
+	opened = 1;
+	snprintf(directory, sizeof(directory), "%s", dir);
+	char path[300];
+	snprintf(path, sizeof(path), "%s/%s", dir, CALIBRATION_FILE);
+	calibration_blob* blob = readFile(path);
+	if (blob == NULL) blob = readTextFiles(dir);
+	if (blob) {
+		install(blob);
+	} else if (!CALIBRATION_QUIET) {
+		fprintf(stderr, "Error Calibration: No calibration in %s, sensors are uncalibrated\n", dir);
+	}
+	pthread_mutex_unlock(&lock);
+	return blob != NULL;
+}
+
+int calibration_watch() {
+	pthread_mutex_lock(&lock);
+	if (!opened || watching.load()) {
+		pthread_mutex_unlock(&lock);
+		return watching.load();
+	}
+	watch_fd = inotify_init1(IN_CLOEXEC);
+	// Only a file renamed in place (calibration_write()) is complete when it shows up
+	if (watch_fd < 0 || inotify_add_watch(watch_fd, directory, IN_MOVED_TO) < 0) {
+		if (!CALIBRATION_QUIET) fprintf(stderr, "Error Calibration: Could not watch %s: %s\n",
+			directory, strerror(errno));
+		if (watch_fd >= 0) close(watch_fd);
+		watch_fd = -1;
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	watching.store(1);
+	if (pthread_create(&watcher, NULL, watch, NULL) != 0) {
+		watching.store(0);
+		close(watch_fd);
+		watch_fd = -1;
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&lock);
+	return 1;
+}
+
+void calibration_close() {
+	if (watching.exchange(0)) {
+		pthread_join(watcher, NULL);
+		close(watch_fd);
+		watch_fd = -1;
+	}
+	pthread_mutex_lock(&lock);
+	current.store(NULL, std::memory_order_release);
+	for (int i=0; i<CALIBRATION_RETIRED; i++) {
+		free(retired[i]);
+		retired[i] = NULL;
+	}
+	num_retired = 0;
+	free(active);
+	active = NULL;
+	opened = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+const calibration_entry* calibration_get(int sensor) {
+	const calibration_blob* blob = current.load(std::memory_order_acquire);
+	if (blob == NULL || sensor < 0 || sensor >= CALIB_SENSORS || !blob->sensors[sensor].valid) return NULL;
+	return &blob->sensors[sensor];
+}
+
+uint32_t calibration_generation() {
+	const calibration_blob* blob = current.load(std::memory_order_acquire);
+	return blob ? blob->generation : 0;
+}
+
+int calibration_write(int sensor, const Mat3x4& calib, const char* dir) {
+	if (sensor < 0 || sensor >= CALIB_SENSORS) return 0;
+	char path[300], temp[310];
+	snprintf(path, sizeof(path), "%s/%s", dir, CALIBRATION_FILE);
+	snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+	// Start from the current file, or the text files, so the other sensors are kept
+	calibration_blob blob;
+	calibration_blob* old = readFile(path);
+	if (old == NULL) old = readTextFiles(dir);
+	if (old) {
+		blob = *old;
+		free(old);
+	} else {
+		memset(&blob, 0, sizeof(blob));
+		memcpy(blob.magic, CALIBRATION_MAGIC, sizeof(blob.magic));
+		blob.version = CALIBRATION_VERSION;
+		blob.size = sizeof(calibration_blob);
+	}
+	calibration_entry* entry = &blob.sensors[sensor];
+	for (int i=0; i<3; i++) {
+		for (int j=0; j<3; j++) entry->matrix[i][j] = calib.data[i][j];
+		entry->offset[i] = calib.data[i][3];
+	}
+	entry->valid = 1;
+	blob.generation++;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	blob.written = (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+	blob.checksum = checksum(&blob);
+
+	int handle = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (handle < 0) {
+		if (!CALIBRATION_QUIET) fprintf(stderr, "Error Calibration: Could not write %s: %s\n", temp, strerror(errno));
+		return 0;
+	}
+	int ok = (write(handle, &blob, sizeof(blob)) == (ssize_t)sizeof(blob)) && fsync(handle) == 0;
+	close(handle);
+	if (!ok || rename(temp, path) != 0) {
+		if (!CALIBRATION_QUIET) fprintf(stderr, "Error Calibration: Could not write %s: %s\n", path, strerror(errno));
+		unlink(temp);
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,83 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Calibration store
+ * The calibration of every sensor in one versioned, checksummed binary file, read
+ * once into memory and shared by all drivers. A watcher thread (inotify) reads a
+ * replaced file, checks it and swaps it in with one atomic pointer store, so
+ * recalibrating on the bench reaches a running raptor without a restart.
+ *	calibration_open();								// Once, at startup
+ *	calibration_watch();							// Optional: hot reload
+ *	calibrated = calibration_correct(CALIB_ACCEL, 1, raw);	// Per sample
+ * calibration_write() writes a new file and renames it over the old one, so the watcher
+ * never sees half a file. Only such a rename is picked up: copy a new file next to it and
+ * mv it in place, don't write over it. Without a valid file the text files of the
+ * calibrator (accel.txt etc., 3x3 matrix then offset) are used instead.
+ * Don't keep an entry across samples: it is freed CALIBRATION_RETIRED reloads later.
+ */
+
+#ifndef _CALIBRATION_H
+#define _CALIBRATION_H
+
+#define CALIBRATION_QUIET 0
+#define CALIBRATION_DIR "calibrate"
+#define CALIBRATION_FILE "calibration.bin"
+#define CALIBRATION_MAGIC "RAPTCAL"		// 8 bytes with the terminating zero
+#define CALIBRATION_VERSION 1
+#define CALIBRATION_WATCH_INTERVAL 0.2	// How often the watcher checks for close() [s]
+#define CALIBRATION_RETIRED 64			// Replaced calibrations kept in memory for late readers
+
+// Sensors
+#define CALIB_ACCEL 0
+#define CALIB_GYRO 1
+#define CALIB_COMPASS 2
+#define CALIB_SENSORS 3
+
+#include <stdint.h>
+#include "matrix.h"
+
+struct calibration_entry {
+	uint32_t valid;				// 0 if the sensor has no calibration
+	float matrix[3][3];			// calibrated = matrix*raw + offset
+	float offset[3];
+};
+
+struct calibration_blob {
+	char magic[8];				// CALIBRATION_MAGIC
+	uint32_t version;			// CALIBRATION_VERSION
+	uint32_t size;				// sizeof(calibration_blob)
+	uint32_t generation;		// Incremented by every write
+	uint32_t checksum;			// CRC-32 of everything after this field
+	int64_t written;			// CLOCK_REALTIME of the write [ns]
+	calibration_entry sensors[CALIB_SENSORS];
+};
+
+// calibration_open(): Read dir/CALIBRATION_FILE, or the text files if there is no valid
+// one. Returns 1 if there is a calibration for any sensor, 0 if not. Later calls do nothing,
+// so every driver calls it from init() and the first one reads the file.
+int calibration_open(const char* dir = CALIBRATION_DIR);
+// calibration_watch(): Reload when the file is replaced. Returns 1 if watching, 0 if not.
+int calibration_watch();
+void calibration_close();
+// calibration_get(): Lock-free, any thread. NULL if the sensor is not calibrated.
+const calibration_entry* calibration_get(int sensor);
+uint32_t calibration_generation();		// Of the calibration in use, 0 for the text files
+// calibration_write(): Replace the calibration of one sensor in dir/CALIBRATION_FILE, the
+// others are kept. Returns 1 if successful, 0 if not.
+int calibration_write(int sensor, const Mat3x4& calib, const char* dir = CALIBRATION_DIR);
+
+static inline Vec3 calibration_apply(const calibration_entry* c, const Vec3& raw) {
+	Vec3 result;
+	for (int i=0; i<3; i++)
+		result[i] = c->matrix[i][0]*raw[0] + c->matrix[i][1]*raw[1] + c->matrix[i][2]*raw[2] + c->offset[i];
+	return result;
+}
+
+// calibration_correct(): raw with the current calibration of sensor applied, unchanged if
+// use is 0 or the sensor is not calibrated. Looked up on every call, so a reloaded
+// calibration takes effect from the next sample on.
+static inline Vec3 calibration_correct(int sensor, int use, const Vec3& raw) {
+	const calibration_entry* c = use ? calibration_get(sensor) : NULL;
+	return c ? calibration_apply(c, raw) : raw;
+}
+
+#endif
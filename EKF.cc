@@ -0,0 +1,217 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Extended Kalman filter for attitude, gyro bias and height
+ */
+
+#include <math.h>
+#include "EKF.h"
+#include "matrix.h"
+
+// State layout
+#define EKF_Q 0			// Quaternion w, x, y, z
+#define EKF_BIAS 4		// Gyro bias x, y, z
+#define EKF_H 7			// Height
+#define EKF_VZ 8		// Vertical velocity
+
+/********************
+ * PUBLIC FUNCTIONS
+ ********************/
+
+EKF::EKF() {
+	this->reset();
+}
+
+void EKF::reset() {
+	x = fvector<EKF_STATES>();
+	x[EKF_Q] = 1;
+	P = fmatrix<EKF_STATES,EKF_STATES>();
+	for (int i=EKF_Q; i<EKF_Q+4; i++) P(i,i) = 0.1f;
+	for (int i=EKF_BIAS; i<EKF_BIAS+3; i++) P(i,i) = EKF_BIAS_INIT*EKF_BIAS_INIT;
+	P(EKF_H,EKF_H) = 0.01f;
+	P(EKF_VZ,EKF_VZ) = 0.01f;
+	heading_age = EKF_HEADING_TIMEOUT;
+}
+
+void EKF::predict(const Vec3& gyro, const Vec3& accel, float dt) {
+	if (!(dt > 0)) return;
+	quaternion q = this->getAttitude();
+	float wx = gyro[0] - x[EKF_BIAS], wy = gyro[1] - x[EKF_BIAS+1], wz = gyro[2] - x[EKF_BIAS+2];
+	float h = 0.5f*dt;
+
+	// Xi(q): d(q * (0,w))/dw
+	float xi[4][3] = {
+		{-q.x, -q.y, -q.z},
+		{ q.w, -q.z,  q.y},
+		{ q.z,  q.w, -q.x},
+		{-q.y,  q.x,  q.w}};
+
+	// Jacobian, identity except for the attitude rows and the height/velocity pair
+	fmatrix<EKF_STATES,EKF_STATES> F = fmatrix<EKF_STATES,EKF_STATES>::identity();
+	float omega[4][4] = {
+		{  0, -wx, -wy, -wz},
+		{ wx,   0,  wz, -wy},
+		{ wy, -wz,   0,  wx},
+		{ wz,  wy, -wx,   0}};
+	for (int i=0; i<4; i++) {
+		for (int j=0; j<4; j++) F(EKF_Q+i,EKF_Q+j) += h*omega[i][j];
+		for (int j=0; j<3; j++) F(EKF_Q+i,EKF_BIAS+j) = -h*xi[i][j];
+	}
+	F(EKF_H,EKF_VZ) = dt;
+
+	// State: attitude from the unbiased rates, height from the vertical acceleration
+	quaternion dq = q * quaternion(0, wx, wy, wz);
+	x[EKF_Q]   += h*dq.w;
+	x[EKF_Q+1] += h*dq.x;
+	x[EKF_Q+2] += h*dq.y;
+	x[EKF_Q+3] += h*dq.z;
+	this->normalizeAttitude();
+	float az = (q.rotate(accel)[2] - 1) * EKF_GRAVITY;
+	x[EKF_H] += x[EKF_VZ]*dt + 0.5f*az*dt*dt;
+	x[EKF_VZ] += az*dt;
+
+	// Covariance: P = F*P*FT + Q
+	P = F * P * F.transposed();
+	float gyro_var = h*h*EKF_GYRO_NOISE*EKF_GYRO_NOISE;
+	for (int i=0; i<4; i++) {
+		for (int j=0; j<4; j++) {
+			float sum = 0;
+			for (int k=0; k<3; k++) sum += xi[i][k]*xi[j][k];
+			P(EKF_Q+i,EKF_Q+j) += gyro_var*sum;
+		}
+	}
+	for (int i=EKF_BIAS; i<EKF_BIAS+3; i++) P(i,i) += EKF_BIAS_NOISE*EKF_BIAS_NOISE*dt;
+	float vacc_var = EKF_VACC_NOISE*EKF_VACC_NOISE;
+	P(EKF_H,EKF_H) += 0.25f*dt*dt*dt*dt*vacc_var;
+	P(EKF_H,EKF_VZ) += 0.5f*dt*dt*dt*vacc_var;
+	P(EKF_VZ,EKF_H) += 0.5f*dt*dt*dt*vacc_var;
+	P(EKF_VZ,EKF_VZ) += dt*dt*vacc_var;
+	heading_age += dt;
+}
+
+void EKF::updateAccel(const Vec3& accel) {
+	float norm = accel.norm();
+	if (!(norm > 0)) return;
+	Vec3 a = accel * (1/norm);
+	static const unsigned int index[4] = {EKF_Q, EKF_Q+1, EKF_Q+2, EKF_Q+3};
+	// One scalar update per axis; each row of H only touches the quaternion.
+	// The prediction and H are re-evaluated at the state left by the previous axis.
+	for (int axis=0; axis<3; axis++) {
+		quaternion q = this->getAttitude();
+		Vec3 v = q.earth_z();
+		float h[4];
+		if (axis==0) {
+			h[0] = -2*q.y; h[1] =  2*q.z; h[2] = -2*q.w; h[3] = 2*q.x;
+		} else if (axis==1) {
+			h[0] =  2*q.x; h[1] =  2*q.w; h[2] =  2*q.z; h[3] = 2*q.y;
+		} else {
+			h[0] =  2*q.w; h[1] = -2*q.x; h[2] = -2*q.y; h[3] = 2*q.z;
+		}
+		this->scalarUpdate(index, h, 4, a[axis] - v[axis], EKF_ACCEL_NOISE*EKF_ACCEL_NOISE);
+	}
+	// Gravity says nothing about yaw, so yaw and the vertical part of the gyro bias
+	// are unobservable without a compass: their covariance grows without bound until
+	// float rounding makes P indefinite. A zero-innovation pseudo-measurement "yaw is
+	// where we think it is" bounds it without moving the state.
+	if (heading_age >= EKF_HEADING_TIMEOUT) this->updateYaw(0, EKF_HEADING_HOLD*EKF_HEADING_HOLD);
+	this->normalizeAttitude();
+}
+
+void EKF::updateHeading(float error) {
+	if (!(fabsf(error) <= (float)M_PI)) return;
+	this->updateYaw(error, EKF_HEADING_NOISE*EKF_HEADING_NOISE);
+	this->normalizeAttitude();
+	heading_age = 0;
+}
+
+void EKF::updateHeight(float height) {
+	static const unsigned int index[1] = {EKF_H};
+	static const float h[1] = {1};
+	this->scalarUpdate(index, h, 1, height - x[EKF_H], EKF_HEIGHT_NOISE*EKF_HEIGHT_NOISE);
+}
+
+quaternion EKF::getAttitude() const {
+	return quaternion(x[EKF_Q], x[EKF_Q+1], x[EKF_Q+2], x[EKF_Q+3]);
+}
+
+Vec3 EKF::getGyroBias() const {
+	return Vec3(x[EKF_BIAS], x[EKF_BIAS+1], x[EKF_BIAS+2]);
+}
+
+float EKF::getHeight() const {
+	return x[EKF_H];
+}
+
+float EKF::getVerticalVelocity() const {
+	return x[EKF_VZ];
+}
+
+/********************
+ * PRIVATE FUNCTIONS
+ ********************/
+
+void EKF::scalarUpdate(const unsigned int* index, const float* h, unsigned int nonzero,
+                       float innovation, float variance) {
+	// Joseph form P = (I-KH)P(I-KH)T + K*r*KT for a single measurement row.
+	// With PHt = P*hT and S = h*PHt + r, this expands to
+	//	P(i,j) -= K(i)*PHt(j) + u(i)*K(j) - r*K(i)*K(j),  u = PHt - K*(S-r)
+	// so no matrix inverse is needed and only the nonzero entries of h are visited.
+	const unsigned int n = EKF_STATES;
+	float PHt[EKF_STATES], K[EKF_STATES], u[EKF_STATES];
+	for (unsigned int i=0; i<n; i++) {
+		float sum = 0;
+		for (unsigned int k=0; k<nonzero; k++) sum += P(i,index[k]) * h[k];
+		PHt[i] = sum;
+	}
+	float S = variance;
+	for (unsigned int k=0; k<nonzero; k++) S += h[k] * PHt[index[k]];
+	if (!(S > 0)) return;
+	for (unsigned int i=0; i<n; i++) {
+		K[i] = PHt[i] / S;
+		u[i] = PHt[i] - K[i]*(S - variance);
+		x[i] += K[i]*innovation;
+	}
+	// Upper triangle only, mirrored, so P stays exactly symmetric
+	for (unsigned int i=0; i<n; i++) {
+		for (unsigned int j=i; j<n; j++) {
+			float p = P(i,j) - K[i]*PHt[j] - u[i]*K[j] + variance*K[i]*K[j];
+			P(i,j) = p;
+			P(j,i) = p;
+		}
+	}
+}
+
+void EKF::updateYaw(float innovation, float variance) {
+	// Small rotation dtheta (body) gives dq = 0.5*Xi(q)*dtheta, so the yaw part,
+	// i.e. dtheta along the earth z-axis v, is 2*(Xi(q)*v).dq.
+	quaternion q = this->getAttitude();
+	Vec3 v = q.earth_z();
+	static const unsigned int index[4] = {EKF_Q, EKF_Q+1, EKF_Q+2, EKF_Q+3};
+	float h[4] = {
+		2*(-q.x*v[0] - q.y*v[1] - q.z*v[2]),
+		2*( q.w*v[0] - q.z*v[1] + q.y*v[2]),
+		2*( q.z*v[0] + q.w*v[1] - q.x*v[2]),
+		2*(-q.y*v[0] + q.x*v[1] + q.w*v[2])};
+	this->scalarUpdate(index, h, 4, innovation, variance);
+}
+
+void EKF::normalizeAttitude() {
+	// Normalize the quaternion and take the covariance along: P = J*P*JT with
+	// J = I - q*qT on the attitude block. Without this the (unobservable) norm
+	// direction of P drifts in float and the filter eventually falls apart.
+	float scale = 1/sqrtf(x[EKF_Q]*x[EKF_Q] + x[EKF_Q+1]*x[EKF_Q+1]
+	                    + x[EKF_Q+2]*x[EKF_Q+2] + x[EKF_Q+3]*x[EKF_Q+3]);
+	for (int i=EKF_Q; i<EKF_Q+4; i++) x[i] *= scale;
+
+	// Rows: P(q,:) -= q * (qT*P(q,:))
+	for (int j=0; j<EKF_STATES; j++) {
+		float dot = 0;
+		for (int k=0; k<4; k++) dot += x[EKF_Q+k] * P(EKF_Q+k,j);
+		for (int k=0; k<4; k++) P(EKF_Q+k,j) -= x[EKF_Q+k] * dot;
+	}
+	// Columns: P(:,q) -= (P(:,q)*q) * qT
+	for (int i=0; i<EKF_STATES; i++) {
+		float dot = 0;
+		for (int k=0; k<4; k++) dot += P(i,EKF_Q+k) * x[EKF_Q+k];
+		for (int k=0; k<4; k++) P(i,EKF_Q+k) -= dot * x[EKF_Q+k];
+	}
+}
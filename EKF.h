@@ -0,0 +1,55 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Extended Kalman filter for attitude, gyro bias and height
+ * State: quaternion (4), gyro bias (3) [rad/s], height [m], vertical velocity [m/s]
+ */
+ 
+#ifndef _EKF_H
+#define _EKF_H
+
+#define EKF_STATES 9
+
+// NOISE SETTINGS (standard deviations)
+#define EKF_GYRO_NOISE 0.01      // Gyro white noise [rad/s]
+#define EKF_BIAS_NOISE 0.0005    // Gyro bias random walk [rad/s/sqrt(s)]
+#define EKF_ACCEL_NOISE 0.05     // Gravity direction measurement, per axis [g]
+#define EKF_VACC_NOISE 0.5       // Vertical acceleration [m/s^2]
+#define EKF_HEIGHT_NOISE 0.02    // Height measurement [m]
+#define EKF_HEADING_HOLD 0.1     // Yaw pseudo-measurement while nothing measures heading [rad]
+#define EKF_HEADING_NOISE 0.05   // Compass heading measurement [rad]
+#define EKF_HEADING_TIMEOUT 1.0  // Hold the yaw once the last heading is this old [s]
+#define EKF_BIAS_INIT 0.02       // Initial gyro bias uncertainty [rad/s]
+#define EKF_GRAVITY 9.81         // [m/s^2]
+
+#include "matrix.h"
+
+class EKF {
+	public:
+		EKF();
+		void reset();
+		// predict(): Propagate state and covariance: gyro [rad/s], accel [g], dt [s]
+		void predict(const Vec3& gyro, const Vec3& accel, float dt);
+		// updateAccel(): Correct the attitude with the measured gravity direction [g]
+		void updateAccel(const Vec3& accel);
+		// updateHeight(): Correct height/vertical velocity with a measured height [m]
+		void updateHeight(float height);
+		// updateHeading(): Correct the yaw with a measured heading error [rad], the rotation
+		// about the earth z-axis that takes the estimate to the measured heading
+		void updateHeading(float error);
+
+		quaternion getAttitude() const;
+		Vec3 getGyroBias() const;
+		float getHeight() const;
+		float getVerticalVelocity() const;
+	private:
+		fvector<EKF_STATES> x;
+		fmatrix<EKF_STATES,EKF_STATES> P;
+		// Scalar measurement z = h.x + noise, with h given by its nonzero entries
+		void scalarUpdate(const unsigned int* index, const float* h, unsigned int nonzero,
+		                  float innovation, float variance);
+		void normalizeAttitude();
+		float heading_age;		// Since the last heading measurement [s]
+		void updateYaw(float innovation, float variance);	// Rotation about the earth z-axis [rad]
+};
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Edge events of a GPIO line, through the character device /dev/gpiochipN
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include "GpioEdge.h"
+#include "Metrics.h"
+#include "timing.h"
+
+/********************
+ * PUBLIC FUNCTIONS
+ ********************/
+
+GpioEdge::GpioEdge() {
+	fd = -1;
+	owned = 0;
+	edges = 0;
+}
+
+GpioEdge::~GpioEdge() {
+	this->close();
+}
+
+int GpioEdge::open(int chip, int line) {
+	if (this->fd >= 0) return 0;	// Already open
+	char filename[32];
+	snprintf(filename, sizeof(filename), "/dev/gpiochip%d", chip);
+	int chipfd = ::open(filename, O_RDONLY | O_CLOEXEC);
+	if (chipfd < 0) {
+		if (!GPIOEDGE_QUIET) fprintf(stderr, "Error GpioEdge: Could not open `%s': %s\n", filename, strerror(errno));
+		return 0;
+	}
+
+	// The line comes back as a descriptor of its own, the chip is not needed after that
+	struct gpioevent_request request;
+	memset(&request, 0, sizeof(request));
+	request.lineoffset = line;
+	request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+	request.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+	strncpy(request.consumer_label, GPIOEDGE_CONSUMER, sizeof(request.consumer_label) - 1);
+	int res = ioctl(chipfd, GPIO_GET_LINEEVENT_IOCTL, &request);
+	int error = errno;
+	::close(chipfd);
+	if (res < 0) {
+		if (!GPIOEDGE_QUIET) {
+			fprintf(stderr, "Error GpioEdge: Could not request edge events on line %d of `%s': %s\n",
+				line, filename, strerror(error));
+			if (error == EBUSY) fprintf(stderr, "Error GpioEdge: Is the line exported in sysfs or used by a driver?\n");
+		}
+		return 0;
+	}
+	if (!this->attach(request.fd)) {
+		::close(request.fd);
+		return 0;
+	}
+	this->owned = 1;
+	return 1;
+}
+
+int GpioEdge::attach(int fd) {
+	if (this->fd >= 0 || fd < 0) return 0;
+	// Non-blocking, so wait() can empty the queue without getting stuck on the last read
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		if (!GPIOEDGE_QUIET) fprintf(stderr, "Error GpioEdge: Could not make the event descriptor non-blocking: %s\n",
+			strerror(errno));
+		return 0;
+	}
+	this->fd = fd;
+	this->owned = 0;
+	return 1;
+}
+
+void GpioEdge::close() {
+	if (this->fd >= 0 && this->owned) ::close(this->fd);
+	this->fd = -1;
+	this->owned = 0;
+}
+
+int GpioEdge::wait(int timeout_ms, uint64_t* timestamp) {
+	if (this->fd < 0) return -1;
+	struct pollfd p;
+	p.fd = this->fd;
+	p.events = POLLIN | POLLPRI;
+	p.revents = 0;
+	int res;
+	while ((res = poll(&p, 1, timeout_ms)) < 0 && errno == EINTR) {}
+	if (res < 0 || (p.revents & (POLLERR | POLLHUP | POLLNVAL) && !(p.revents & POLLIN))) return -1;
+	if (res == 0) return 0;
+
+	// Everything queued in one read: a slow reader gets the newest edge, not the oldest
+	struct gpioevent_data events[GPIOEDGE_BATCH];
+	int n = 0;
+	uint64_t newest = 0;
+	for (;;) {
+		ssize_t length = read(this->fd, events, sizeof(events));
+		if (length < 0 && errno == EINTR) continue;
+		if (length <= 0) break;
+		int count = length / sizeof(struct gpioevent_data);
+		for (int i=0; i<count; i++) {
+			if (events[i].id != GPIOEVENT_EVENT_RISING_EDGE) continue;
+			newest = events[i].timestamp;
+			n++;
+		}
+		if (length < (ssize_t)sizeof(events)) break;
+	}
+	if (n == 0) return 0;		// Woken up without a rising edge, same as a timeout
+
+	// Kernels before 5.7 stamp with CLOCK_REALTIME: then the time we read it is the best we have
+	uint64_t now = monotonic_ns();
+	if (newest > now || now - newest > GPIOEDGE_CLOCK_SLACK) newest = now;
+	*timestamp = newest;
+	this->edges += n;
+	metrics_count(METRIC_GPIO_EDGES, n);
+	if (n > 1) metrics_count(METRIC_GPIO_MISSED, n - 1);
+	return n;
+}
+
+int GpioEdge::getFd() const {
+	return this->fd;
+}
+
+unsigned long GpioEdge::getEdges() const {
+	return this->edges;
+}
@@ -0,0 +1,48 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Edge events of a GPIO line, through the character device /dev/gpiochipN
+ * The kernel timestamps every edge in the interrupt handler and queues it on a file
+ * descriptor, so a sensor's data-ready line can be waited on with poll() instead of
+ * polling the sensor over i2c, and the sample stamped with when it was converted:
+ *	GpioEdge drdy;
+ *	drdy.open(0, 17);
+ *	uint64_t edge;
+ *	if (drdy.wait(10, &edge) > 0) ... read the sample, it belongs to 'edge'
+ * attach() takes the same events from any other descriptor, e.g. the pipe of a
+ * simulated sensor (I2CSimEdge in I2CSim.h).
+ */
+
+#ifndef _GPIOEDGE_H
+#define _GPIOEDGE_H
+
+#define GPIOEDGE_QUIET 0
+#define GPIOEDGE_CONSUMER "raptor"		// Label of the requested line, shown by gpioinfo
+#define GPIOEDGE_BATCH 16				// Events taken from the kernel per read()
+#define GPIOEDGE_CLOCK_SLACK 1000000000ull	// Timestamps further from CLOCK_MONOTONIC are not trusted [ns]
+
+#include <stdint.h>
+
+class GpioEdge {
+	public:
+		GpioEdge();
+		~GpioEdge();
+		// open(): Request rising edge events on a line of /dev/gpiochip<chip>. Returns 1 if
+		// successful, 0 if not.
+		int open(int chip, int line);
+		// attach(): Read events (struct gpioevent_data, see linux/gpio.h) from fd instead.
+		// The descriptor stays owned by the caller and is made non-blocking.
+		int attach(int fd);
+		void close();
+		// wait(): Block until the next rising edge, at most timeout_ms (-1: forever). Edges
+		// queued in the meantime are taken at once: the newest one's time goes in timestamp
+		// [ns, CLOCK_MONOTONIC]. Returns the number of edges taken, 0 on timeout, -1 on error.
+		int wait(int timeout_ms, uint64_t* timestamp);
+		int getFd() const;				// For epoll() together with other descriptors, -1 if closed
+		unsigned long getEdges() const;
+	private:
+		int fd;
+		int owned;						// fd is ours to close
+		unsigned long edges;
+};
+
+#endif
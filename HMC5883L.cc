@@ -0,0 +1,225 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * HMC5883L magnetometer driver (i2c)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "HMC5883L.h"
+#include "Calibration.h"
+#include "I2CBus.h"
+#include "matrix.h"
+#include "Metrics.h"
+#include "timing.h"
+
+/********************
+ * PUBLIC FUNCTIONS
+ ********************/
+
+HMC5883L_COMPASS::HMC5883L_COMPASS() {
+	bus = NULL;
+	rate = 0;
+	scale = 0;
+	next_due = 0;
+	memset(last, 0, sizeof(last));
+	use_calibration = 1;
+	read_mode = HMC5883L_READ_WORD;
+	queue_status = 0;
+	queue_data_status = 0;
+}
+
+HMC5883L_COMPASS::~HMC5883L_COMPASS() {
+	if (this->bus) this->bus->release();
+}
+
+int HMC5883L_COMPASS::init(int i2c_bus) {
+	// Try to open the i2c bus and connect to the sensor
+	// To verify communication, the identification registers (0x0A-0x0C) are read, "H43"
+
+	// Return: 1 if successful, 0 if not
+
+	if (this->bus) return 0; // Already init
+	this->bus = I2CBus::open(i2c_bus);
+	if (!this->bus) return 0;
+
+	if (this->bus->setSlave(HMC5883L_ADDRESS, HMC5883L_FORCE) < 0) {
+		if (!HMC5883L_QUIET) {
+			fprintf(stderr, "Error HMC5883L: Could not set address to 0x%02x\n", HMC5883L_ADDRESS);
+		}
+		this->bus->release();
+		this->bus = NULL;
+		return 0;
+	}
+
+	for (int i=0; i<3; i++) {
+		int res = this->bus->readByte(HMC5883L_ADDRESS, HMC5883L_IDENT + i);
+		if (res != HMC5883L_ID[i]) {
+			if (!HMC5883L_QUIET) {
+				if (res < 0) fprintf(stderr, "Error HMC5883L: Reading the identification (address 0x%02x) failed\n",
+					HMC5883L_IDENT + i);
+				else fprintf(stderr, "Error HMC5883L: Identification does not match. Read 0x%02x at 0x%02x, should be 0x%02x.\n",
+					res, HMC5883L_IDENT + i, HMC5883L_ID[i]);
+			}
+			this->bus->release();
+			this->bus = NULL;
+			return 0;
+		}
+	}
+
+	// Status and data in one transaction if the adapter can
+	this->read_mode = this->bus->supportsBurst() ? HMC5883L_READ_BURST : HMC5883L_READ_WORD;
+
+	this->setGain(HMC5883L_DEFAULT_GAIN);
+	this->setRate(HMC5883L_DEFAULT_RATE);
+	if (this->writeByte(HMC5883L_MODE, 0x00) < 0) {	// Continuous measurement
+		this->bus->release();
+		this->bus = NULL;
+		return 0;
+	}
+	calibration_open();
+	return 1;
+}
+
+int HMC5883L_COMPASS::getMeasurement(Vec3* measurement) {
+	if (!this->bus) return -1;	// Not connected to sensor
+	uint64_t start = monotonic_ns();
+	if (start < this->next_due) return 0;
+
+	unsigned char buffer[1 + HMC5883L_DATA_LENGTH];
+	int res = this->readData(buffer) ? this->accept(buffer, measurement) : -1;
+	metrics_latency(METRIC_LAT_HMC5883L, monotonic_ns() - start);
+	metrics_count(METRIC_HMC5883L_READS);
+	if (res < 0) {
+		metrics_count(METRIC_HMC5883L_ERRORS);
+		if (!HMC5883L_QUIET) metrics_log("Error HMC5883L: Could not read the data registers on the sensor.");
+	}
+	return res;
+}
+
+int HMC5883L_COMPASS::queueMeasurement() {
+	if (!this->bus || this->read_mode != HMC5883L_READ_BURST) return 0;
+	if (monotonic_ns() < this->next_due) return 0;
+	// Status first: it belongs to the data read right after it
+	if (!this->bus->queueRead(HMC5883L_ADDRESS, HMC5883L_STATUS, this->queue_buffer, 1, &this->queue_status))
+		return 0;
+	return this->bus->queueRead(HMC5883L_ADDRESS, HMC5883L_DATA,
+		this->queue_buffer + 1, HMC5883L_DATA_LENGTH, &this->queue_data_status);
+}
+
+int HMC5883L_COMPASS::getQueuedMeasurement(Vec3* measurement) {
+	int status = this->queue_status;
+	int data_status = this->queue_data_status;
+	this->queue_status = this->queue_data_status = 0;
+	if (status == 0) return 0;		// Not flushed yet
+	metrics_count(METRIC_HMC5883L_READS);
+	int res = (status > 0 && data_status > 0) ? this->accept(this->queue_buffer, measurement) : -1;
+	if (res < 0) {
+		metrics_count(METRIC_HMC5883L_ERRORS);
+		if (!HMC5883L_QUIET) metrics_log("Error HMC5883L: Could not read the data registers on the sensor.");
+	}
+	return res;
+}
+
+void HMC5883L_COMPASS::setRate(float rate) {
+	static const float rates[7] = {0.75f, 1.5f, 3, 7.5f, 15, 30, 75};
+	static const int averaging[4] = {1, 2, 4, 8};
+	int rateBin = -1, averagingBin = 0;
+	for (int i=0; i<7; i++)
+		if (rates[i] == rate) rateBin = i;
+	if (rateBin < 0) return;
+	for (int i=0; i<4; i++)
+		if (averaging[i] == HMC5883L_DEFAULT_AVERAGING) averagingBin = i;
+	// Normal measurement, no bias current
+	if (this->writeByte(HMC5883L_CONFIG_A, (averagingBin<<5) | (rateBin<<2)) < 0) return;
+	this->rate = rate;
+	this->next_due = 0;
+}
+
+float HMC5883L_COMPASS::getRate() const {
+	return this->rate;
+}
+
+void HMC5883L_COMPASS::setGain(float range) {
+	static const float ranges[8] = {0.88f, 1.3f, 1.9f, 2.5f, 4.0f, 4.7f, 5.6f, 8.1f};
+	static const int resolution[8] = {1370, 1090, 820, 660, 440, 390, 330, 230};	// LSB/gauss
+	int gainBin = -1;
+	for (int i=0; i<8; i++)
+		if (ranges[i] == range) gainBin = i;
+	if (gainBin < 0) return;
+	if (this->writeByte(HMC5883L_CONFIG_B, gainBin<<5) < 0) return;
+	// The first sample after a gain change still has the old gain
+	this->scale = 1.0f / resolution[gainBin];
+}
+
+int HMC5883L_COMPASS::decode(const unsigned char* buffer, Vec3* measurement) {
+	if (!(this->scale>0)) return 0;		// No valid gain
+
+	// X, Z, Y, each 16 bit two's complement, MSB first
+	int x = (int16_t)((buffer[0]<<8) | buffer[1]);
+	int z = (int16_t)((buffer[2]<<8) | buffer[3]);
+	int y = (int16_t)((buffer[4]<<8) | buffer[5]);
+	if (x == HMC5883L_OVERFLOW || y == HMC5883L_OVERFLOW || z == HMC5883L_OVERFLOW) return 0;
+
+	Vec3 data(x*this->scale, y*this->scale, z*this->scale);
+	*measurement = calibration_correct(CALIB_COMPASS, this->use_calibration, data);
+	return 1;
+}
+
+/********************
+ * PRIVATE FUNCTIONS
+ ********************/
+
+int HMC5883L_COMPASS::writeByte(int reg, unsigned char data) {
+	if (!this->bus) return -1;	// Not connected to sensor
+	int res = this->bus->writeByte(HMC5883L_ADDRESS, reg, data);
+	if (res<0) {
+		if (!HMC5883L_QUIET) {
+			fprintf(stderr,
+				"Error HMC5883L: Could not write some data register (0x%02x) on the sensor.\n",
+				reg);
+		}
+		return -1;
+	}
+	return 1;
+}
+
+int HMC5883L_COMPASS::readData(unsigned char* buffer) {
+	// Status into buffer[0], then the data behind it unless the chip is writing a new sample.
+	// Returns 1 on success, 0 if not.
+	int status = this->bus->readByte(HMC5883L_ADDRESS, HMC5883L_STATUS);
+	if (status < 0) return 0;
+	buffer[0] = status;
+	if (!(status & 0x01)) return 1;
+	if (this->read_mode == HMC5883L_READ_BURST) {
+		return (this->bus->readBlock(HMC5883L_ADDRESS, HMC5883L_DATA, buffer + 1, HMC5883L_DATA_LENGTH)
+			== HMC5883L_DATA_LENGTH);
+	}
+	// Per-word fallback: the lock bit holds the sample until all six bytes are read
+	for (int i=0; i<3; i++) {
+		int word = this->bus->readWord(HMC5883L_ADDRESS, HMC5883L_DATA + 2*i);
+		if (word<0) return 0;
+		buffer[1 + 2*i] = word & 0xFF;			// The byte at the register, here the MSB
+		buffer[1 + 2*i + 1] = (word>>8) & 0xFF;
+	}
+	return 1;
+}
+
+int HMC5883L_COMPASS::accept(const unsigned char* buffer, Vec3* measurement) {
+	// Ready and different from the last sample read: a new one. The noise of the chip
+	// makes a repeat of all six bytes unlikely, and dropping a real one costs nothing.
+	if (!(buffer[0] & 0x01) || memcmp(buffer + 1, this->last, HMC5883L_DATA_LENGTH) == 0) {
+		metrics_count(METRIC_HMC5883L_STALE);
+		return 0;
+	}
+	memcpy(this->last, buffer + 1, HMC5883L_DATA_LENGTH);
+	if (this->rate > 0) this->next_due = monotonic_ns() + (uint64_t)(HMC5883L_POLL_EARLY * 1e9 / this->rate);
+	if (!this->decode(buffer + 1, measurement)) {
+		// Read fine, but saturated: not a bus error, the gain is too high for this field
+		metrics_count(METRIC_HMC5883L_OVERFLOWS);
+		if (!HMC5883L_QUIET) metrics_log("Warning HMC5883L: Field out of range, lower the gain (setGain()).");
+		return 0;
+	}
+	return 1;
+}
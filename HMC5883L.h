@@ -0,0 +1,85 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * HMC5883L magnetometer driver (i2c)
+ * Runs in continuous mode: the chip measures on its own at the output rate and the
+ * driver only reads when a new sample is due. Queued, the status and all six data
+ * bytes go out in the same transaction as the other sensors' reads.
+ * The status register cannot tell a new sample from one already read: RDY only drops
+ * while the chip writes a new one. So a read is skipped until a sample is due, a read
+ * with RDY low is skipped, and a read identical to the last one is taken as stale.
+ */
+
+#ifndef _HMC5883L_H
+#define _HMC5883L_H
+
+#define HMC5883L_QUIET 0			// Should we shut up if we screw up?
+#define HMC5883L_FORCE 0			// Force use of i2c bus even if device driver is running?
+#define HMC5883L_ADDRESS 0x1E		// Address of the sensor on the bus, hardcoded in chip
+#define HMC5883L_ID "H43"			// Identification registers A, B, C
+
+// Registers
+#define HMC5883L_CONFIG_A 0x00		// Averaging (bits 6:5), output rate (bits 4:2), bias (bits 1:0)
+#define HMC5883L_CONFIG_B 0x01		// Gain (bits 7:5)
+#define HMC5883L_MODE 0x02			// 0: continuous, 1: single, 2/3: idle
+#define HMC5883L_DATA 0x03			// X, Z, Y (sic), MSB first
+#define HMC5883L_STATUS 0x09		// Bit 1: lock, bit 0: ready
+#define HMC5883L_IDENT 0x0A
+
+#define HMC5883L_DATA_LENGTH 6
+#define HMC5883L_OVERFLOW -4096		// Value of an axis out of range for the gain
+
+// How the data registers are read, picked in init() from what the adapter supports
+#define HMC5883L_READ_BURST 1		// Data in one transaction (I2C_RDWR or SMBus block), queued with the status
+#define HMC5883L_READ_WORD 0		// Status byte and three SMBus word reads, basic adapters
+
+#define HMC5883L_DEFAULT_RATE 75		// Output rate [Hz]: 0.75, 1.5, 3, 7.5, 15, 30 or 75
+#define HMC5883L_DEFAULT_GAIN 1.3		// Range [gauss]: 0.88, 1.3, 1.9, 2.5, 4.0, 4.7, 5.6 or 8.1
+#define HMC5883L_DEFAULT_AVERAGING 8	// Measurements averaged per output sample: 1, 2, 4 or 8
+#define HMC5883L_POLL_EARLY 0.9			// Poll this fraction of a period after the last sample
+
+#include <stdint.h>
+#include "matrix.h"
+#include "I2CBus.h"
+
+class HMC5883L_COMPASS {
+	public:
+		HMC5883L_COMPASS();
+		~HMC5883L_COMPASS();
+		// init(): Open connection, test, start continuous measurement at the default rate, gain
+		// and averaging. Always call before doing other things
+		int init(int i2c_bus);
+		// getMeasurement(): Read the field [gauss] if a new sample is there. Returns 1 if so, 0 if
+		// there is none yet (no bus traffic before one is due) or it overflowed, -1 on a bus error
+		int getMeasurement(Vec3* measurement);
+		// queueMeasurement(): Add the status and data reads to the bus queue, so they go out with
+		// other devices on the next I2CBus::flush(). Then call getQueuedMeasurement(). Returns 0 if
+		// nothing was queued: no sample due yet, or HMC5883L_READ_WORD (use getMeasurement() then)
+		int queueMeasurement();
+		int getQueuedMeasurement(Vec3* measurement);
+		// setRate(): Output rate [Hz], one of the HMC5883L_DEFAULT_RATE values
+		void setRate(float rate);
+		float getRate() const;
+		// setGain(): Range [gauss], one of the HMC5883L_DEFAULT_GAIN values. Avoid overflow!
+		void setGain(float range);
+		// decode(): Convert HMC5883L_DATA_LENGTH raw bytes, as read from HMC5883L_DATA, to [gauss],
+		// calibrated if use_calibration is set. Returns 1 if successful, 0 on overflow.
+		int decode(const unsigned char* buffer, Vec3* measurement);
+
+		// Variables:
+		int use_calibration;
+		int read_mode;			// HMC5883L_READ_*, may be lowered to force a slower path
+	private:
+		I2CBus* bus;						// Shared bus, NULL if not connected
+		float rate;
+		float scale;						// [gauss] per LSB, depends on the gain
+		uint64_t next_due;					// Earliest poll for the next sample [ns]
+		unsigned char last[HMC5883L_DATA_LENGTH];	// Raw bytes of the last sample
+		int writeByte(int reg, unsigned char data);
+		int readData(unsigned char* buffer);	// Status, then data if ready. 0 on failure
+		int accept(const unsigned char* buffer, Vec3* measurement);	// Status and data: 1, or 0 if stale or overflowed
+		unsigned char queue_buffer[1 + HMC5883L_DATA_LENGTH];		// Status, data
+		int queue_status;			// Of the status read
+		int queue_data_status;
+};
+
+#endif
@@ -0,0 +1,302 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Shared i2c bus: one file descriptor per /dev/i2c-N for all drivers on it
+ */
+
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev-user.h>
+#include "I2CBus.h"
+#include "Metrics.h"
+#include "timing.h"
+
+I2CBus* I2CBus::buses[I2CBUS_MAX_BUSES];
+
+/********************
+ * PUBLIC FUNCTIONS
+ ********************/
+
+I2CBus* I2CBus::open(int i2c_bus) {
+	if (i2c_bus < 0 || i2c_bus >= I2CBUS_MAX_BUSES) {
+		if (!I2CBUS_QUIET) fprintf(stderr, "Error I2CBus: Bus number %d out of range\n", i2c_bus);
+		return NULL;
+	}
+	if (buses[i2c_bus]) {
+		buses[i2c_bus]->users++;
+		return buses[i2c_bus];
+	}
+	I2CLinux* backend = I2CLinux::open(i2c_bus);
+	if (!backend) return NULL;
+	buses[i2c_bus] = new I2CBus(i2c_bus, backend);
+	return buses[i2c_bus];
+}
+
+I2CBus* I2CBus::attach(int i2c_bus, I2CBackend* backend) {
+	if (i2c_bus < 0 || i2c_bus >= I2CBUS_MAX_BUSES || buses[i2c_bus]) {
+		if (!I2CBUS_QUIET) fprintf(stderr, "Error I2CBus: Cannot attach a backend to bus %d\n", i2c_bus);
+		delete backend;
+		return NULL;
+	}
+	buses[i2c_bus] = new I2CBus(i2c_bus, backend);
+	return buses[i2c_bus];
+}
+
+void I2CBus::release() {
+	if (--this->users > 0) return;
+	buses[this->bus] = NULL;
+	delete this;
+}
+
+int I2CBus::number() const {
+	return this->bus;
+}
+
+int I2CBus::supportsBurst() const {
+	return (this->funcs & (I2C_FUNC_I2C | I2C_FUNC_SMBUS_READ_I2C_BLOCK)) != 0;
+}
+
+int I2CBus::maxBurst() const {
+	if (this->funcs & I2C_FUNC_I2C) return 0xFFFF;		// i2c_msg.len
+	if (this->funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK) return I2C_SMBUS_BLOCK_MAX;
+	return 0;
+}
+
+int I2CBus::setSlave(int address, int force) {
+	if (address == this->slave && force == this->slave_force) return 1;
+	if (this->backend->setSlave(address, force) < 0) {
+		this->slave = -1;
+		return -1;
+	}
+	this->slave = address;
+	this->slave_force = force;
+	return 1;
+}
+
+int I2CBus::readByte(int address, int reg) {
+	uint64_t start = monotonic_ns();
+	int res = -1;
+	if (this->setSlave(address, this->slave_force) >= 0) res = this->backend->readByteData(reg);
+	return this->account(start, (res < 0) ? -1 : res);
+}
+
+int I2CBus::writeByte(int address, int reg, unsigned char data) {
+	uint64_t start = monotonic_ns();
+	int res = -1;
+	if (this->setSlave(address, this->slave_force) >= 0) res = this->backend->writeByteData(reg, data);
+	return this->account(start, (res < 0) ? -1 : 1);
+}
+
+int I2CBus::readWord(int address, int reg) {
+	uint64_t start = monotonic_ns();
+	int res = -1;
+	if (this->setSlave(address, this->slave_force) >= 0) res = this->backend->readWordData(reg);
+	return this->account(start, (res < 0) ? -1 : res);
+}
+
+int I2CBus::readBlock(int address, int reg, unsigned char* buffer, int length) {
+	uint64_t start = monotonic_ns();
+	if (this->funcs & I2C_FUNC_I2C) {
+		// Write the register address, repeated start, read everything
+		unsigned char r = reg;
+		struct i2c_msg msgs[2];
+		msgs[0].addr = address;
+		msgs[0].flags = 0;
+		msgs[0].len = 1;
+		msgs[0].buf = &r;
+		msgs[1].addr = address;
+		msgs[1].flags = I2C_M_RD;
+		msgs[1].len = length;
+		msgs[1].buf = buffer;
+		return this->account(start, (this->backend->transfer(msgs, 2) == 2) ? length : -1);
+	}
+	if ((this->funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK) && length <= I2C_SMBUS_BLOCK_MAX) {
+		int res = -1;
+		if (this->setSlave(address, this->slave_force) >= 0) res = this->backend->readBlockData(reg, length, buffer);
+		return this->account(start, (res == length) ? length : -1);
+	}
+	return -1;	// No burst support, caller has to fall back to smaller reads
+}
+
+int I2CBus::write(int address, const unsigned char* data, int length) {
+	uint64_t start = monotonic_ns();
+	int res = -1;
+	if (this->setSlave(address, this->slave_force) >= 0) res = this->backend->write(data, length);
+	return this->account(start, (res == length) ? length : -1);
+}
+
+int I2CBus::generalCall(int reg, unsigned char data) {
+	// Acked if at least one device listens
+	return this->writeByte(I2C_GENERAL_CALL, reg, data);
+}
+
+int I2CBus::queueRead(int address, int reg, unsigned char* buffer, int length, int* status) {
+	if (this->queued >= I2CBUS_MAX_QUEUE) return 0;
+	int n = this->queued;
+	this->queue_regs[n] = reg;
+	struct i2c_msg* msgs = this->queue_msgs + 2*n;
+	msgs[0].addr = address;
+	msgs[0].flags = 0;
+	msgs[0].len = 1;
+	msgs[0].buf = this->queue_regs + n;
+	msgs[1].addr = address;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len = length;
+	msgs[1].buf = buffer;
+	this->queue_status[n] = status;
+	if (status) *status = 0;
+	this->queued++;
+	return 1;
+}
+
+int I2CBus::flush() {
+	int n = this->queued;
+	if (n == 0) return 0;
+	this->queued = 0;
+	uint64_t start = monotonic_ns();
+	metrics_count(METRIC_I2C_FLUSHES);
+	
+	if (this->funcs & I2C_FUNC_I2C) {
+		// Everything in one go
+		int res = this->account(start, (this->backend->transfer(this->queue_msgs, 2*n) == 2*n) ? n : -1);
+		if (res == n) {
+			for (int i=0; i<n; i++)
+				if (this->queue_status[i]) *this->queue_status[i] = 1;
+			metrics_latency(METRIC_LAT_I2C_FLUSH, monotonic_ns() - start);
+			return n;
+		}
+	}
+	// Batch failed (one device NAKed?) or no I2C_RDWR: do them one by one so only
+	// the culprit fails
+	int succeeded = 0;
+	for (int i=0; i<n; i++) {
+		struct i2c_msg* msgs = this->queue_msgs + 2*i;
+		int res = this->readBlock(msgs[0].addr, this->queue_regs[i], msgs[1].buf, msgs[1].len);
+		if (res > 0) succeeded++;
+		if (this->queue_status[i]) *this->queue_status[i] = (res > 0) ? 1 : -1;
+	}
+	metrics_latency(METRIC_LAT_I2C_FLUSH, monotonic_ns() - start);
+	return succeeded;
+}
+
+/********************
+ * PRIVATE FUNCTIONS
+ ********************/
+
+int I2CBus::account(uint64_t start, int res) {
+	metrics_latency(METRIC_LAT_I2C, monotonic_ns() - start);
+	metrics_count(METRIC_I2C_TRANSACTIONS);
+	if (res < 0) metrics_count(METRIC_I2C_ERRORS);
+	return res;
+}
+
+I2CBus::I2CBus(int i2c_bus, I2CBackend* backend) {
+	this->bus = i2c_bus;
+	this->backend = backend;
+	this->users = 1;
+	this->slave = -1;
+	this->slave_force = 0;
+	this->queued = 0;
+	this->funcs = backend->functionality();
+}
+
+I2CBus::~I2CBus() {
+	delete this->backend;
+}
+
+/********************
+ * I2CLinux backend
+ ********************/
+
+I2CLinux* I2CLinux::open(int i2c_bus) {
+	char filename[20];
+	snprintf(filename, 20, "/dev/i2c/%d", i2c_bus);
+	filename[19] = '\0';
+
+	// Find the correct file and open it
+	int handle = ::open(filename, O_RDWR);
+
+	if (handle < 0 && (errno == ENOENT || errno == ENOTDIR)) {
+		sprintf(filename, "/dev/i2c-%d", i2c_bus);
+		handle = ::open(filename, O_RDWR);
+	}
+
+	if (handle < 0) {
+		if (!I2CBUS_QUIET) {
+			if (errno == ENOENT) {
+				fprintf(stderr, "Error I2CBus: Could not open handle "
+					"`/dev/i2c-%d' or `/dev/i2c/%d': %s\n",
+					i2c_bus, i2c_bus, strerror(ENOENT));
+			} else {
+				fprintf(stderr, "Error I2CBus: Could not open handle "
+					"`%s': %s\n", filename, strerror(errno));
+				if (errno == EACCES)
+					fprintf(stderr, "Run as root?\n");
+			}
+		}
+		return NULL;
+	}
+	return new I2CLinux(handle);
+}
+
+I2CLinux::I2CLinux(int handle) {
+	this->handle = handle;
+}
+
+I2CLinux::~I2CLinux() {
+	close(this->handle);
+}
+
+unsigned long I2CLinux::functionality() {
+	unsigned long funcs = 0;
+	if (ioctl(this->handle, I2C_FUNCS, &funcs) < 0) return 0;
+	return funcs;
+}
+
+int I2CLinux::setSlave(int address, int force) {
+	/* With force, let the user read from/write to the registers
+	   even when a driver is also running */
+	if (ioctl(this->handle, force ? I2C_SLAVE_FORCE : I2C_SLAVE, address) < 0) {
+		if (!I2CBUS_QUIET) {
+			fprintf(stderr,
+				"Error I2CBus: Could not set address to 0x%02x: %s\n",
+				address, strerror(errno));
+		}
+		return -1;
+	}
+	return 1;
+}
+
+int I2CLinux::readByteData(int reg) {
+	int res = i2c_smbus_read_byte_data(this->handle, reg);
+	return (res < 0) ? -1 : res;
+}
+
+int I2CLinux::writeByteData(int reg, unsigned char value) {
+	return (i2c_smbus_write_byte_data(this->handle, reg, value) < 0) ? -1 : 1;
+}
+
+int I2CLinux::readWordData(int reg) {
+	int res = i2c_smbus_read_word_data(this->handle, reg);
+	return (res < 0) ? -1 : res;
+}
+
+int I2CLinux::readBlockData(int reg, int length, unsigned char* buffer) {
+	return i2c_smbus_read_i2c_block_data(this->handle, reg, length, buffer);
+}
+
+int I2CLinux::write(const unsigned char* data, int length) {
+	return ::write(this->handle, data, length);
+}
+
+int I2CLinux::transfer(struct i2c_msg* msgs, int count) {
+	struct i2c_rdwr_ioctl_data rdwr;
+	rdwr.msgs = msgs;
+	rdwr.nmsgs = count;
+	return ioctl(this->handle, I2C_RDWR, &rdwr);
+}
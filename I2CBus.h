@@ -0,0 +1,97 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Shared i2c bus: one file descriptor per /dev/i2c-N for all drivers on it
+ */
+ 
+#ifndef _I2CBUS_H
+#define _I2CBUS_H
+
+#define I2CBUS_QUIET 0			// Should we shut up if we screw up?
+#define I2CBUS_MAX_BUSES 8		// Highest bus number + 1 we can open
+#define I2CBUS_MAX_QUEUE 16		// Queued transactions per flush(), 2 messages each (kernel limit is 42)
+#define I2C_GENERAL_CALL 0x00	// Broadcast address, written by every device that listens to it
+
+#include <stdint.h>
+#include <linux/i2c.h>
+
+// The kernel calls the bus needs. I2CLinux talks to /dev/i2c-N, I2CSim (I2CSim.h)
+// runs register models of our sensors in-process.
+class I2CBackend {
+	public:
+		virtual ~I2CBackend() {}
+		virtual unsigned long functionality() = 0;				// I2C_FUNC_* of the adapter
+		virtual int setSlave(int address, int force) = 0;		// Target of the calls below, -1 on failure
+		virtual int readByteData(int reg) = 0;					// SMBus calls, -1 on failure
+		virtual int writeByteData(int reg, unsigned char value) = 0;
+		virtual int readWordData(int reg) = 0;
+		virtual int readBlockData(int reg, int length, unsigned char* buffer) = 0;	// Returns length
+		virtual int write(const unsigned char* data, int length) = 0;		// Plain i2c write
+		virtual int transfer(struct i2c_msg* msgs, int count) = 0;			// I2C_RDWR, returns count
+};
+
+class I2CLinux : public I2CBackend {
+	public:
+		static I2CLinux* open(int i2c_bus);		// NULL if /dev/i2c-N cannot be opened
+		~I2CLinux();
+		unsigned long functionality();
+		int setSlave(int address, int force);
+		int readByteData(int reg);
+		int writeByteData(int reg, unsigned char value);
+		int readWordData(int reg);
+		int readBlockData(int reg, int length, unsigned char* buffer);
+		int write(const unsigned char* data, int length);
+		int transfer(struct i2c_msg* msgs, int count);
+	private:
+		I2CLinux(int handle);
+		int handle;						// Handle to /dev/i2c-N
+};
+
+class I2CBus {
+	public:
+		// open(): Get the shared bus object for /dev/i2c-N, opening it on first use.
+		// Returns NULL if the bus cannot be opened. Call release() when done.
+		static I2CBus* open(int i2c_bus);
+		// attach(): Use backend for bus number i2c_bus instead of /dev/i2c-N. Call before
+		// any driver opens the bus; the bus takes ownership of backend.
+		static I2CBus* attach(int i2c_bus, I2CBackend* backend);
+		void release();
+		int number() const;
+		int supportsBurst() const;		// readBlock() is one transaction (I2C_RDWR or SMBus block)
+		int maxBurst() const;			// Longest readBlock() in one transaction, 0 without burst support
+
+		// Immediate transactions, SMBus style: return value or 1 on success, -1 on failure.
+		// The slave address is only sent to the kernel when it changes.
+		int setSlave(int address, int force);
+		int readByte(int address, int reg);
+		int writeByte(int address, int reg, unsigned char data);
+		int readWord(int address, int reg);		// Little endian, LSB at reg
+		int readBlock(int address, int reg, unsigned char* buffer, int length);	// Returns length
+		int write(int address, const unsigned char* data, int length);		// Raw write, returns length
+		int generalCall(int reg, unsigned char data);	// writeByte() to every device listening to I2C_GENERAL_CALL
+
+		// Queued reads: collect reads for several devices, send them as one I2C_RDWR
+		// with flush(). status is set to 1 or -1 per transaction when flushed.
+		int queueRead(int address, int reg, unsigned char* buffer, int length, int* status);	// 0 if full
+		int flush();		// Number of transactions that succeeded
+		
+	private:
+		I2CBus(int i2c_bus, I2CBackend* backend);
+		~I2CBus();
+		static I2CBus* buses[I2CBUS_MAX_BUSES];
+		
+		int bus;
+		I2CBackend* backend;
+		int users;						// Reference count
+		unsigned long funcs;			// I2C_FUNCS of the adapter
+		int slave;						// Address last set with I2C_SLAVE, -1 if none
+		int slave_force;
+		int account(uint64_t start, int res);	// Metrics of one transaction, returns res
+		
+		// Queue
+		struct i2c_msg queue_msgs[2*I2CBUS_MAX_QUEUE];
+		unsigned char queue_regs[I2CBUS_MAX_QUEUE];
+		int* queue_status[I2CBUS_MAX_QUEUE];
+		int queued;
+};
+
+#endif
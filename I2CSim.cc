@@ -0,0 +1,556 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Simulated i2c bus with register models of our sensors
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/gpio.h>
+#include "I2CSim.h"
+#include "BMA020.h"
+#include "ITG3200.h"
+#include "HMC5883L.h"
+#include "SRF02.h"
+
+static double monotonic() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/********************
+ * I2CSimDevice
+ ********************/
+
+I2CSimDevice::I2CSimDevice(int address) {
+	this->address = address;
+	this->pointer = 0;
+	this->seed = 12345 + address;
+}
+
+int I2CSimDevice::getAddress() const {
+	return this->address;
+}
+
+int I2CSimDevice::receive(const unsigned char* data, int length) {
+	if (this->busy()) return -1;
+	if (length < 1) return 0;
+	this->pointer = data[0];
+	for (int i=1; i<length; i++) {
+		this->writeRegister(this->pointer, data[i]);
+		this->pointer = (this->pointer + 1) % I2CSIM_REGISTERS;
+	}
+	return length;
+}
+
+int I2CSimDevice::transmit(unsigned char* data, int length) {
+	if (this->busy()) return -1;
+	this->beginRead();
+	for (int i=0; i<length; i++) {
+		int value = this->readRegister(this->pointer);
+		data[i] = (value < 0) ? 0xFF : value;	// Unused registers read as a floating bus
+		if (!this->holdsPointer(this->pointer)) this->pointer = (this->pointer + 1) % I2CSIM_REGISTERS;
+	}
+	return length;
+}
+
+float I2CSimDevice::gaussian() {
+	// Box-Muller
+	float u1 = (rand_r(&this->seed) + 1.0f) / (RAND_MAX + 2.0f);
+	float u2 = (rand_r(&this->seed) + 1.0f) / (RAND_MAX + 2.0f);
+	return sqrtf(-2*logf(u1)) * cosf(2*M_PI*u2);
+}
+
+double I2CSimDevice::now() {
+	return monotonic();
+}
+
+/********************
+ * BMA020_SIM
+ ********************/
+
+BMA020_SIM::BMA020_SIM() : I2CSimDevice(BMA020_ADDRESS), edgePeriod(0) {
+	for (int i=0; i<0x16; i++) regs[i] = 0;
+	regs[0x00] = BMA020_CHIP_ID;
+	regs[0x01] = 0x12;		// al_version, ml_version
+	regs[0x14] = 0x06;		// +/- 2g, 1500 Hz
+	regs[0x15] = 0x80;
+	accel = Vec3(0, 0, 1);
+	noise = 0.005f;
+	epoch = this->now();
+	nextSample = 0;
+}
+
+double BMA020_SIM::nextEdge(double t) {
+	double p = edgePeriod.load(std::memory_order_relaxed) * 1e-9;
+	if (!(p > 0)) return 0;
+	// Strictly after t, also when t is an edge itself and rounding puts it just before
+	return epoch + (floor((t - epoch)/p + 1e-6) + 1)*p;
+}
+
+double BMA020_SIM::period() {
+	// A new conversion every half bandwidth period
+	static const int bandwidths[8] = {25, 50, 100, 190, 375, 750, 1500, 1500};
+	return 0.5/bandwidths[regs[0x14] & 0x07];
+}
+
+void BMA020_SIM::beginRead() {
+	// A read transaction sees one sample: burst reads are coherent, separate word reads may not be
+	double t = this->now();
+	if (t < nextSample) return;
+	double p = this->period();
+	nextSample = epoch + (floor((t - epoch)/p) + 1)*p;
+	this->convert();
+}
+
+void BMA020_SIM::convert() {
+	int range = 2 << ((regs[0x14] >> 3) & 0x03);	// 2, 4 or 8 g (3 is reserved, reads as 8)
+	if (range > 8) range = 8;
+	for (int axis=0; axis<3; axis++) {
+		float g = accel[axis] + noise*this->gaussian();
+		int value = (int)lroundf(g * 512 / range);
+		if (value > 511) value = 511;
+		if (value < -512) value = -512;
+		value &= 0x3FF;
+		regs[0x02 + 2*axis] = ((value & 0x03) << 6) | 0x01;	// Bits 1:0, new_data flag
+		regs[0x03 + 2*axis] = value >> 2;					// Bits 9:2
+	}
+}
+
+int BMA020_SIM::readRegister(int reg) {
+	if (reg >= 0x16) return -1;
+	int value = regs[reg];
+	if (reg >= 0x02 && reg <= 0x07 && (reg & 1) == 0) regs[reg] &= ~0x01;	// new_data cleared by reading
+	return value;
+}
+
+void BMA020_SIM::writeRegister(int reg, unsigned char value) {
+	if (reg == 0x14) regs[reg] = (regs[reg] & 0xE0) | (value & 0x1F);	// Bits 7:5 reserved
+	else if (reg >= 0x0A && reg < 0x16) regs[reg] = value;
+	else return;
+	nextSample = 0;		// The new setting applies from the next conversion
+	edgePeriod.store((regs[0x15] & BMA020_NEW_DATA_INT) ? lround(this->period()*1e9) : 0, std::memory_order_relaxed);
+}
+
+/********************
+ * ITG3200_SIM
+ ********************/
+
+ITG3200_SIM::ITG3200_SIM(int fifo) : I2CSimDevice(ITG3200_ADDRESS) {
+	this->fifo = fifo;
+	rate = Vec3(0, 0, 0);
+	bias = Vec3(0, 0, 0);
+	noise = 0.0066f;		// 0.38 deg/s rms
+	this->reset();
+}
+
+void ITG3200_SIM::reset() {
+	for (int i=0; i<0x40; i++) regs[i] = 0;
+	regs[ITG3200_WHO_AM_I] = ITG3200_ID;
+	regs[ITG3200_TEMP_OUT] = 0xCC;		// -13200: 35 degrees
+	regs[ITG3200_TEMP_OUT + 1] = 0x70;
+	fifo_head = 0;
+	fifo_count = 0;
+	nextSample = 0;
+}
+
+void ITG3200_SIM::beginRead() {
+	// Every sample that came due since the last read, at internal rate / (divider + 1).
+	// A long pause produces a FIFO's worth at most, the rest would be dropped anyway.
+	double period = (regs[ITG3200_SMPLRT_DIV] + 1) / ((regs[ITG3200_DLPF_FS] & 0x07) ? 1000.0 : 8000.0);
+	double t = this->now();
+	if (nextSample == 0) nextSample = t;
+	int n = 0;
+	for (; nextSample <= t && n <= ITG3200_FIFO_SIZE/ITG3200_DATA_LENGTH; n++) {
+		nextSample += period;
+		this->sample();
+	}
+	if (nextSample <= t) nextSample = t + period;
+}
+
+void ITG3200_SIM::sample() {
+	for (int axis=0; axis<3; axis++) {
+		float w = rate[axis] + bias[axis] + noise*this->gaussian();
+		long value = lroundf(w * 180/M_PI * ITG3200_SCALE);
+		if (value > 32767) value = 32767;
+		if (value < -32768) value = -32768;
+		regs[ITG3200_GYRO_OUT + 2*axis] = (value >> 8) & 0xFF;
+		regs[ITG3200_GYRO_OUT + 2*axis + 1] = value & 0xFF;
+	}
+	regs[ITG3200_INT_STATUS] |= 0x01;
+	if (!fifo || !(regs[ITG3200_USER_CTRL] & 0x40)) return;
+	// Enabled outputs in register order: temperature (bit 7), X, Y, Z (bits 6:4)
+	unsigned char bytes[8];
+	int length = 0;
+	for (int k=0; k<4; k++) {
+		if (!(regs[ITG3200_FIFO_EN] & (0x80 >> k))) continue;
+		int reg = (k == 0) ? ITG3200_TEMP_OUT : ITG3200_GYRO_OUT + 2*(k-1);
+		bytes[length++] = regs[reg];
+		bytes[length++] = regs[reg + 1];
+	}
+	if (fifo_count + length > ITG3200_FIFO_SIZE) {
+		regs[ITG3200_INT_STATUS] |= 0x80;	// FIFO full, sample lost
+		return;
+	}
+	for (int i=0; i<length; i++) fifo_data[(fifo_head + fifo_count++) % ITG3200_FIFO_SIZE] = bytes[i];
+}
+
+int ITG3200_SIM::holdsPointer(int reg) {
+	return fifo && reg == ITG3200_FIFO_R;
+}
+
+int ITG3200_SIM::readRegister(int reg) {
+	if (reg >= 0x40) return -1;
+	if (reg == ITG3200_FIFO_EN || (reg >= ITG3200_FIFO_COUNT && reg <= ITG3200_USER_CTRL)) {
+		if (!fifo) return -1;
+		if (reg == ITG3200_FIFO_COUNT) return fifo_count >> 8;
+		if (reg == ITG3200_FIFO_COUNT + 1) return fifo_count & 0xFF;
+		if (reg == ITG3200_FIFO_R) {
+			if (fifo_count == 0) return 0;
+			int value = fifo_data[fifo_head];
+			fifo_head = (fifo_head + 1) % ITG3200_FIFO_SIZE;
+			fifo_count--;
+			return value;
+		}
+		return regs[reg];
+	}
+	if (reg == ITG3200_INT_STATUS) {
+		int value = regs[reg];
+		regs[reg] = 0;		// Cleared by reading
+		return value;
+	}
+	if (reg == ITG3200_WHO_AM_I || (reg >= ITG3200_SMPLRT_DIV && reg <= ITG3200_INT_CFG)
+		|| (reg >= ITG3200_TEMP_OUT && reg < ITG3200_GYRO_OUT + ITG3200_DATA_LENGTH) || reg == ITG3200_PWR_MGM)
+		return regs[reg];
+	return -1;
+}
+
+void ITG3200_SIM::writeRegister(int reg, unsigned char value) {
+	if (reg == ITG3200_PWR_MGM) {
+		if (value & 0x80) this->reset();
+		else regs[reg] = value;
+	} else if (reg >= ITG3200_SMPLRT_DIV && reg <= ITG3200_INT_CFG) {
+		regs[reg] = value;
+	} else if (fifo && reg == ITG3200_FIFO_EN) {
+		regs[reg] = value;
+	} else if (fifo && reg == ITG3200_USER_CTRL) {
+		if (value & 0x02) fifo_head = fifo_count = 0;
+		regs[reg] = value & ~0x02;		// Reset bit clears itself
+	}
+}
+
+/********************
+ * HMC5883L_SIM
+ ********************/
+
+#define HMC5883L_SIM_WRITE 0.00025		// RDY low while a sample is written [s]
+
+HMC5883L_SIM::HMC5883L_SIM() : I2CSimDevice(HMC5883L_ADDRESS) {
+	for (int i=0; i<13; i++) regs[i] = 0;
+	regs[HMC5883L_CONFIG_A] = 0x10;		// 15 Hz, no averaging
+	regs[HMC5883L_CONFIG_B] = 0x20;		// 1.3 gauss
+	regs[HMC5883L_MODE] = 0x01;			// Single measurement
+	for (int i=0; i<3; i++) regs[HMC5883L_IDENT + i] = HMC5883L_ID[i];
+	field = Vec3(0.2f, 0, -0.4f);
+	offset = Vec3(0, 0, 0);
+	noise = 0.002f;
+	nextSample = 0;
+	readMask = 0;
+	pending = 0;
+}
+
+void HMC5883L_SIM::beginRead() {
+	if (nextSample == 0) return;
+	static const double rates[8] = {0.75, 1.5, 3, 7.5, 15, 30, 75, 75};
+	double period = 1/rates[(regs[HMC5883L_CONFIG_A] >> 2) & 0x07];
+	double t = this->now();
+	if (t >= nextSample + HMC5883L_SIM_WRITE) {
+		// Written: the latest sample only, a slow reader missed the others
+		pending = 1;
+		while (t >= nextSample + HMC5883L_SIM_WRITE) nextSample += period;
+		if ((regs[HMC5883L_MODE] & 0x03) != 0x00) nextSample = 0;	// Single measurement done
+	}
+	if (pending && readMask == 0) {
+		this->measure();
+		pending = 0;
+	}
+	// RDY: a sample is there and the next one is not being written
+	int writing = (nextSample != 0 && t >= nextSample);
+	regs[HMC5883L_STATUS] = ((regs[HMC5883L_STATUS] & 0x01) && !writing) ? 0x01 : 0x00;
+	if (readMask) regs[HMC5883L_STATUS] |= 0x02;
+}
+
+void HMC5883L_SIM::measure() {
+	static const int resolution[8] = {1370, 1090, 820, 660, 440, 390, 330, 230};
+	int lsb = resolution[regs[HMC5883L_CONFIG_B] >> 5];
+	int order[3] = {0, 2, 1};		// X, Z, Y
+	for (int i=0; i<3; i++) {
+		int axis = order[i];
+		float b = field[axis] + offset[axis] + noise*this->gaussian();
+		int value = (int)lroundf(b * lsb);
+		if (value > 2047 || value < -2048) value = HMC5883L_OVERFLOW;
+		regs[HMC5883L_DATA + 2*i] = (value >> 8) & 0xFF;
+		regs[HMC5883L_DATA + 2*i + 1] = value & 0xFF;
+	}
+	regs[HMC5883L_STATUS] |= 0x01;
+}
+
+int HMC5883L_SIM::readRegister(int reg) {
+	if (reg >= 13) return -1;
+	if (reg >= HMC5883L_DATA && reg < HMC5883L_DATA + HMC5883L_DATA_LENGTH) {
+		readMask |= 1 << (reg - HMC5883L_DATA);
+		if (readMask == 0x3F) readMask = 0;		// All read, unlocked
+	}
+	return regs[reg];
+}
+
+void HMC5883L_SIM::writeRegister(int reg, unsigned char value) {
+	if (reg > HMC5883L_MODE) return;
+	regs[reg] = value;
+	readMask = 0;
+	if (reg == HMC5883L_MODE) {
+		// Continuous: the first sample one period from now. Single: one after ~6 ms.
+		static const double rates[8] = {0.75, 1.5, 3, 7.5, 15, 30, 75, 75};
+		if ((value & 0x03) == 0x00) nextSample = this->now() + 1/rates[(regs[HMC5883L_CONFIG_A] >> 2) & 0x07];
+		else if ((value & 0x03) == 0x01) nextSample = this->now() + 0.006;
+		else nextSample = 0;
+	}
+}
+
+/********************
+ * SRF02_SIM
+ ********************/
+
+SRF02_SIM::SRF02_SIM(int address) : I2CSimDevice(address) {
+	for (int i=0; i<6; i++) regs[i] = 0;
+	regs[0] = 0x06;					// Software revision
+	regs[1] = SRF02_VERIFICATION;	// Unused, reads 0x80
+	regs[5] = 0x12;					// Minimum range (autotune), 18 cm
+	range = 100;
+	noise = 1;
+	conversion = 0.065f;
+	readyAt = 0;
+}
+
+int SRF02_SIM::busy() {
+	return this->now() < readyAt;
+}
+
+int SRF02_SIM::readRegister(int reg) {
+	if (reg >= 6) return -1;
+	return regs[reg];
+}
+
+void SRF02_SIM::writeRegister(int reg, unsigned char value) {
+	if (reg != 0) return;
+	float scale;
+	if (value == 0x50) scale = 1/2.54f;			// Inches
+	else if (value == SRF02_CMD_RANGE) scale = 1;	// Centimetres
+	else if (value == 0x52) scale = 58;			// Microseconds
+	else return;
+	int result = (int)lroundf((range + noise*this->gaussian()) * scale);
+	if (result < 0) result = 0;
+	regs[2] = (result >> 8) & 0xFF;
+	regs[3] = result & 0xFF;
+	readyAt = this->now() + conversion;
+}
+
+/********************
+ * I2CSimEdge
+ ********************/
+
+I2CSimEdge::I2CSimEdge(I2CSimDevice* device) : running(0) {
+	this->device = device;
+	fds[0] = fds[1] = -1;
+}
+
+I2CSimEdge::~I2CSimEdge() {
+	this->stop();
+	if (fds[0] >= 0) close(fds[0]);
+	if (fds[1] >= 0) close(fds[1]);
+}
+
+int I2CSimEdge::start() {
+	if (running.load()) return 0;
+	// Non-blocking write end: a full pipe drops edges, like the kernel's event queue
+	if (fds[0] < 0 && (pipe(fds) < 0 || fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0)) {
+		fprintf(stderr, "Error I2CSimEdge: Could not create the pipe: %s\n", strerror(errno));
+		return 0;
+	}
+	running.store(1);
+	int res = pthread_create(&thread, NULL, I2CSimEdge::run, this);
+	if (res != 0) {
+		fprintf(stderr, "Error I2CSimEdge: Could not start thread: %s\n", strerror(res));
+		running.store(0);
+		return 0;
+	}
+	return 1;
+}
+
+void I2CSimEdge::stop() {
+	if (!running.exchange(0)) return;
+	pthread_join(thread, NULL);
+}
+
+int I2CSimEdge::getFd() const {
+	return fds[0];
+}
+
+void* I2CSimEdge::run(void* self) {
+	((I2CSimEdge*)self)->loop();
+	return NULL;
+}
+
+void I2CSimEdge::loop() {
+	double t = monotonic();
+	while (running.load(std::memory_order_relaxed)) {
+		double edge = device->nextEdge(t);
+		if (edge == 0) {
+			// Line quiet, look again in a while
+			usleep(1000);
+			t = monotonic();
+			continue;
+		}
+		uint64_t ns = (uint64_t)(edge*1e9);
+		struct timespec ts;
+		ts.tv_sec = ns / 1000000000ull;
+		ts.tv_nsec = ns % 1000000000ull;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+		struct gpioevent_data event;
+		memset(&event, 0, sizeof(event));
+		event.timestamp = ns;
+		event.id = GPIOEVENT_EVENT_RISING_EDGE;
+		ssize_t res = write(fds[1], &event, sizeof(event));	// Full pipe: dropped
+		(void)res;
+		t = edge;
+	}
+}
+
+/********************
+ * I2CSim
+ ********************/
+
+I2CSim::I2CSim() {
+	funcs = I2C_FUNC_I2C | I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WORD_DATA | I2C_FUNC_SMBUS_I2C_BLOCK;
+	bitrate = I2CSIM_BITRATE;
+	latency = I2CSIM_LATENCY;
+	transactions = 0;
+	bytes = 0;
+	numDevices = 0;
+	slave = -1;
+}
+
+I2CSim::~I2CSim() {
+	for (int i=0; i<numDevices; i++) delete devices[i];
+}
+
+void I2CSim::addDevice(I2CSimDevice* device) {
+	if (numDevices >= I2CSIM_MAX_DEVICES) {
+		fprintf(stderr, "Error I2CSim: Too many devices\n");
+		delete device;
+		return;
+	}
+	devices[numDevices++] = device;
+}
+
+unsigned long I2CSim::functionality() {
+	return funcs;
+}
+
+int I2CSim::setSlave(int address, int force) {
+	this->slave = address;
+	return 1;
+}
+
+int I2CSim::readByteData(int reg) {
+	unsigned char value;
+	if (this->readRegisters(reg, &value, 1) < 0) return -1;
+	return value;
+}
+
+int I2CSim::writeByteData(int reg, unsigned char value) {
+	unsigned char data[2] = {(unsigned char)reg, value};
+	return (this->write(data, 2) == 2) ? 1 : -1;
+}
+
+int I2CSim::readWordData(int reg) {
+	unsigned char value[2];
+	if (this->readRegisters(reg, value, 2) < 0) return -1;
+	return value[0] | (value[1] << 8);
+}
+
+int I2CSim::readBlockData(int reg, int length, unsigned char* buffer) {
+	if (!(funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK)) return -1;
+	return this->readRegisters(reg, buffer, length);
+}
+
+int I2CSim::write(const unsigned char* data, int length) {
+	this->spend(1, length);
+	return this->deliver(this->slave, data, length);
+}
+
+int I2CSim::transfer(struct i2c_msg* msgs, int count) {
+	if (!(funcs & I2C_FUNC_I2C)) return -1;
+	int length = 0;
+	for (int i=0; i<count; i++) length += msgs[i].len;
+	this->spend(count, length);
+	for (int i=0; i<count; i++) {
+		int res;
+		if (msgs[i].flags & I2C_M_RD) {
+			I2CSimDevice* device = this->find(msgs[i].addr);
+			if (!device) return -1;
+			res = device->transmit(msgs[i].buf, msgs[i].len);
+		} else {
+			res = this->deliver(msgs[i].addr, msgs[i].buf, msgs[i].len);
+		}
+		if (res < 0) return -1;
+	}
+	return count;
+}
+
+I2CSimDevice* I2CSim::find(int address) {
+	for (int i=0; i<numDevices; i++)
+		if (devices[i]->getAddress() == address) return devices[i];
+	return NULL;
+}
+
+int I2CSim::deliver(int address, const unsigned char* data, int length) {
+	if (address != I2C_GENERAL_CALL) {
+		I2CSimDevice* device = this->find(address);
+		if (!device) return -1;
+		return device->receive(data, length);
+	}
+	// Open drain: the general call is acked if any listener acks
+	int acked = 0;
+	for (int i=0; i<numDevices; i++) {
+		if (devices[i]->listensGeneralCall() && devices[i]->receive(data, length) >= 0) acked = 1;
+	}
+	return acked ? length : -1;
+}
+
+int I2CSim::readRegisters(int reg, unsigned char* buffer, int length) {
+	this->spend(2, 1 + length);
+	I2CSimDevice* device = this->find(this->slave);
+	if (!device) return -1;
+	unsigned char r = reg;
+	if (device->receive(&r, 1) < 0) return -1;
+	return device->transmit(buffer, length);
+}
+
+void I2CSim::spend(int messages, int length) {
+	// Every message costs a start + address byte, every byte 9 clocks (8 data + ack)
+	transactions++;
+	bytes += length;
+	double duration = latency;
+	if (bitrate > 0) duration += (messages + length) * 9.0 / bitrate;
+	if (duration <= 0) return;
+	// Spin, a sleep would add the scheduler's wakeup latency on top
+	double end = monotonic() + duration;
+	while (monotonic() < end) {}
+}
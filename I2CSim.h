@@ -0,0 +1,196 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Simulated i2c bus with register models of our sensors, so the drivers can be
+ * run, timed and tested without the quad on the bench:
+ *	I2CSim* sim = new I2CSim();
+ *	sim->addDevice(new BMA020_SIM());
+ *	I2CBus::attach(I2CBUS_SENSORS, sim);	// Before any driver's init()
+ * A device's interrupt line is simulated by an I2CSimEdge, read through GpioEdge::attach().
+ */
+ 
+#ifndef _I2CSIM_H
+#define _I2CSIM_H
+
+#define I2CSIM_MAX_DEVICES 8
+#define I2CSIM_BITRATE 100000		// Default bus clock [Hz]
+#define I2CSIM_LATENCY 0.00005		// Default fixed cost per transaction (syscall, adapter) [s]
+#define I2CSIM_REGISTERS 256
+
+#include <pthread.h>
+#include <atomic>
+#include "I2CBus.h"
+#include "ITG3200.h"
+#include "matrix.h"
+
+// A device on the simulated bus. A write sets the register pointer with its first
+// byte and writes the rest auto-incrementing, a read continues from the pointer
+// (except at a register that holdsPointer(), like a FIFO's data register).
+class I2CSimDevice {
+	public:
+		I2CSimDevice(int address);
+		virtual ~I2CSimDevice() {}
+		int getAddress() const;
+		virtual int listensGeneralCall() { return 0; }			// Take writes to I2C_GENERAL_CALL too?
+		
+		int receive(const unsigned char* data, int length);		// Write transaction, -1 on NAK
+		int transmit(unsigned char* data, int length);			// Read transaction, -1 on NAK
+		// nextEdge(): First rising edge of the interrupt line after t [s], 0 if the line is quiet.
+		// Called from the I2CSimEdge thread, not the bus: only touch what is safe to share.
+		virtual double nextEdge(double t) { return 0; }
+		
+	protected:
+		virtual int busy() { return 0; }						// NAK everything while busy
+		virtual void beginRead() {}								// Called at the start of each read
+		virtual int holdsPointer(int reg) { return 0; }			// Reads of reg don't auto-increment
+		virtual int readRegister(int reg) = 0;
+		virtual void writeRegister(int reg, unsigned char value) = 0;
+		float gaussian();										// Standard normal noise
+		double now();											// Monotonic time [s]
+	private:
+		int address;
+		int pointer;
+		unsigned int seed;
+};
+
+// BMA020: chip-id 0x02, range/bandwidth in 0x14, 10 bit left-justified data in 0x02-0x07.
+// Conversions run on a fixed schedule from power-up; with new_data_INT set in 0x15 the INT
+// pin pulses at each of them.
+class BMA020_SIM : public I2CSimDevice {
+	public:
+		BMA020_SIM();
+		Vec3 accel;				// True acceleration [g]
+		float noise;			// Standard deviation [g]
+		double nextEdge(double t);
+	protected:
+		void beginRead();
+		int readRegister(int reg);
+		void writeRegister(int reg, unsigned char value);
+	private:
+		unsigned char regs[0x16];
+		double epoch;			// Power-up, the conversion schedule starts here
+		double nextSample;		// When the next conversion is done
+		std::atomic<long> edgePeriod;	// INT pulse period [ns], 0 while new_data_INT is off
+		double period();		// Between conversions [s]
+		void convert();
+};
+
+// ITG-3200: WHO_AM_I 0x68, rate/filter in 0x15-0x16, big-endian data in 0x1D-0x22 with the
+// data-ready flag in 0x1A. Samples are produced on the configured schedule as time passes.
+// With fifo set it is an MPU-3050 instead: every sample also goes in a 512 byte FIFO
+// (FIFO_EN 0x12, count 0x3A-0x3B, data 0x3C, enable/reset 0x3D), dropped when it is full.
+class ITG3200_SIM : public I2CSimDevice {
+	public:
+		ITG3200_SIM(int fifo = 1);
+		Vec3 rate;				// True angular velocity [rad/s]
+		Vec3 bias;				// Zero-rate offset [rad/s]
+		float noise;			// Standard deviation [rad/s]
+	protected:
+		void beginRead();
+		int holdsPointer(int reg);
+		int readRegister(int reg);
+		void writeRegister(int reg, unsigned char value);
+	private:
+		int fifo;				// MPU-3050 FIFO present
+		unsigned char regs[0x40];
+		unsigned char fifo_data[ITG3200_FIFO_SIZE];
+		int fifo_head;			// Oldest byte
+		int fifo_count;
+		double nextSample;		// When the next sample is due, 0 after a reset
+		void reset();
+		void sample();
+};
+
+// HMC5883L: "H43" in 0x0A-0x0C, big-endian X, Z, Y in 0x03-0x08, status in 0x09. In
+// continuous mode a sample is written every output period; RDY drops for the 250 us the
+// write takes. Reading some but not all data bytes locks the data until the rest is read.
+class HMC5883L_SIM : public I2CSimDevice {
+	public:
+		HMC5883L_SIM();
+		Vec3 field;				// True field in the body frame [gauss]
+		Vec3 offset;			// Hard iron, added to the field [gauss]
+		float noise;			// Standard deviation [gauss]
+	protected:
+		void beginRead();
+		int readRegister(int reg);
+		void writeRegister(int reg, unsigned char value);
+	private:
+		unsigned char regs[13];
+		double nextSample;		// When the next write starts, 0 if not measuring
+		int readMask;			// Data bytes read since the last complete read, lock while not 0
+		int pending;			// A sample waits for the lock to clear
+		void measure();
+};
+
+// SRF02: reads SRF02_VERIFICATION at 0x01, 0x51 in 0x00 starts ranging, busy (NAK) ~65ms.
+// Listens to the general call, like the real one.
+class SRF02_SIM : public I2CSimDevice {
+	public:
+		SRF02_SIM(int address);	// 7 bit address
+		float range;			// True range [cm]
+		float noise;			// Standard deviation [cm]
+		float conversion;		// Ranging time [s]
+		int listensGeneralCall() { return 1; }
+	protected:
+		int busy();
+		int readRegister(int reg);
+		void writeRegister(int reg, unsigned char value);
+	private:
+		unsigned char regs[6];
+		double readyAt;
+};
+
+// Interrupt line of a simulated device: a thread writes a struct gpioevent_data into a pipe
+// at every rising edge, stamped with its time, as the kernel's GPIO character device does.
+//	I2CSimEdge* drdy = new I2CSimEdge(accel_sim);
+//	drdy->start();
+//	gpio.attach(drdy->getFd());
+class I2CSimEdge {
+	public:
+		I2CSimEdge(I2CSimDevice* device);	// The device stays owned by the bus
+		~I2CSimEdge();						// Stops the thread
+		int start();						// 1 if successful
+		void stop();
+		int getFd() const;					// Read end of the pipe, -1 before start()
+	private:
+		static void* run(void* self);
+		void loop();
+		I2CSimDevice* device;
+		int fds[2];
+		pthread_t thread;
+		std::atomic<int> running;
+};
+
+class I2CSim : public I2CBackend {
+	public:
+		I2CSim();
+		~I2CSim();
+		void addDevice(I2CSimDevice* device);	// The bus takes ownership
+		
+		// Settings
+		unsigned long funcs;	// Advertised I2C_FUNC_*, clear bits to exercise driver fallbacks
+		int bitrate;			// Bus clock [Hz], 0 for no transfer time at all
+		double latency;			// Fixed cost per transaction [s]
+		// Statistics
+		unsigned long transactions;
+		unsigned long bytes;
+		
+		// I2CBackend
+		unsigned long functionality();
+		int setSlave(int address, int force);
+		int readByteData(int reg);
+		int writeByteData(int reg, unsigned char value);
+		int readWordData(int reg);
+		int readBlockData(int reg, int length, unsigned char* buffer);
+		int write(const unsigned char* data, int length);
+		int transfer(struct i2c_msg* msgs, int count);
+	private:
+		I2CSimDevice* devices[I2CSIM_MAX_DEVICES];
+		int numDevices;
+		int slave;
+		I2CSimDevice* find(int address);
+		int deliver(int address, const unsigned char* data, int length);	// Write to one device, or all on a general call
+		int readRegisters(int reg, unsigned char* buffer, int length);	// SMBus style: write reg, read
+		void spend(int messages, int length);		// Burn the time the transaction takes on a real bus
+};
+
+#endif
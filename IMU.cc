@@ -8,28 +8,33 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <math.h>
 
 #include "IMU.h"
 #include "BMA020.h"
+#include "ITG3200.h"
+#include "HMC5883L.h"
 #include "SRF02.h"
 #include "matrix.h"
+#include "Metrics.h"
+#include "timing.h"
 
 /********************
  * PUBLIC FUNCTIONS
  ********************/
  
 IMU::IMU() {
-  // Init variables:
-  angles = new vector(3);
-  corrected_accel = new vector(3);
-  angular_velocity = new vector(3);
-  
-  // Init all the sensors
   accel = new BMA020_ACCEL();
-  if (!accel.init(I2CBUS_SENSORS)) {
-    fprintf(stderr, "FAILED to init the accelerometer (BMA020) on i2c bus %d\nTerminating...", I2CBUS_SENSORS);
-    exit(1);
-  }
+  gyro = new ITG3200_GYRO();
+  have_gyro = 0;
+  compass = new HMC5883L_COMPASS();
+  have_compass = 0;
+  bus = NULL;
+  samples = NULL;
+  last_sample = 0;
+  recorder = NULL;
+  weight_accel = IMU_STDWEIGHT_ACCEL;
+  weight_magneto = IMU_STDWEIGHT_MAGNETO;
   // Reset all the states
   this->reset();
 }
@@ -37,15 +42,235 @@ IMU::IMU() {
 IMU::~IMU() {
   // Free the sensors
   delete accel;
+  delete gyro;
+  delete compass;
+  if (bus) bus->release();
+}
+
+int IMU::init(int i2c_bus) {
+  // Init all the sensors
+  if (bus) return 0;  // Already init
+  if (!accel->init(i2c_bus)) {
+    fprintf(stderr, "FAILED to init the accelerometer (BMA020) on i2c bus %d\n", i2c_bus);
+    return 0;
+  }
+  have_gyro = gyro->init(i2c_bus);
+  if (!have_gyro) {
+    fprintf(stderr, "No gyroscope (ITG3200) on i2c bus %d, continuing with the accelerometer only\n", i2c_bus);
+  }
+  have_compass = compass->init(i2c_bus);
+  if (!have_compass) {
+    fprintf(stderr, "No compass (HMC5883L) on i2c bus %d, continuing without heading\n", i2c_bus);
+  }
+  bus = I2CBus::open(i2c_bus);
+  this->reset();
+  return 1;
 }
 
 void IMU::reset() {
+  attitude = quaternion();
+#if IMU_FILTER == IMU_FILTER_EKF
+  ekf.reset();
+#endif
   for (int i = 0; i<3; i++) {
-    angles->set(i,0);
-    corrected_accel->set(i,0);
-    angular_velocity->set(i,0);
+    gyro_integral.set(i,0);
+    angles.set(i,0);
+    corrected_accel.set(i,0);
+    angular_velocity.set(i,0);
+    gyro_sum.set(i,0);
   }
+  gyro_count = 0;
   height = 0;
   
   return;
-}
\ No newline at end of file
+}
+
+void IMU::attach(sample_ring* ring) {
+  samples = ring;
+  last_sample = 0;
+}
+
+void IMU::update(float dt) {
+  if (samples) {
+    // Step the filter once per sample, on the time between the samples rather than the loop tick
+    sensor_sample batch[IMU_DRAIN_BATCH];
+    unsigned int n;
+    while ((n = samples->popBatch(batch, IMU_DRAIN_BATCH)) > 0) {
+      for (unsigned int i = 0; i<n; i++) {
+        if (batch[i].sensor == SENSOR_ACCEL) {
+          float sample_dt = last_sample ? (batch[i].timestamp - last_sample) * 1e-9f : dt;
+          last_sample = batch[i].timestamp;
+          this->updateAccel(batch[i].value, sample_dt);
+          this->recordState(batch[i].timestamp);
+        } else if (batch[i].sensor == SENSOR_GYRO) {
+          this->addGyro(batch[i].value);
+        } else if (batch[i].sensor == SENSOR_RANGE) {
+          this->updateRange(batch[i].value[0]);
+          this->recordState(batch[i].timestamp);
+        } else if (batch[i].sensor == SENSOR_COMPASS) {
+          this->updateCompass(batch[i].value);
+        }
+      }
+    }
+    return;
+  }
+  if (!bus) return;
+  // Queue the reads of all sensors and send them as one bus transaction
+  int gyro_queued = have_gyro && gyro->queueMeasurement();
+  int compass_queued = have_compass && compass->queueMeasurement();
+  int accel_queued = accel->queueMeasurement();
+  bus->flush();
+  Vec3 rate = angular_velocity;
+  int have_rate = have_gyro && this->readGyro(&rate, gyro_queued);
+  if (have_compass) this->readCompass(compass_queued);
+  Vec3 a;
+  if (!(accel_queued ? accel->getQueuedMeasurement(&a) : accel->getMeasurement(&a))) return;
+  if (have_gyro) gyro->addAccel(a);   // For the bias tracker
+  uint64_t now = monotonic_ns();
+  if (recorder) {
+    if (have_rate) recorder->record(RECORD_GYRO, now, rate[0], rate[1], rate[2]);
+    recorder->record(RECORD_ACCEL, now, a[0], a[1], a[2]);
+  }
+  this->update(rate, a, dt);
+  this->recordState(now);
+}
+
+void IMU::update(const Vec3& gyro, const Vec3& accel, float dt) {
+  if (!(dt > 0)) return;
+  uint64_t start = monotonic_ns();
+  angular_velocity = gyro;
+  float norm2 = innerprod(accel, accel);
+  int use_accel = (norm2 > IMU_ACCEL_MIN*IMU_ACCEL_MIN && norm2 < IMU_ACCEL_MAX*IMU_ACCEL_MAX);
+  if (!use_accel) metrics_count(METRIC_IMU_ACCEL_SKIPPED);
+
+#if IMU_FILTER == IMU_FILTER_EKF
+  ekf.predict(gyro, accel, dt);
+  if (use_accel) ekf.updateAccel(accel);
+  attitude = ekf.getAttitude();
+  height = ekf.getHeight();
+#else
+  Vec3 rate = gyro;
+
+  // Accelerometer correction, only when it mostly measures gravity
+  if (use_accel) {
+    Vec3 a = accel * (1/sqrtf(norm2));
+    // Error between measured and estimated gravity direction, both in the body frame
+    Vec3 error = crossprod(a, attitude.earth_z());
+    // weight_accel is the per-update complementary blend, so the proportional gain is weight/dt
+    gyro_integral = gyro_integral + error * (float)(IMU_MAHONY_KI * dt);
+    rate = rate + error * (weight_accel / dt) + gyro_integral;
+  }
+
+  // Integrate q' = 0.5 * q * (0, rate)
+  quaternion dq = attitude * quaternion(0, rate[0], rate[1], rate[2]);
+  float h = 0.5f * dt;
+  attitude.w += dq.w * h;
+  attitude.x += dq.x * h;
+  attitude.y += dq.y * h;
+  attitude.z += dq.z * h;
+  attitude.normalize();
+#endif
+
+  corrected_accel = attitude.rotate(accel) - Vec3(0, 0, 1);
+  angles = attitude.euler();
+  metrics_count(METRIC_IMU_UPDATES);
+  metrics_latency(METRIC_LAT_IMU_UPDATE, monotonic_ns() - start);
+}
+
+void IMU::addGyro(const Vec3& rate) {
+  gyro_sum = gyro_sum + rate;
+  gyro_count++;
+}
+
+void IMU::updateAccel(const Vec3& accel, float dt) {
+  // Without new gyro samples (FIFO not read this cycle) the last rate holds
+  Vec3 rate = angular_velocity;
+  if (gyro_count) rate = gyro_sum * (1.0f / gyro_count);
+  gyro_sum = Vec3(0, 0, 0);
+  gyro_count = 0;
+  this->update(rate, accel, dt);
+}
+
+void IMU::updateRange(float range) {
+  // The ranger looks along the body z-axis: project onto the vertical
+  float tilt = attitude.earth_z()[2];
+  if (tilt < 0.5f) return;   // More than 60 degrees tilted, the echo is useless
+  float measured = range * 0.01f * tilt;
+#if IMU_FILTER == IMU_FILTER_EKF
+  ekf.updateHeight(measured);
+  height = ekf.getHeight();
+#else
+  height = measured;
+#endif
+}
+
+void IMU::updateCompass(const Vec3& field) {
+  // Heading error from the tilt-compensated field: the yaw that turns its horizontal part to the x-axis
+  Vec3 h = attitude.rotate(field);
+  float horizontal2 = h[0]*h[0] + h[1]*h[1];
+  if (!(horizontal2 > 1e-6f)) return;   // Field (nearly) vertical or missing
+  float error = -atan2f(h[1], h[0]);
+#if IMU_FILTER == IMU_FILTER_EKF
+  ekf.updateHeading(error);
+  attitude = ekf.getAttitude();
+#else
+  // weight_magneto is the per-sample blend: rotate that fraction of the error about the earth z-axis
+  float half = 0.5f * weight_magneto * error;
+  attitude = quaternion(cosf(half), 0, 0, sinf(half)) * attitude;
+  attitude.normalize();
+#endif
+  angles = attitude.euler();
+}
+
+void IMU::setRecorder(FlightRecorder* recorder) {
+  this->recorder = recorder;
+}
+
+const Vec3& IMU::getAngles() const {
+  return angles;
+}
+
+const quaternion& IMU::getAttitude() const {
+  return attitude;
+}
+
+const Vec3& IMU::getCorrectedAccel() const {
+  return corrected_accel;
+}
+
+float IMU::getHeight() const {
+  return height;
+}
+
+/********************
+ * PRIVATE FUNCTIONS
+ ********************/
+
+void IMU::recordState(uint64_t timestamp) {
+  if (!recorder) return;
+  float state[8] = {attitude.w, attitude.x, attitude.y, attitude.z, height,
+    corrected_accel[0], corrected_accel[1], corrected_accel[2]};
+  recorder->record(RECORD_IMU, timestamp, state, 8);
+}
+
+int IMU::readGyro(Vec3* rate, int queued) {
+  // All samples since the last tick (several from the FIFO), averaged over the tick
+  Vec3 rates[ITG3200_FIFO_BATCH];
+  int n = queued ? gyro->getQueuedMeasurements(rates, ITG3200_FIFO_BATCH)
+    : gyro->getMeasurements(rates, ITG3200_FIFO_BATCH);
+  if (n <= 0) return 0;
+  Vec3 sum;
+  for (int i = 0; i<n; i++) sum = sum + rates[i];
+  *rate = sum * (1.0f / n);
+  return 1;
+}
+
+void IMU::readCompass(int queued) {
+  // Most ticks find no sample due and cost no bus time
+  Vec3 field;
+  int res = queued ? compass->getQueuedMeasurement(&field)
+    : (compass->read_mode == HMC5883L_READ_WORD ? compass->getMeasurement(&field) : 0);
+  if (res <= 0) return;
+  if (recorder) recorder->record(RECORD_COMPASS, monotonic_ns(), field[0], field[1], field[2]);
+  this->updateCompass(field);
+}
@@ -11,30 +11,98 @@
 #define I2CBUS_SENSORS 3
 
 // FILTER SETTINGS
+#define IMU_FILTER_MAHONY 0         // Quaternion complementary filter, cheapest
+#define IMU_FILTER_EKF 1            // Extended Kalman filter, also estimates gyro bias & vertical velocity
+#ifndef IMU_FILTER
+#define IMU_FILTER IMU_FILTER_MAHONY  // Pick per build: make IMU_FILTER=EKF
+#endif
 #define IMU_STDWEIGHT_ACCEL 0.05    // Relative to gyro weight
 #define IMU_STDWEIGHT_MAGNETO 0.05  // Relative to gyro weight
+#define IMU_MAHONY_KI 0.01          // Integral gain, slowly learns the gyro bias [1/s]
+#define IMU_ACCEL_MIN 0.5           // Skip the accel correction below this norm [g], free fall
+#define IMU_ACCEL_MAX 1.5           // ... and above this one, hard manoeuvring
+#define IMU_DRAIN_BATCH 32          // Samples taken from the acquisition ring per pop
 
 
 #include "BMA020.h"
+#include "ITG3200.h"
+#include "HMC5883L.h"
 #include "SRF02.h"
 #include "matrix.h"
+#include "I2CBus.h"
+#include "Acquisition.h"
+#include "Recorder.h"
+#include <stdint.h>
+#if IMU_FILTER == IMU_FILTER_EKF
+#include "EKF.h"
+#endif
 
 class IMU {
 	public:
 		IMU();
 		~IMU();
+    // init(): Connect to all the sensors. Returns 1 if successful, 0 if not.
+    // Not needed when the IMU is only fed through update(gyro, accel, dt), e.g. in replay.
+    int init(int i2c_bus);
     void reset();      // Reset the IMU, should be steady on the ground
+    // attach(): Take samples from an acquisition thread instead of reading the bus, no init() needed
+    void attach(sample_ring* ring);
+    // update(): Read the sensors and advance the filter by dt seconds.
+    // When attached, drains the ring instead and steps the filter per sample on its timestamp.
+    void update(float dt);
+    // update(): Advance the filter with given measurements: gyro [rad/s], accel [g]
+    // Quaternion Mahony filter: no heap, no trig except the final Euler extraction
+    void update(const Vec3& gyro, const Vec3& accel, float dt);
+    // addGyro(), updateAccel(): The same, one sample at a time as the acquisition delivers them.
+    // updateAccel() steps the filter with the mean of the gyro samples added since the last
+    // accel sample, or with the last rate if none came. update(dt) and replay both go through here.
+    void addGyro(const Vec3& rate);
+    void updateAccel(const Vec3& accel, float dt);
+    // updateRange(): Feed a raw ultrasound range [cm], corrected for tilt here
+    void updateRange(float range);
+    // updateCompass(): Feed a calibrated magnetic field [gauss], body frame. Only corrects the yaw,
+    // so magnetic north is the earth x-axis and a disturbed field cannot tilt the attitude
+    void updateCompass(const Vec3& field);
+    // setRecorder(): Record the sensor samples read by update(dt) and the state after each step (NULL: off)
+    void setRecorder(FlightRecorder* recorder);
+
+    const Vec3& getAngles() const;           // Pitch, roll and yaw [rad]
+    const quaternion& getAttitude() const;
+    const Vec3& getCorrectedAccel() const;   // [g]
+    float getHeight() const;
+
+    // Filter weights, default IMU_STDWEIGHT_*
+    float weight_accel;
+    float weight_magneto;
   private:
     // Sensors
+    I2CBus* bus;              // Shared with the drivers, all reads of a tick go out in one flush
     BMA020_ACCEL* accel;
+    ITG3200_GYRO* gyro;
+    int have_gyro;            // Optional, without it the attitude follows the accelerometer
+    HMC5883L_COMPASS* compass;
+    int have_compass;         // Optional, without it the yaw drifts with the gyro
+    sample_ring* samples;     // Consumer side of the acquisition ring, NULL if not attached
+    Vec3 gyro_sum;            // Gyro samples since the last accel sample, their mean drives the next step
+    int gyro_count;
+    int readGyro(Vec3* rate, int queued);  // Mean of the new gyro samples (direct path), 0 if none
+    void readCompass(int queued);          // New compass sample, if any, into the filter (direct path)
+    uint64_t last_sample;     // Timestamp of the last accel sample taken from the ring [ns]
+    FlightRecorder* recorder;
+    void recordState(uint64_t timestamp);
     // Variables
-    vector* angles;           // Pitch, roll and yaw
-    vector* corrected_accel;  // Acceleration corrected for gravity
-    vector* angular_velocity;  // Angular velocity of the quadcopter
+    quaternion attitude;      // Body -> earth
+    Vec3 gyro_integral;       // Integral of the attitude error, compensates gyro bias
+    Vec3 angles;              // Pitch, roll and yaw
+    Vec3 corrected_accel;     // Acceleration corrected for gravity
+    Vec3 angular_velocity;    // Angular velocity of the quadcopter
     float height;             // Height of the quadcopter, 0 until about 18cm
+#if IMU_FILTER == IMU_FILTER_EKF
+    EKF ekf;
+#endif
   
     
   
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,361 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * ITG-3200 gyroscope driver (i2c)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include "ITG3200.h"
+#include "Calibration.h"
+#include "I2CBus.h"
+#include "matrix.h"
+#include "Metrics.h"
+#include "timing.h"
+
+/********************
+ * PUBLIC FUNCTIONS
+ ********************/
+
+ITG3200_GYRO::ITG3200_GYRO() {
+	bus = NULL;
+	address = ITG3200_ADDRESS;
+	rate = 0;
+	internal_rate = 8000;
+	fifo_batch = 0;
+	use_calibration = 1;
+	track_bias = 1;
+	read_mode = ITG3200_READ_WORD;
+	queue_status = 0;
+	queue_data_status = 0;
+	queued_samples = 0;
+	fifo_pending = 0;
+	overflows = 0;
+	window_fill = 0;
+	accel_fill = 0;
+	rest_windows = 0;
+	at_rest = 0;
+}
+
+ITG3200_GYRO::~ITG3200_GYRO() {
+	if (this->bus) this->bus->release();
+}
+
+int ITG3200_GYRO::init(int i2c_bus, int address) {
+	// Try to open the i2c bus and connect to the sensor
+	// To verify communication, WHO_AM_I (register 0x00) is read, bits 6:1 should be 0x68
+
+	// Return: 1 if successful, 0 if not
+
+	if (this->bus) return 0; // Already init
+	this->bus = I2CBus::open(i2c_bus);
+	if (!this->bus) return 0;
+	this->address = address;
+
+	if (this->bus->setSlave(address, ITG3200_FORCE) < 0) {
+		if (!ITG3200_QUIET) {
+			fprintf(stderr, "Error ITG3200: Could not set address to 0x%02x\n", address);
+		}
+		this->bus->release();
+		this->bus = NULL;
+		return 0;
+	}
+
+	// Bit 0 of WHO_AM_I is AD0, bit 7 unused
+	int res = this->bus->readByte(address, ITG3200_WHO_AM_I);
+	if (res < 0 || (res & 0x7E) != (ITG3200_ID & 0x7E)) {
+		if (!ITG3200_QUIET) {
+			if (res < 0) fprintf(stderr, "Error ITG3200: Reading WHO_AM_I (address 0x00) failed\n");
+			else fprintf(stderr, "Error ITG3200: WHO_AM_I does not match. Read 0x%02x, should be 0x%02x.\n",
+				res, ITG3200_ID);
+		}
+		this->bus->release();
+		this->bus = NULL;
+		return 0;
+	}
+
+	// Reset, then clock from the X gyro's PLL: more stable than the internal oscillator
+	this->writeByte(ITG3200_PWR_MGM, 0x80);
+	usleep(5000);
+	if (this->writeByte(ITG3200_PWR_MGM, 0x01) < 0) {
+		this->bus->release();
+		this->bus = NULL;
+		return 0;
+	}
+	this->setLowpass(ITG3200_DEFAULT_LOWPASS);
+	this->setRate(ITG3200_DEFAULT_RATE);
+	// Data-ready flag latched until INT_STATUS is read, so no sample goes unnoticed
+	this->writeByte(ITG3200_INT_CFG, 0x21);
+
+	// The FIFO needs burst reads to be worth it: a batch is one transaction
+	int burst = this->bus->maxBurst();
+	if (burst >= ITG3200_DATA_LENGTH && this->hasFifo()) {
+		this->read_mode = ITG3200_READ_FIFO;
+		this->fifo_batch = burst / ITG3200_DATA_LENGTH;
+		if (this->fifo_batch > ITG3200_FIFO_BATCH) this->fifo_batch = ITG3200_FIFO_BATCH;
+	} else {
+		this->read_mode = burst ? ITG3200_READ_BURST : ITG3200_READ_WORD;
+	}
+
+	calibration_open();
+	return 1;
+}
+
+int ITG3200_GYRO::getMeasurements(Vec3* measurements, int max) {
+	if (!this->bus) return -1;	// Not connected to sensor
+	uint64_t start = monotonic_ns();
+	int res;
+	if (this->read_mode == ITG3200_READ_FIFO) {
+		// Count, then take whole samples. The rest stays for the next read.
+		unsigned char count[2];
+		res = -1;
+		if (this->bus->readBlock(this->address, ITG3200_FIFO_COUNT, count, 2) == 2) {
+			int available = this->checkCount((count[0]<<8) | count[1]);
+			int n = available;
+			if (n > max) n = max;
+			if (n > this->fifo_batch) n = this->fifo_batch;
+			int length = n * ITG3200_DATA_LENGTH;
+			if (n == 0 || this->bus->readBlock(this->address, ITG3200_FIFO_R, this->queue_buffer + 2, length) == length) {
+				for (int i=0; i<n; i++) this->decode(this->queue_buffer + 2 + i*ITG3200_DATA_LENGTH, &measurements[i]);
+				metrics_count(METRIC_ITG3200_SAMPLES, n);
+				this->fifo_pending = available - n;
+				res = n;
+			}
+		}
+	} else {
+		unsigned char buffer[ITG3200_STATUS_LENGTH];
+		res = this->readStatus(buffer) ? this->decodeStatus(buffer, measurements) : -1;
+	}
+	metrics_latency(METRIC_LAT_ITG3200, monotonic_ns() - start);
+	metrics_count(METRIC_ITG3200_READS);
+	if (res < 0) {
+		metrics_count(METRIC_ITG3200_ERRORS);
+		if (!ITG3200_QUIET) metrics_log("Error ITG3200: Could not read the data registers on the sensor.");
+	}
+	return res;
+}
+
+int ITG3200_GYRO::queueMeasurement() {
+	if (!this->bus) return 0;	// Not connected to sensor
+	if (this->read_mode == ITG3200_READ_FIFO) {
+		// Samples counted last time are there for sure; the new count is what is left behind them
+		int n = (this->fifo_pending < this->fifo_batch) ? this->fifo_pending : this->fifo_batch;
+		this->queued_samples = 0;
+		if (n > 0) {
+			if (!this->bus->queueRead(this->address, ITG3200_FIFO_R, this->queue_buffer + 2,
+				n*ITG3200_DATA_LENGTH, &this->queue_data_status)) return 0;
+			this->queued_samples = n;
+		}
+		return this->bus->queueRead(this->address, ITG3200_FIFO_COUNT, this->queue_buffer, 2, &this->queue_status);
+	}
+	if (this->read_mode == ITG3200_READ_BURST) {
+		return this->bus->queueRead(this->address, ITG3200_INT_STATUS,
+			this->queue_buffer, ITG3200_STATUS_LENGTH, &this->queue_status);
+	}
+	return 0;
+}
+
+int ITG3200_GYRO::getQueuedMeasurements(Vec3* measurements, int max) {
+	int status = this->queue_status;
+	this->queue_status = 0;
+	if (status == 0) return 0;		// Not flushed yet
+	metrics_count(METRIC_ITG3200_READS);
+	int res = -1;
+	if (this->read_mode == ITG3200_READ_FIFO) {
+		int n = this->queued_samples;
+		this->queued_samples = 0;
+		if (n > 0 && this->queue_data_status < 0) status = -1;
+		if (status > 0) {
+			if (n > max) n = max;		// Dropped, should not happen: ask for ITG3200_FIFO_BATCH
+			for (int i=0; i<n; i++) this->decode(this->queue_buffer + 2 + i*ITG3200_DATA_LENGTH, &measurements[i]);
+			metrics_count(METRIC_ITG3200_SAMPLES, n);
+			this->fifo_pending = this->checkCount((this->queue_buffer[0]<<8) | this->queue_buffer[1]);
+			res = n;
+		} else {
+			this->fifo_pending = 0;		// Not known what was read, count again
+		}
+	} else if (status > 0) {
+		res = this->decodeStatus(this->queue_buffer, measurements);
+	}
+	if (res < 0) {
+		metrics_count(METRIC_ITG3200_ERRORS);
+		if (!ITG3200_QUIET) metrics_log("Error ITG3200: Could not read the data registers on the sensor.");
+	}
+	return res;
+}
+
+void ITG3200_GYRO::setRate(int rate) {
+	// Sample rate = internal rate / (SMPLRT_DIV + 1), rounded to what the divider can do
+	if (rate <= 0) return;
+	int divider = (this->internal_rate + rate/2) / rate - 1;
+	if (divider < 0) divider = 0;
+	if (divider > 255) divider = 255;
+	if (this->writeByte(ITG3200_SMPLRT_DIV, (unsigned char)divider) < 0) return;
+	this->rate = this->internal_rate / (divider + 1);
+	if (this->read_mode == ITG3200_READ_FIFO) this->resetFifo();	// Drop samples at the old rate
+}
+
+int ITG3200_GYRO::getRate() const {
+	return this->rate;
+}
+
+void ITG3200_GYRO::setLowpass(int bandwidth) {
+	static const int bandwidths[7] = {256, 188, 98, 42, 20, 10, 5};
+	int cfg = -1;
+	for (int i=0; i<7; i++)
+		if (bandwidths[i] == bandwidth) cfg = i;
+	if (cfg < 0) return;
+	// FS_SEL must be 3 (+/- 2000 deg/s) for proper operation
+	if (this->writeByte(ITG3200_DLPF_FS, 0x18 | cfg) < 0) return;
+	// The internal sample rate depends on the filter, keep the output rate where it was
+	int old = this->internal_rate;
+	this->internal_rate = (cfg == 0) ? 8000 : 1000;
+	if (this->rate && old != this->internal_rate) this->setRate(this->rate);
+}
+
+void ITG3200_GYRO::decode(const unsigned char* buffer, Vec3* measurement) {
+	// X, Y, Z, each 16 bit two's complement, MSB first
+	static const float scale = M_PI / 180 / ITG3200_SCALE;
+	Vec3 data((int16_t)((buffer[0]<<8) | buffer[1]) * scale,
+	          (int16_t)((buffer[2]<<8) | buffer[3]) * scale,
+	          (int16_t)((buffer[4]<<8) | buffer[5]) * scale);
+	data = calibration_correct(CALIB_GYRO, this->use_calibration, data);
+	if (this->track_bias) this->trackBias(data);
+	*measurement = data - this->bias;
+}
+
+int ITG3200_GYRO::getBacklog() const {
+	return this->fifo_pending;
+}
+
+void ITG3200_GYRO::addAccel(const Vec3& accel) {
+	if (!this->track_bias) return;
+	this->accel_window.add(accel.data);
+	this->accel_fill++;
+}
+
+const Vec3& ITG3200_GYRO::getBias() const {
+	return this->bias;
+}
+
+int ITG3200_GYRO::isAtRest() const {
+	return this->at_rest;
+}
+
+unsigned long ITG3200_GYRO::getOverflows() const {
+	return this->overflows;
+}
+
+/********************
+ * PRIVATE FUNCTIONS
+ ********************/
+
+int ITG3200_GYRO::readByte(int reg) {
+	if (!this->bus) return -1;	// Not connected to sensor
+	int res = this->bus->readByte(this->address, reg);
+	if (res<0) {
+		if (!ITG3200_QUIET) {
+			fprintf(stderr,
+				"Error ITG3200: Could not read some data register (0x%02x) on the sensor.\n",
+				reg);
+		}
+		return -1;
+	}
+	return res;
+}
+
+int ITG3200_GYRO::writeByte(int reg, unsigned char data) {
+	if (!this->bus) return -1;	// Not connected to sensor
+	int res = this->bus->writeByte(this->address, reg, data);
+	if (res<0) {
+		if (!ITG3200_QUIET) {
+			fprintf(stderr,
+				"Error ITG3200: Could not write some data register (0x%02x) on the sensor.\n",
+				reg);
+		}
+		return -1;
+	}
+	return 1;
+}
+
+int ITG3200_GYRO::hasFifo() {
+	// The ITG-3200 has nothing at the FIFO registers, the MPU-3050 keeps what we write:
+	// gyro X, Y and Z into the FIFO, FIFO on and reset
+	if (this->writeByte(ITG3200_FIFO_EN, 0x70) < 0) return 0;
+	if (this->writeByte(ITG3200_USER_CTRL, 0x42) < 0) return 0;
+	int user_ctrl = this->readByte(ITG3200_USER_CTRL);
+	return this->readByte(ITG3200_FIFO_EN) == 0x70 && user_ctrl >= 0 && (user_ctrl & 0x40);
+}
+
+void ITG3200_GYRO::resetFifo() {
+	this->writeByte(ITG3200_USER_CTRL, 0x42);
+	this->fifo_pending = 0;
+}
+
+int ITG3200_GYRO::checkCount(int count) {
+	count &= 0x3FF;
+	if (count > ITG3200_FIFO_SIZE - ITG3200_DATA_LENGTH) {
+		// Full: samples were dropped and the next one may be cut in half. Start over.
+		this->overflows++;
+		metrics_count(METRIC_ITG3200_OVERFLOWS);
+		if (!ITG3200_QUIET) metrics_log("Error ITG3200: FIFO overflow, %d bytes", count);
+		this->resetFifo();
+		return 0;
+	}
+	return count / ITG3200_DATA_LENGTH;
+}
+
+int ITG3200_GYRO::readStatus(unsigned char* buffer) {
+	// INT_STATUS, TEMP and GYRO into buffer. Returns 1 on success, 0 if not.
+	if (this->read_mode != ITG3200_READ_WORD) {
+		return (this->bus->readBlock(this->address, ITG3200_INT_STATUS, buffer, ITG3200_STATUS_LENGTH)
+			== ITG3200_STATUS_LENGTH);
+	}
+	// Per-word fallback: the axes may come from different samples. Temperature is not read.
+	int status = this->bus->readByte(this->address, ITG3200_INT_STATUS);
+	if (status < 0) return 0;
+	buffer[0] = status;
+	buffer[1] = buffer[2] = 0;
+	if (!(status & 0x01)) return 1;		// Nothing new, spare the bus
+	for (int i=0; i<3; i++) {
+		int word = this->bus->readWord(this->address, ITG3200_GYRO_OUT + 2*i);
+		if (word<0) return 0;
+		buffer[3 + 2*i] = word & 0xFF;			// The byte at the register, here the MSB
+		buffer[3 + 2*i + 1] = (word>>8) & 0xFF;
+	}
+	return 1;
+}
+
+int ITG3200_GYRO::decodeStatus(const unsigned char* buffer, Vec3* measurements) {
+	// Only a sample that is new since the last read, or the bias tracker would see it twice
+	if (!(buffer[0] & 0x01)) return 0;
+	this->decode(buffer + 3, &measurements[0]);
+	metrics_count(METRIC_ITG3200_SAMPLES);
+	return 1;
+}
+
+void ITG3200_GYRO::trackBias(const Vec3& rate) {
+	// Called per sample, judges non-overlapping windows of ITG3200_REST_WINDOW samples
+	this->window.add(rate.data);
+	if (++this->window_fill < ITG3200_REST_WINDOW) return;
+	this->window_fill = 0;
+	fvector<3> mean = this->window.mean();
+	fvector<3> variance = this->window.variance();
+	float limit = this->rest_windows ? ITG3200_BIAS_STEP : ITG3200_BIAS_MAX;
+	// The accelerometer over (about) the same time: its window is a sliding one, fed all along
+	fvector<3> accel_variance = this->accel_window.variance();
+	this->at_rest = this->accel_window.full() && this->accel_fill > 0;
+	this->accel_fill = 0;
+	for (int i=0; i<3; i++) {
+		if (variance[i] > ITG3200_REST_STDDEV*ITG3200_REST_STDDEV
+			|| fabsf(mean[i] - this->bias[i]) > limit
+			|| accel_variance[i] > ITG3200_STILL_STDDEV*ITG3200_STILL_STDDEV) this->at_rest = 0;
+	}
+	if (!this->at_rest) return;
+	this->rest_windows++;
+	float gain = 1.0f / this->rest_windows;
+	if (gain < ITG3200_BIAS_GAIN) gain = ITG3200_BIAS_GAIN;
+	this->bias = this->bias + (mean - this->bias) * gain;
+}
@@ -0,0 +1,134 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * ITG-3200 gyroscope driver (i2c)
+ * Also drives the MPU-3050, the same gyro with a FIFO. When the FIFO is there the chip
+ * buffers every sample and one bus transaction fetches all of them since the last read;
+ * on a plain ITG-3200 the status and data registers are read in one burst and a sample
+ * is only taken when the data-ready flag says it is new.
+ */
+
+#ifndef _ITG3200_H
+#define _ITG3200_H
+
+#define ITG3200_QUIET 0			// Should we shut up if we screw up?
+#define ITG3200_FORCE 0			// Force use of i2c bus even if device driver is running?
+#define ITG3200_ADDRESS 0x68	// Address of the sensor on the bus, AD0 low (0x69 with AD0 high)
+#define ITG3200_ID 0x68			// WHO_AM_I bits 6:1, used to check communication during init
+
+// Registers
+#define ITG3200_WHO_AM_I 0x00
+#define ITG3200_FIFO_EN 0x12		// MPU-3050 only: what goes in the FIFO
+#define ITG3200_SMPLRT_DIV 0x15		// Sample rate = internal rate / (divider + 1)
+#define ITG3200_DLPF_FS 0x16		// Full scale (bits 4:3, must be 3) and low-pass filter (bits 2:0)
+#define ITG3200_INT_CFG 0x17
+#define ITG3200_INT_STATUS 0x1A		// Bit 0: new data, cleared by reading. MPU-3050 bit 7: FIFO overflow
+#define ITG3200_TEMP_OUT 0x1B
+#define ITG3200_GYRO_OUT 0x1D		// X, Y, Z, MSB first
+#define ITG3200_FIFO_COUNT 0x3A		// MPU-3050 only: bytes in the FIFO, MSB first
+#define ITG3200_FIFO_R 0x3C			// MPU-3050 only: reading pops the FIFO, the pointer stays here
+#define ITG3200_USER_CTRL 0x3D		// MPU-3050 only: bit 6 FIFO enable, bit 1 FIFO reset
+#define ITG3200_PWR_MGM 0x3E		// Bit 7 reset, bits 2:0 clock source
+
+#define ITG3200_DATA_LENGTH 6		// X, Y, Z MSB/LSB pairs
+#define ITG3200_STATUS_LENGTH 9		// INT_STATUS, temperature and data in one burst
+#define ITG3200_FIFO_SIZE 512		// Bytes
+#define ITG3200_FIFO_BATCH 32		// Samples per FIFO read at most
+#define ITG3200_SCALE 14.375		// LSB per deg/s
+
+// How the data is read, picked in init() from what the chip and the adapter support
+#define ITG3200_READ_FIFO 2			// FIFO count, then every buffered sample in one burst
+#define ITG3200_READ_BURST 1		// Status + data in one transaction, the latest sample only
+#define ITG3200_READ_WORD 0			// Status byte and three SMBus word reads, basic adapters
+
+#define ITG3200_DEFAULT_RATE 1000	// Sample rate [Hz]
+#define ITG3200_DEFAULT_LOWPASS 98	// Bandwidth of the low-pass filter [Hz]
+
+// At-rest bias tracking: the mean of every ITG3200_REST_WINDOW samples with all axes quieter
+// than ITG3200_REST_STDDEV is bias, if the accelerometer (addAccel()) was still over the same
+// time. Averaged over the first windows, then followed with gain ITG3200_BIAS_GAIN per window.
+// Only the first window may be anywhere up to ITG3200_BIAS_MAX, later ones within
+// ITG3200_BIAS_STEP of the bias so far. A quiet gyro alone would take a smooth slow turn for
+// bias; a still accelerometer rules out tilting and running motors, not a slow level yaw,
+// so clear track_bias whenever the quad may be turned: raptor does once it leaves the ground
+// (SensorAcquisition::setTrackBias()).
+#define ITG3200_REST_WINDOW 200
+#define ITG3200_REST_STDDEV 0.02	// [rad/s]
+#define ITG3200_STILL_STDDEV 0.015	// Accelerometer noise at rest, every axis [g]
+#define ITG3200_BIAS_MAX 0.7		// [rad/s], zero-rate offset of the chip is up to 40 deg/s
+#define ITG3200_BIAS_STEP 0.02		// [rad/s]
+#define ITG3200_BIAS_GAIN 0.05
+
+#include "matrix.h"
+#include "I2CBus.h"
+#include "LeastSquares.h"
+
+class ITG3200_GYRO {
+	public:
+		ITG3200_GYRO();
+		~ITG3200_GYRO();
+		// init(): Open connection, test, reset the chip, set rate and low-pass filter to the
+		// defaults and start the FIFO if there is one. Always call before doing other things
+		int init(int i2c_bus, int address = ITG3200_ADDRESS);
+		// getMeasurements(): Read the samples that are new since the last read, oldest first,
+		// at most max, in [rad/s]. Returns the number read, 0 if there is nothing new, -1 on error.
+		// Whatever is left in the FIFO comes with the next read.
+		int getMeasurements(Vec3* measurements, int max);
+		// queueMeasurement(): Add the reads to the bus queue, so they go out together with other
+		// devices on the next I2CBus::flush(). Then call getQueuedMeasurements(). From the FIFO
+		// this takes the samples counted by the previous read and counts again behind them, so
+		// it is one transaction and the first call only counts. Returns 0 if the reads cannot be
+		// queued (ITG3200_READ_WORD), use getMeasurements() then.
+		int queueMeasurement();
+		int getQueuedMeasurements(Vec3* measurements, int max);
+		// getBacklog(): Samples left in the FIFO at the last read, newer than the ones returned
+		int getBacklog() const;
+		// setRate(): Sample rate [Hz], 4..1000 (8000 without low-pass filter)
+		void setRate(int rate);
+		int getRate() const;
+		// setLowpass(): Bandwidth of the low-pass filter [Hz]: 256, 188, 98, 42, 20, 10 or 5
+		void setLowpass(int bandwidth);
+		// decode(): Convert ITG3200_DATA_LENGTH raw bytes to [rad/s], calibrated if use_calibration
+		// is set, minus the tracked bias. Feeds the bias tracker.
+		void decode(const unsigned char* buffer, Vec3* measurement);
+		// addAccel(): Accelerometer samples [g] taken alongside, without them the bias is not tracked
+		void addAccel(const Vec3& accel);
+		const Vec3& getBias() const;	// Tracked at rest [rad/s]
+		int isAtRest() const;			// During the last full window
+		unsigned long getOverflows() const;
+
+		// Variables:
+		int use_calibration;
+		int track_bias;			// At-rest bias tracking on (default) or off, off when the quad may turn
+		int read_mode;			// ITG3200_READ_*, may be lowered to force a slower path
+	private:
+		I2CBus* bus;						// Shared bus, NULL if not connected
+		int address;
+		int rate;
+		int internal_rate;					// 8000 without low-pass filter, 1000 with
+		int fifo_batch;						// Samples per FIFO read, limited by the adapter
+		int readByte(int reg);
+		int writeByte(int reg, unsigned char data);
+		int hasFifo();
+		void resetFifo();
+		int checkCount(int count);		// FIFO_COUNT: whole samples, 0 after an overflow
+		int readStatus(unsigned char* buffer);					// ITG3200_STATUS_LENGTH bytes
+		int decodeStatus(const unsigned char* buffer, Vec3* measurements);
+		// Count (2 bytes), then up to fifo_batch samples. Or status, temperature and data.
+		unsigned char queue_buffer[2 + ITG3200_FIFO_BATCH*ITG3200_DATA_LENGTH];
+		int queue_status;			// Of the count or status read
+		int queue_data_status;		// Of the FIFO data read
+		int queued_samples;			// Samples in the queued FIFO read
+		int fifo_pending;			// Samples in the FIFO at the last count
+		unsigned long overflows;
+		// Bias tracking
+		window_stats<3,ITG3200_REST_WINDOW> window;
+		unsigned int window_fill;			// Samples since the last window was judged
+		window_stats<3,ITG3200_REST_WINDOW> accel_window;
+		unsigned int accel_fill;			// Accelerometer samples since the last window was judged
+		unsigned int rest_windows;			// Windows at rest so far
+		int at_rest;
+		Vec3 bias;
+		void trackBias(const Vec3& rate);
+};
+
+#endif
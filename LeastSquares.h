@@ -0,0 +1,258 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Streaming statistics and least squares, for the calibrator and the gyro's bias tracking
+ * Samples are folded in as they arrive and then forgotten: memory does not grow
+ * with the number of samples, and solving at the end is a tiny fixed-size problem.
+ *	lsq_accumulator<4,3> lsq;			// X (3x4) * [raw; 1] = expected
+ *	lsq.add(regressors, expected);		// For every sample
+ *	fmatrix<3,4> X;
+ *	lsq.solve(&X);
+ */
+
+#ifndef _LEASTSQUARES_H
+#define _LEASTSQUARES_H
+
+#include <math.h>
+#include "matrix.h"
+
+// Running mean and variance of N-dimensional samples (Welford), stable for any count
+template <unsigned int N>
+class running_stats {
+	public:
+		running_stats() { this->reset(); }
+		void reset() {
+			n = 0;
+			for (unsigned int i=0; i<N; i++) mean_[i] = m2[i] = 0;
+		}
+		void add(const float* x) {
+			n++;
+			for (unsigned int i=0; i<N; i++) {
+				double delta = x[i] - mean_[i];
+				mean_[i] += delta / n;
+				m2[i] += delta * (x[i] - mean_[i]);
+			}
+		}
+		unsigned long count() const { return n; }
+		fvector<N> mean() const {
+			fvector<N> result;
+			for (unsigned int i=0; i<N; i++) result[i] = mean_[i];
+			return result;
+		}
+		fvector<N> variance() const {		// Sample variance, 0 below two samples
+			fvector<N> result;
+			for (unsigned int i=0; i<N; i++) result[i] = (n > 1) ? m2[i] / (n - 1) : 0;
+			return result;
+		}
+		fvector<N> stddev() const {
+			fvector<N> result = this->variance();
+			for (unsigned int i=0; i<N; i++) result[i] = sqrtf(result[i]);
+			return result;
+		}
+	private:
+		unsigned long n;
+		double mean_[N];
+		double m2[N];		// Sum of squared differences from the current mean
+};
+
+// Mean and variance over the last W samples only, e.g. to tell whether a sensor is at rest
+template <unsigned int N, unsigned int W>
+class window_stats {
+	public:
+		window_stats() { this->reset(); }
+		void reset() {
+			n = 0;
+			head = 0;
+			for (unsigned int i=0; i<N; i++) sum[i] = sum2[i] = 0;
+		}
+		void add(const float* x) {
+			float* slot = window[head];
+			for (unsigned int i=0; i<N; i++) {
+				if (n == W) {		// Drop the oldest sample from the sums
+					sum[i] -= slot[i];
+					sum2[i] -= (double)slot[i]*slot[i];
+				}
+				slot[i] = x[i];
+				sum[i] += x[i];
+				sum2[i] += (double)x[i]*x[i];
+			}
+			head = (head + 1) % W;
+			if (n < W) n++;
+		}
+		int full() const { return n == W; }
+		fvector<N> mean() const {
+			fvector<N> result;
+			for (unsigned int i=0; i<N; i++) result[i] = n ? sum[i] / n : 0;
+			return result;
+		}
+		fvector<N> variance() const {		// Sample variance, 0 below two samples
+			fvector<N> result;
+			for (unsigned int i=0; i<N; i++) {
+				double v = (n > 1) ? (sum2[i] - sum[i]*sum[i]/n) / (n - 1) : 0;
+				result[i] = (v > 0) ? v : 0;
+			}
+			return result;
+		}
+	private:
+		unsigned int n;
+		unsigned int head;			// Next slot to write
+		float window[W][N];
+		double sum[N];
+		double sum2[N];
+};
+
+// Least squares X * a = b over all samples (a: N regressors, b: M outputs), via the
+// normal equations AᵀA Xᵀ = Aᵀb, accumulated in double and solved with cholesky_factor().
+template <unsigned int N, unsigned int M>
+class lsq_accumulator {
+	public:
+		lsq_accumulator() { this->reset(); }
+		void reset() {
+			n = 0;
+			weight_sum = 0;
+			btb = 0;
+			for (unsigned int i=0; i<N; i++) {
+				for (unsigned int j=0; j<N; j++) AtA[i][j] = 0;
+				for (unsigned int j=0; j<M; j++) Atb[i][j] = 0;
+			}
+		}
+		void add(const float* a, const float* b, float weight = 1) {
+			// Only the lower triangle of AᵀA, it is symmetric
+			for (unsigned int i=0; i<N; i++) {
+				double wa = weight * (double)a[i];
+				for (unsigned int j=0; j<=i; j++) AtA[i][j] += wa * a[j];
+				for (unsigned int j=0; j<M; j++) Atb[i][j] += wa * b[j];
+			}
+			for (unsigned int j=0; j<M; j++) btb += weight * (double)b[j] * b[j];
+			weight_sum += weight;
+			n++;
+		}
+		void add(const fvector<N>& a, const fvector<M>& b, float weight = 1) {
+			this->add(a.data, b.data, weight);
+		}
+		unsigned long count() const { return n; }
+
+		// solve(): Returns 1 if successful, 0 if the samples do not determine X
+		// (AᵀA not positive definite: too few or degenerate samples)
+		int solve(fmatrix<M,N>* X) const {
+			double L[N][N];
+			for (unsigned int i=0; i<N; i++)
+				for (unsigned int j=0; j<=i; j++) L[i][j] = AtA[i][j];
+			if (!cholesky_factor<N>(&L[0][0], N, N)) return 0;
+			for (unsigned int c=0; c<M; c++) {
+				double x[N];
+				for (unsigned int i=0; i<N; i++) x[i] = Atb[i][c];
+				cholesky_solve<N>(&L[0][0], N, N, x);
+				for (unsigned int i=0; i<N; i++) X->data[c][i] = x[i];
+			}
+			return 1;
+		}
+
+		// rms(): Root mean square of the residual |X a - b| over all samples added, without
+		// revisiting them: |Xa - b|² summed = bᵀb - 2 tr(X Aᵀb) + tr(X AᵀA Xᵀ)
+		float rms(const fmatrix<M,N>& X) const {
+			if (!(weight_sum > 0)) return 0;
+			double sum = btb;
+			for (unsigned int c=0; c<M; c++) {
+				for (unsigned int i=0; i<N; i++) {
+					sum -= 2 * X.data[c][i] * Atb[i][c];
+					for (unsigned int j=0; j<N; j++) {
+						double ata = (j <= i) ? AtA[i][j] : AtA[j][i];
+						sum += X.data[c][i] * ata * X.data[c][j];
+					}
+				}
+			}
+			return (sum > 0) ? sqrt(sum / weight_sum) : 0;
+		}
+
+	private:
+		unsigned long n;
+		double weight_sum;
+		double AtA[N][N];		// Lower triangle
+		double Atb[N][M];
+		double btb;
+};
+
+// Ellipsoid fit for magnetometer calibration (hard iron offset + soft iron matrix).
+// Samples from all orientations lie on an ellipsoid; the fit finds the affine map that
+// takes them to a sphere of the same mean radius:
+//	calibrated = M * raw + offset		(M symmetric)
+// Every sample updates the sums of a linear least squares fit of the quadric
+//	ax² + by² + cz² + 2dxy + 2exz + 2fyz + 2gx + 2hy + 2iz = 1
+// so memory is fixed and solve() can run at any time, e.g. to watch it converge.
+class ellipsoid_fit {
+	public:
+		ellipsoid_fit() { this->reset(); }
+		void reset() {
+			lsq.reset();
+			scale = 0;
+		}
+		void add(const Vec3& raw) {
+			// Scaled by the first sample's norm, keeps the quartic sums well conditioned
+			if (!(scale > 0)) {
+				scale = raw.norm();
+				if (!(scale > 0)) return;
+			}
+			float x = raw[0]/scale, y = raw[1]/scale, z = raw[2]/scale;
+			float a[9] = {x*x, y*y, z*z, 2*x*y, 2*x*z, 2*y*z, 2*x, 2*y, 2*z};
+			float one = 1;
+			lsq.add(a, &one);
+		}
+		unsigned long count() const { return lsq.count(); }
+
+		// solve(): Returns 1 if successful, 0 if the samples do not determine an ellipsoid
+		// (too few, or not spread over enough orientations). field: the radius [raw units]
+		int solve(Mat3x4* calib, float* field = NULL) const {
+			fmatrix<1,9> p;
+			if (!lsq.solve(&p)) return 0;
+			double Q[3][3] = {{p(0,0), p(0,3), p(0,4)},
+			                  {p(0,3), p(0,1), p(0,5)},
+			                  {p(0,4), p(0,5), p(0,2)}};
+			double u[3] = {p(0,6), p(0,7), p(0,8)};
+
+			// Center: Q c = -u. Then (r - c)ᵀ Q (r - c) = 1 + cᵀQc = k
+			double L[3][3], center[3] = {-u[0], -u[1], -u[2]};
+			for (int i=0; i<3; i++)
+				for (int j=0; j<3; j++) L[i][j] = Q[i][j];
+			if (!cholesky_factor<3>(&L[0][0], 3, 3)) return 0;	// Not an ellipsoid
+			cholesky_solve<3>(&L[0][0], 3, 3, center);
+			double k = 1;
+			for (int i=0; i<3; i++)
+				for (int j=0; j<3; j++) k += center[i]*Q[i][j]*center[j];
+			if (!(k > 0)) return 0;
+
+			// Soft iron: W = sqrt(Q/k) maps the ellipsoid to the unit sphere. Rescaled by the
+			// geometric mean radius, so the field keeps its magnitude.
+			double A[3][3], V[3][3], lambda[3];
+			for (int i=0; i<3; i++)
+				for (int j=0; j<3; j++) A[i][j] = Q[i][j]/k;
+			if (!jacobi_eigen<3>(&A[0][0], 3, 3, lambda, &V[0][0], 3)) return 0;
+			if (!(lambda[0] > 0 && lambda[1] > 0 && lambda[2] > 0)) return 0;
+			double radius = pow(lambda[0]*lambda[1]*lambda[2], -1.0/6);
+			for (int i=0; i<3; i++) {
+				for (int j=0; j<3; j++) {
+					double w = 0;
+					for (int e=0; e<3; e++) w += V[i][e]*sqrt(lambda[e])*V[j][e];
+					calib->data[i][j] = radius*w;
+				}
+			}
+			for (int i=0; i<3; i++) {
+				double offset = 0;
+				for (int j=0; j<3; j++) offset -= calib->data[i][j]*center[j]*scale;
+				calib->data[i][3] = offset;
+			}
+			if (field) *field = radius*scale;
+			return 1;
+		}
+		// RMS of the quadric residual, 0 for samples exactly on the ellipsoid [1]
+		float rms() const {
+			fmatrix<1,9> p;
+			if (!lsq.solve(&p)) return 0;
+			return lsq.rms(p);
+		}
+
+	private:
+		lsq_accumulator<9,1> lsq;
+		float scale;		// Raw units per fit unit
+};
+
+#endif
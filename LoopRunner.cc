@@ -0,0 +1,157 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Fixed-rate loop runner
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "LoopRunner.h"
+#include "timing.h"
+#include "Metrics.h"
+
+/********************
+ * PUBLIC FUNCTIONS
+ ********************/
+
+LoopRunner::LoopRunner(int rate) : running(0) {
+	this->rate = (rate > 0) ? rate : 1;
+	period = 1000000000ll / this->rate;
+	task_count = 0;
+	recorder = NULL;
+	this->resetStats();
+}
+
+int LoopRunner::addTask(loop_task task, void* arg, int divider) {
+	if (task_count >= LOOP_MAX_TASKS || !task || divider < 1) return 0;
+	tasks[task_count].task = task;
+	tasks[task_count].arg = arg;
+	tasks[task_count].divider = divider;
+	task_count++;
+	return 1;
+}
+
+int LoopRunner::setRealtime(int priority) {
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+	int res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (res != 0) {
+		if (!LOOP_QUIET) fprintf(stderr, "Error LoopRunner: SCHED_FIFO priority %d failed: %s\n", priority, strerror(res));
+		return 0;
+	}
+	return 1;
+}
+
+int LoopRunner::lockMemory() {
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		if (!LOOP_QUIET) fprintf(stderr, "Error LoopRunner: mlockall failed: %s\n", strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+int LoopRunner::setAffinity(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (res != 0) {
+		if (!LOOP_QUIET) fprintf(stderr, "Error LoopRunner: Pinning to cpu %d failed: %s\n", cpu, strerror(res));
+		return 0;
+	}
+	return 1;
+}
+
+void LoopRunner::setRecorder(FlightRecorder* recorder) {
+	this->recorder = recorder;
+}
+
+void LoopRunner::run() {
+	running.store(1);
+	unsigned long tick = 0;
+	int64_t deadline = monotonic_ns() + period;
+	int64_t last_start = 0;
+	struct timespec ts;
+	
+	while (running.load(std::memory_order_relaxed)) {
+		ts.tv_sec = deadline / 1000000000ll;
+		ts.tv_nsec = deadline % 1000000000ll;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+			if (!running.load(std::memory_order_relaxed)) return;
+		}
+		
+		int64_t start = monotonic_ns();
+		int64_t jitter = start - deadline;
+		if (jitter < stats.jitter_min) stats.jitter_min = jitter;
+		if (jitter > stats.jitter_max) stats.jitter_max = jitter;
+		stats.jitter_sum += jitter;
+		stats.jitter_sum2 += (double)jitter*jitter;
+		int64_t last_period = last_start ? start - last_start : 0;
+		if (last_start) metrics_latency(METRIC_LAT_LOOP_PERIOD, last_period);
+		last_start = start;
+		
+		for (int i=0; i<task_count; i++) {
+			if (tick % tasks[i].divider == 0) {
+				tasks[i].task(tasks[i].arg, (float)tasks[i].divider / rate);
+			}
+		}
+		tick++;
+		stats.ticks++;
+		
+		int64_t stop = monotonic_ns();
+		int64_t exec = stop - start;
+		if (exec > stats.exec_max) stats.exec_max = exec;
+		stats.exec_sum += exec;
+		metrics_latency(METRIC_LAT_LOOP_TASKS, exec);
+		if (recorder) recorder->record(RECORD_LOOP, start, last_period, jitter, exec);
+		
+		deadline += period;
+		if (stop >= deadline) {
+			// Overrun: drop the deadlines already passed but stay in phase, no burst of catch-up ticks
+			int64_t missed = (stop - deadline) / period + 1;
+			stats.overruns++;
+			metrics_count(METRIC_LOOP_OVERRUNS);
+			stats.skipped += missed;
+			deadline += missed * period;
+		}
+	}
+}
+
+void LoopRunner::stop() {
+	running.store(0);
+}
+
+int LoopRunner::getRate() const {
+	return rate;
+}
+
+const loop_stats& LoopRunner::getStats() const {
+	return stats;
+}
+
+void LoopRunner::resetStats() {
+	memset(&stats, 0, sizeof(stats));
+	stats.jitter_min = INT64_MAX;
+	stats.jitter_max = INT64_MIN;
+}
+
+void LoopRunner::printStats(FILE* out) const {
+	if (stats.ticks == 0) {
+		fprintf(out, "Loop %d Hz: no ticks yet\n", rate);
+		return;
+	}
+	double mean = stats.jitter_sum / stats.ticks;
+	double var = stats.jitter_sum2 / stats.ticks - mean*mean;
+	fprintf(out, "Loop %d Hz: %lu ticks, %lu overruns (%lu periods skipped)\n",
+		rate, stats.ticks, stats.overruns, stats.skipped);
+	fprintf(out, "  jitter min %lld / mean %.0f / max %lld / std %.0f ns\n",
+		(long long)stats.jitter_min, mean, (long long)stats.jitter_max, sqrt(var > 0 ? var : 0));
+	fprintf(out, "  tasks  mean %.0f / max %lld ns of a %lld ns period\n",
+		stats.exec_sum / stats.ticks, (long long)stats.exec_max, (long long)period);
+}
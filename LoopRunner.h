@@ -0,0 +1,70 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Fixed-rate loop runner
+ * Runs the registered tasks on absolute CLOCK_MONOTONIC deadlines, so the loop
+ * rate does not drift with the time the tasks take, and keeps statistics on how
+ * late every period starts (jitter) and how often the tasks overrun the period.
+ */
+ 
+#ifndef _LOOPRUNNER_H
+#define _LOOPRUNNER_H
+
+#define LOOP_QUIET 0
+#define LOOP_MAX_TASKS 8
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include "Recorder.h"
+
+// Task callback: arg as registered, dt = time between two runs of this task [s]
+typedef void (*loop_task)(void* arg, float dt);
+
+struct loop_stats {
+	unsigned long ticks;		// Periods run
+	unsigned long overruns;		// Periods that ended past the next deadline, late wake-up or slow tasks
+	unsigned long skipped;		// Deadlines dropped after an overrun
+	int64_t jitter_min;			// Wake-up lateness [ns]
+	int64_t jitter_max;
+	double jitter_sum;
+	double jitter_sum2;
+	int64_t exec_max;			// Longest time spent in the tasks [ns]
+	double exec_sum;
+};
+
+class LoopRunner {
+	public:
+		LoopRunner(int rate);		// [Hz]
+		// Task runs every divider-th period, in the order added. Returns 1 if successful.
+		int addTask(loop_task task, void* arg, int divider);
+		
+		// Real-time setup, call before run(). Each returns 1 if successful, 0 if not (e.g. no privileges).
+		int setRealtime(int priority);	// SCHED_FIFO, 1..99
+		int lockMemory();				// mlockall, no page faults in the loop
+		int setAffinity(int cpu);		// Pin the loop thread to one core
+		void setRecorder(FlightRecorder* recorder);	// Record the timing of every period (NULL: off)
+		
+		void run();						// Blocks until stop()
+		void stop();					// Safe from a signal handler or another thread
+		
+		int getRate() const;
+		const loop_stats& getStats() const;	// Only consistent from inside a task or after run()
+		void resetStats();
+		void printStats(FILE* out) const;
+		
+	private:
+		struct task_entry {
+			loop_task task;
+			void* arg;
+			int divider;
+		};
+		int rate;
+		int64_t period;				// [ns]
+		task_entry tasks[LOOP_MAX_TASKS];
+		int task_count;
+		std::atomic<int> running;
+		loop_stats stats;
+		FlightRecorder* recorder;
+};
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Metrics: lock-free counters, latency histograms and a deferred log
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "Metrics.h"
+#include "timing.h"
+
+std::atomic<unsigned long> metrics_counters[METRIC_COUNTERS];
+metric_histogram metrics_latencies[METRIC_LATENCIES];
+int metrics_enabled = 1;
+
+static const char* counter_names[METRIC_COUNTERS] = {
+	"i2c transactions", "i2c errors", "i2c flushes", "bma020 reads", "bma020 errors",
+	"srf02 ranges", "srf02 errors", "imu updates", "imu accel skipped", "loop overruns",
+	"acquisition overruns", "log dropped", "itg3200 reads", "itg3200 errors", "itg3200 overflows",
+	"itg3200 samples", "hmc5883l reads", "hmc5883l errors", "hmc5883l stale",
+	"gpio edges", "gpio edges missed", "hmc5883l overflows"
+};
+
+static const char* latency_names[METRIC_LATENCIES] = {
+	"i2c transaction", "i2c flush", "bma020 measurement", "srf02 poll", "imu update",
+	"loop period", "loop tasks", "acquisition cycle", "itg3200 measurement",
+	"hmc5883l measurement", "data-ready latency"
+};
+
+/********************
+ * DEFERRED LOG
+ ********************/
+
+// Bounded multi-producer ring: a producer claims a slot by advancing log_head, the
+// slot's sequence number tells the consumer when the copy into it is complete.
+struct log_slot {
+	std::atomic<unsigned int> sequence;
+	uint64_t timestamp;
+	const char* format;
+	int a, b;
+};
+
+static log_slot log_slots[METRICS_LOG_SIZE];
+static std::atomic<unsigned int> log_head(0);
+static unsigned int log_tail = 0;		// Consumer only
+
+static struct log_init {
+	log_init() {
+		for (unsigned int i=0; i<METRICS_LOG_SIZE; i++) log_slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+} log_init_instance;
+
+void metrics_log(const char* format, int a, int b) {
+	unsigned int pos = log_head.load(std::memory_order_relaxed);
+	for (;;) {
+		log_slot& slot = log_slots[pos & (METRICS_LOG_SIZE-1)];
+		int diff = (int)(slot.sequence.load(std::memory_order_acquire) - pos);
+		if (diff == 0) {
+			if (log_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				slot.timestamp = monotonic_ns();
+				slot.format = format;
+				slot.a = a;
+				slot.b = b;
+				slot.sequence.store(pos + 1, std::memory_order_release);
+				return;
+			}
+		} else if (diff < 0) {
+			metrics_count(METRIC_LOG_DROPPED);		// Full
+			return;
+		} else {
+			pos = log_head.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+int metrics_flush_log(FILE* out) {
+	int n = 0;
+	for (;;) {
+		log_slot& slot = log_slots[log_tail & (METRICS_LOG_SIZE-1)];
+		if (slot.sequence.load(std::memory_order_acquire) != log_tail + 1) break;	// Empty or still being written
+		fprintf(out, "[%10.6f] ", slot.timestamp * 1e-9);
+		fprintf(out, slot.format, slot.a, slot.b);
+		fputc('\n', out);
+		slot.sequence.store(log_tail + METRICS_LOG_SIZE, std::memory_order_release);
+		log_tail++;
+		n++;
+	}
+	return n;
+}
+
+/********************
+ * SNAPSHOTS
+ ********************/
+
+void metrics_take(metrics_snapshot* snapshot) {
+	snapshot->timestamp = monotonic_ns();
+	for (int i=0; i<METRIC_COUNTERS; i++) {
+		snapshot->counters[i] = metrics_counters[i].load(std::memory_order_relaxed);
+	}
+	for (int i=0; i<METRIC_LATENCIES; i++) {
+		metric_histogram& h = metrics_latencies[i];
+		for (int b=0; b<METRICS_BUCKETS; b++) {
+			snapshot->latencies[i].buckets[b] = h.buckets[b].load(std::memory_order_relaxed);
+		}
+		snapshot->latencies[i].count = h.count.load(std::memory_order_relaxed);
+		snapshot->latencies[i].sum = h.sum.load(std::memory_order_relaxed);
+		snapshot->latencies[i].max = h.max.load(std::memory_order_relaxed);
+	}
+}
+
+void metrics_diff(const metrics_snapshot* now, const metrics_snapshot* before, metrics_snapshot* out) {
+	out->timestamp = now->timestamp - before->timestamp;
+	for (int i=0; i<METRIC_COUNTERS; i++) out->counters[i] = now->counters[i] - before->counters[i];
+	for (int i=0; i<METRIC_LATENCIES; i++) {
+		for (int b=0; b<METRICS_BUCKETS; b++) {
+			out->latencies[i].buckets[b] = now->latencies[i].buckets[b] - before->latencies[i].buckets[b];
+		}
+		out->latencies[i].count = now->latencies[i].count - before->latencies[i].count;
+		out->latencies[i].sum = now->latencies[i].sum - before->latencies[i].sum;
+		out->latencies[i].max = now->latencies[i].max;
+	}
+}
+
+uint64_t metrics_percentile(const metrics_snapshot* snapshot, int latency, double p) {
+	unsigned long total = 0;
+	for (int b=0; b<METRICS_BUCKETS; b++) total += snapshot->latencies[latency].buckets[b];
+	if (total == 0) return 0;
+	unsigned long rank = (unsigned long)(p * total);
+	if (rank >= total) rank = total - 1;
+	unsigned long seen = 0;
+	for (int b=0; b<METRICS_BUCKETS; b++) {
+		seen += snapshot->latencies[latency].buckets[b];
+		if (seen > rank) return (b == 0) ? 0 : (1ull << b) - 1;
+	}
+	return snapshot->latencies[latency].max;
+}
+
+void metrics_print(const metrics_snapshot* snapshot, FILE* out) {
+	fprintf(out, "Counters:\n");
+	for (int i=0; i<METRIC_COUNTERS; i++) {
+		if (snapshot->counters[i]) fprintf(out, "  %-22s %lu\n", counter_names[i], snapshot->counters[i]);
+	}
+	fprintf(out, "Latencies [ns]:              count       mean     p50 <=     p99 <=        max\n");
+	for (int i=0; i<METRIC_LATENCIES; i++) {
+		unsigned long count = snapshot->latencies[i].count;
+		if (!count) continue;
+		fprintf(out, "  %-22s %10lu %10.0f %10llu %10llu %10llu\n", latency_names[i], count,
+			(double)snapshot->latencies[i].sum / count,
+			(unsigned long long)metrics_percentile(snapshot, i, 0.5),
+			(unsigned long long)metrics_percentile(snapshot, i, 0.99),
+			(unsigned long long)snapshot->latencies[i].max);
+	}
+}
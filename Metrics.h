@@ -0,0 +1,125 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Metrics: lock-free counters, latency histograms and a deferred log
+ * Cheap enough for the hot path: a counter is one relaxed atomic add, a latency
+ * a few, and metrics_log() only copies its arguments into a ring. The printing
+ * (and the syscall that comes with it) happens later, in metrics_flush_log(),
+ * called from wherever a slow write does not hurt.
+ *	uint64_t start = monotonic_ns();
+ *	...
+ *	metrics_latency(METRIC_LAT_IMU_UPDATE, monotonic_ns() - start);
+ */
+ 
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#define METRICS_BUCKETS 32			// Latency bucket b holds [2^(b-1), 2^b) ns, the last one everything above
+#define METRICS_LOG_SIZE 256		// Pending log events, power of two. Full ring drops (and counts) new ones
+
+// Counters
+#define METRIC_I2C_TRANSACTIONS 0
+#define METRIC_I2C_ERRORS 1			// Failed transactions, a NAK of a busy SRF02 included
+#define METRIC_I2C_FLUSHES 2
+#define METRIC_BMA020_READS 3
+#define METRIC_BMA020_ERRORS 4
+#define METRIC_SRF02_RANGES 5
+#define METRIC_SRF02_ERRORS 6		// Unrealistic or missing ranges
+#define METRIC_IMU_UPDATES 7
+#define METRIC_IMU_ACCEL_SKIPPED 8	// Updates without accel correction, norm out of range
+#define METRIC_LOOP_OVERRUNS 9
+#define METRIC_ACQ_OVERRUNS 10
+#define METRIC_LOG_DROPPED 11
+#define METRIC_ITG3200_READS 12
+#define METRIC_ITG3200_ERRORS 13
+#define METRIC_ITG3200_OVERFLOWS 14	// FIFO ran full, samples lost
+#define METRIC_ITG3200_SAMPLES 15	// Gyro samples read, several per read from the FIFO
+#define METRIC_HMC5883L_READS 16
+#define METRIC_HMC5883L_ERRORS 17	// Failed reads
+#define METRIC_HMC5883L_STALE 18	// Reads that found no new sample
+#define METRIC_GPIO_EDGES 19	// Data-ready edges taken
+#define METRIC_GPIO_MISSED 20	// Edges that came while the previous one was still being served
+#define METRIC_HMC5883L_OVERFLOWS 21	// New samples dropped because the field is beyond the gain
+#define METRIC_COUNTERS 22
+
+// Latency histograms
+#define METRIC_LAT_I2C 0				// One transaction
+#define METRIC_LAT_I2C_FLUSH 1			// One batched flush
+#define METRIC_LAT_BMA020 2				// getMeasurement()
+#define METRIC_LAT_SRF02 3				// getRange() / poll()
+#define METRIC_LAT_IMU_UPDATE 4			// One filter step
+#define METRIC_LAT_LOOP_PERIOD 5		// Start to start of the control loop
+#define METRIC_LAT_LOOP_TASKS 6			// Time spent in the loop tasks
+#define METRIC_LAT_ACQ_CYCLE 7			// One acquisition cycle, all bus work
+#define METRIC_LAT_ITG3200 8			// getMeasurements()
+#define METRIC_LAT_HMC5883L 9			// getMeasurement()
+#define METRIC_LAT_DRDY 10		// Data-ready edge to its sample in the acquisition ring
+#define METRIC_LATENCIES 11
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+struct metric_histogram {
+	std::atomic<unsigned long> buckets[METRICS_BUCKETS];
+	std::atomic<unsigned long> count;
+	std::atomic<uint64_t> sum;			// [ns]
+	std::atomic<uint64_t> max;			// [ns]
+};
+
+// Plain copy, taken while everything keeps running. Each value is exact, the set is not
+// one instant: a latency may be counted in 'count' and not yet in its bucket.
+struct metrics_snapshot {
+	uint64_t timestamp;					// monotonic_ns() when taken
+	unsigned long counters[METRIC_COUNTERS];
+	struct {
+		unsigned long buckets[METRICS_BUCKETS];
+		unsigned long count;
+		uint64_t sum;
+		uint64_t max;
+	} latencies[METRIC_LATENCIES];
+};
+
+extern std::atomic<unsigned long> metrics_counters[METRIC_COUNTERS];
+extern metric_histogram metrics_latencies[METRIC_LATENCIES];
+extern int metrics_enabled;
+
+// metrics_enable(): Turn counting off (0) or back on, set before starting threads.
+// For offline tools running the same code on many cores, where the shared counters
+// would be the bottleneck.
+static inline void metrics_enable(int on) {
+	metrics_enabled = on;
+}
+
+static inline void metrics_count(int counter, unsigned long n = 1) {
+	if (!metrics_enabled) return;
+	metrics_counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+static inline int metrics_bucket(uint64_t ns) {
+	int b = ns ? 64 - __builtin_clzll(ns) : 0;
+	return (b < METRICS_BUCKETS) ? b : METRICS_BUCKETS - 1;
+}
+
+static inline void metrics_latency(int latency, uint64_t ns) {
+	if (!metrics_enabled) return;
+	metric_histogram& h = metrics_latencies[latency];
+	h.buckets[metrics_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+	h.count.fetch_add(1, std::memory_order_relaxed);
+	h.sum.fetch_add(ns, std::memory_order_relaxed);
+	uint64_t max = h.max.load(std::memory_order_relaxed);
+	while (ns > max && !h.max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+}
+
+// metrics_log(): Queue a message for metrics_flush_log(). format must be a string literal
+// (only the pointer is kept) with at most two int conversions. Any thread, never blocks.
+void metrics_log(const char* format, int a = 0, int b = 0);
+// metrics_flush_log(): Print and remove the queued messages, oldest first. One thread at a time.
+int metrics_flush_log(FILE* out);
+
+void metrics_take(metrics_snapshot* snapshot);
+// metrics_diff(): What happened between two snapshots (max is the one of 'now', not of the interval)
+void metrics_diff(const metrics_snapshot* now, const metrics_snapshot* before, metrics_snapshot* out);
+void metrics_print(const metrics_snapshot* snapshot, FILE* out);
+uint64_t metrics_percentile(const metrics_snapshot* snapshot, int latency, double p);	// Bucket upper bound [ns]
+
+#endif
@@ -0,0 +1,287 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Flight data recorder
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Recorder.h"
+#include "timing.h"
+
+/********************
+ * PUBLIC FUNCTIONS
+ ********************/
+
+FlightRecorder::FlightRecorder() : head(0), flushes(0), running(0) {
+	handle = -1;
+	map = NULL;
+	map_size = 0;
+	header = NULL;
+	records = NULL;
+	capacity = 0;
+	flushed = 0;
+}
+
+FlightRecorder::~FlightRecorder() {
+	this->close();
+}
+
+int FlightRecorder::open(const char* filename, unsigned long records) {
+	if (map || records == 0) return 0;
+	handle = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (handle < 0) {
+		if (!RECORDER_QUIET) fprintf(stderr, "Error Recorder: Could not open %s: %s\n", filename, strerror(errno));
+		return 0;
+	}
+	// Allocate the blocks now, not on the first write to each page in flight
+	map_size = RECORDER_HEADER_SIZE + records * sizeof(flight_record);
+	int res = posix_fallocate(handle, 0, map_size);
+	if (res != 0) {
+		if (!RECORDER_QUIET) fprintf(stderr, "Error Recorder: Could not allocate %lu bytes: %s\n",
+			(unsigned long)map_size, strerror(res));
+		::close(handle);
+		handle = -1;
+		return 0;
+	}
+	map = (unsigned char*)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, handle, 0);
+	if (map == MAP_FAILED) {
+		if (!RECORDER_QUIET) fprintf(stderr, "Error Recorder: Could not map %s: %s\n", filename, strerror(errno));
+		map = NULL;
+		::close(handle);
+		handle = -1;
+		return 0;
+	}
+	
+	header = (recorder_header*)map;
+	this->records = (flight_record*)(map + RECORDER_HEADER_SIZE);
+	capacity = records;
+	head.store(0);
+	flushed = 0;
+	
+	memset(header, 0, sizeof(recorder_header));
+	memcpy(header->magic, RECORDER_MAGIC, sizeof(header->magic));
+	header->version = RECORDER_VERSION;
+	header->record_size = sizeof(flight_record);
+	header->capacity = capacity;
+	header->written = 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header->start = monotonic_ns();
+	header->start_realtime = (int64_t)ts.tv_sec*1000000000ll + ts.tv_nsec;
+	msync(map, RECORDER_HEADER_SIZE, MS_SYNC);
+	
+	running.store(1);
+	res = pthread_create(&thread, NULL, FlightRecorder::run, this);
+	if (res != 0) {
+		if (!RECORDER_QUIET) fprintf(stderr, "Error Recorder: Could not start flusher: %s\n", strerror(res));
+		running.store(0);
+		this->close();
+		return 0;
+	}
+	return 1;
+}
+
+void FlightRecorder::close() {
+	if (running.exchange(0)) pthread_join(thread, NULL);
+	if (map) {
+		this->flush();
+		munmap(map, map_size);
+		map = NULL;
+		header = NULL;
+		records = NULL;
+	}
+	if (handle >= 0) {
+		::close(handle);
+		handle = -1;
+	}
+}
+
+int FlightRecorder::isOpen() const {
+	return map != NULL;
+}
+
+int FlightRecorder::record(int type, uint64_t timestamp, const float* values, int count) {
+	if (!records) return 0;
+	if (count > RECORDER_VALUES) count = RECORDER_VALUES;
+	uint64_t index = head.fetch_add(1, std::memory_order_relaxed);
+	flight_record* r = records + (index % capacity);
+	// Invalidate first, so a reader never takes a half-overwritten old record for a good one
+	__atomic_store_n(&r->sequence, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	r->timestamp = timestamp;
+	r->type = type;
+	r->count = count;
+	for (int i=0; i<count; i++) r->values[i] = values[i];
+	for (int i=count; i<RECORDER_VALUES; i++) r->values[i] = 0;
+	__atomic_store_n(&r->sequence, (uint32_t)(index + 1), __ATOMIC_RELEASE);
+	return 1;
+}
+
+int FlightRecorder::record(int type, uint64_t timestamp, float a, float b, float c) {
+	float values[3] = {a, b, c};
+	return this->record(type, timestamp, values, 3);
+}
+
+unsigned long FlightRecorder::getWritten() const {
+	return head.load(std::memory_order_relaxed);
+}
+
+unsigned long FlightRecorder::getFlushes() const {
+	return flushes.load(std::memory_order_relaxed);
+}
+
+/********************
+ * PRIVATE FUNCTIONS
+ ********************/
+
+void* FlightRecorder::run(void* self) {
+	((FlightRecorder*)self)->flusher();
+	return NULL;
+}
+
+void FlightRecorder::flusher() {
+	struct timespec interval;
+	interval.tv_sec = (time_t)RECORDER_FLUSH_INTERVAL;
+	interval.tv_nsec = (long)((RECORDER_FLUSH_INTERVAL - interval.tv_sec) * 1e9);
+	while (running.load(std::memory_order_relaxed)) {
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &interval, NULL);
+		this->flush();
+	}
+}
+
+void FlightRecorder::flush() {
+	// Only the pages written since the last flush. MS_SYNC even from the flusher: MS_ASYNC
+	// does nothing on Linux, the pages would wait for normal writeback (up to 30 s)
+	uint64_t written = head.load(std::memory_order_acquire);
+	int flags = MS_SYNC;
+	long page = sysconf(_SC_PAGESIZE);
+	if (written != flushed) {
+		uint64_t from = flushed % capacity;
+		uint64_t to = written % capacity;
+		if (written - flushed >= capacity) {
+			from = 0;
+			to = capacity;
+		}
+		if (to <= from && written - flushed < capacity) {
+			// Wrapped: tail end of the ring, then its start
+			size_t offset = RECORDER_HEADER_SIZE + from * sizeof(flight_record);
+			size_t aligned = offset - offset % page;
+			msync(map + aligned, map_size - aligned, flags);
+			from = 0;
+		}
+		size_t offset = RECORDER_HEADER_SIZE + from * sizeof(flight_record);
+		size_t end = RECORDER_HEADER_SIZE + to * sizeof(flight_record);
+		size_t aligned = offset - offset % page;
+		if (end > aligned) msync(map + aligned, end - aligned, flags);
+		flushed = written;
+	}
+	header->written = written;
+	msync(map, RECORDER_HEADER_SIZE, flags);
+	flushes.fetch_add(1, std::memory_order_relaxed);
+}
+
+/********************
+ * FlightLog
+ ********************/
+
+FlightLog::FlightLog() {
+	handle = -1;
+	map = NULL;
+	map_size = 0;
+	header = NULL;
+	records = NULL;
+	order = NULL;
+	count = 0;
+	lost = 0;
+}
+
+FlightLog::~FlightLog() {
+	this->close();
+}
+
+int FlightLog::open(const char* filename) {
+	if (map) return 0;
+	handle = ::open(filename, O_RDONLY);
+	struct stat st;
+	if (handle < 0 || fstat(handle, &st) < 0) {
+		if (!RECORDER_QUIET) fprintf(stderr, "Error FlightLog: Could not open %s: %s\n", filename, strerror(errno));
+		this->close();
+		return 0;
+	}
+	map_size = st.st_size;
+	if (map_size < RECORDER_HEADER_SIZE) {
+		if (!RECORDER_QUIET) fprintf(stderr, "Error FlightLog: %s is too short for a flight log\n", filename);
+		this->close();
+		return 0;
+	}
+	map = (unsigned char*)mmap(NULL, map_size, PROT_READ, MAP_SHARED, handle, 0);
+	if (map == MAP_FAILED) {
+		if (!RECORDER_QUIET) fprintf(stderr, "Error FlightLog: Could not map %s: %s\n", filename, strerror(errno));
+		map = NULL;
+		this->close();
+		return 0;
+	}
+	header = (const recorder_header*)map;
+	if (memcmp(header->magic, RECORDER_MAGIC, sizeof(header->magic)) != 0
+		|| header->version != RECORDER_VERSION || header->record_size != sizeof(flight_record)
+		|| header->capacity == 0
+		|| RECORDER_HEADER_SIZE + header->capacity * sizeof(flight_record) > map_size) {
+		if (!RECORDER_QUIET) fprintf(stderr, "Error FlightLog: %s is not a version %d flight log\n",
+			filename, RECORDER_VERSION);
+		this->close();
+		return 0;
+	}
+	records = (const flight_record*)(map + RECORDER_HEADER_SIZE);
+	
+	// The header count is as of the last flush: records after it may still be there if we crashed
+	uint64_t capacity = header->capacity;
+	uint64_t written = header->written;
+	while (written - header->written < capacity
+		&& records[written % capacity].sequence == (uint32_t)(written + 1)) written++;
+	
+	uint64_t first = (written > capacity) ? written - capacity : 0;
+	order = new unsigned long[written - first];
+	for (uint64_t index = first; index < written; index++) {
+		if (records[index % capacity].sequence == (uint32_t)(index + 1)) {
+			order[count++] = index % capacity;
+		} else {
+			lost++;
+		}
+	}
+	return 1;
+}
+
+void FlightLog::close() {
+	delete[] order;
+	order = NULL;
+	count = 0;
+	lost = 0;
+	if (map) munmap(map, map_size);
+	map = NULL;
+	header = NULL;
+	records = NULL;
+	if (handle >= 0) ::close(handle);
+	handle = -1;
+}
+
+unsigned long FlightLog::size() const {
+	return count;
+}
+
+const flight_record* FlightLog::get(unsigned long i) const {
+	return records + order[i];
+}
+
+const recorder_header* FlightLog::getHeader() const {
+	return header;
+}
+
+unsigned long FlightLog::getLost() const {
+	return lost;
+}
@@ -0,0 +1,114 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Flight data recorder
+ * Fixed-size binary records in a preallocated, memory-mapped ring file. Recording a
+ * sample is a copy into the mapping: no allocation, no syscall. A background thread
+ * pushes the dirty pages to disk and keeps the file header up to date, so the file
+ * stays readable if we crash or the battery is pulled.
+ *
+ * File layout: recorder_header, padded to RECORDER_HEADER_SIZE, then 'capacity'
+ * flight_records. Record i (counting from the start of the flight) lives in slot
+ * i % capacity and is valid if its sequence equals i+1 (low 32 bits); once the ring
+ * has wrapped the oldest records are overwritten.
+ */
+ 
+#ifndef _RECORDER_H
+#define _RECORDER_H
+
+#define RECORDER_QUIET 0
+#define RECORDER_MAGIC "RAPTREC"		// 8 bytes with the terminating zero
+#define RECORDER_VERSION 1
+#define RECORDER_HEADER_SIZE 4096		// Records start page aligned
+#define RECORDER_DEFAULT_RECORDS (1<<19)	// 24 MB, about 4 minutes of everything at 1 kHz
+#define RECORDER_FLUSH_INTERVAL 0.1		// Background flush period, about what a power cut loses [s]
+#define RECORDER_VALUES 8
+
+// Record types
+#define RECORD_ACCEL 1			// Calibrated acceleration x, y, z [g]
+#define RECORD_RANGE 2			// Smoothed raw range [cm], not tilt corrected
+#define RECORD_IMU 3			// Attitude w, x, y, z, height [m], corrected accel x, y, z [g]
+#define RECORD_LOOP 4			// Period, wake-up jitter, task time [ns]
+#define RECORD_GYRO 5			// Angular velocity x, y, z [rad/s]
+#define RECORD_COMPASS 6		// Magnetic field x, y, z [gauss]
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+
+struct flight_record {
+	uint64_t timestamp;			// CLOCK_MONOTONIC [ns]
+	uint16_t type;				// RECORD_*
+	uint16_t count;				// Values used
+	uint32_t sequence;			// Index + 1 of the record, written last: 0 or stale = not (yet) valid
+	float values[RECORDER_VALUES];
+};
+
+struct recorder_header {
+	char magic[8];				// RECORDER_MAGIC
+	uint32_t version;			// RECORDER_VERSION
+	uint32_t record_size;		// sizeof(flight_record)
+	uint64_t capacity;			// Slots in the ring
+	uint64_t written;			// Records claimed so far (as of the last flush)
+	uint64_t start;				// CLOCK_MONOTONIC at open [ns]
+	int64_t start_realtime;		// CLOCK_REALTIME at the same moment [ns], to find the wall time
+};
+
+class FlightRecorder {
+	public:
+		FlightRecorder();
+		~FlightRecorder();			// Closes
+		// open(): Create (or truncate) filename with room for 'records' records, map it and
+		// start the flusher. Returns 1 if successful, 0 if not.
+		int open(const char* filename, unsigned long records = RECORDER_DEFAULT_RECORDS);
+		void close();				// Final flush
+		int isOpen() const;
+		
+		// record(): Any thread, never blocks. Returns 0 if not open. count <= RECORDER_VALUES.
+		int record(int type, uint64_t timestamp, const float* values, int count);
+		int record(int type, uint64_t timestamp, float a, float b, float c);
+		
+		unsigned long getWritten() const;	// Records claimed so far
+		unsigned long getFlushes() const;
+		
+	private:
+		static void* run(void* self);
+		void flusher();
+		void flush();				// Synchronous, blocks the flusher until on disk
+		
+		int handle;
+		unsigned char* map;
+		size_t map_size;
+		recorder_header* header;
+		flight_record* records;
+		uint64_t capacity;
+		std::atomic<uint64_t> head;		// Next record index
+		uint64_t flushed;					// Records pushed to disk, flusher only
+		std::atomic<unsigned long> flushes;
+		pthread_t thread;
+		std::atomic<int> running;
+};
+
+// Read side, for the offline tools: the valid records of a file in the order they were written
+class FlightLog {
+	public:
+		FlightLog();
+		~FlightLog();
+		int open(const char* filename);	// 1 if successful, 0 if not
+		void close();
+		unsigned long size() const;		// Valid records
+		const flight_record* get(unsigned long i) const;	// i < size(), oldest first
+		const recorder_header* getHeader() const;
+		unsigned long getLost() const;	// Slots skipped: torn, or overwritten while being read
+		
+	private:
+		int handle;
+		unsigned char* map;
+		size_t map_size;
+		const recorder_header* header;
+		const flight_record* records;
+		unsigned long* order;			// Slot of the i-th valid record
+		unsigned long count;
+		unsigned long lost;
+};
+
+#endif
@@ -3,31 +3,33 @@
  * SRF02 ultrasound range finder driver (i2c)
  */
 
-#include <sys/ioctl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <linux/i2c-dev-user.h>
-#include <time.h>
 #include "SRF02.h"
+#include "I2CBus.h"
+#include "timing.h"
+#include "Metrics.h"
 
 /********************
  * PUBLIC FUNCTIONS
  ********************/
  
-SRF02_US::SRF02_US() {
-	handle = 0;
-	lastRange = 0;
-	measurementBusy = 0;
-	endWait = clock();
+SRF02_US::SRF02_US(int address) {
+	bus = NULL;
+	this->address = address;
+	grouped = 0;
+	lastRange = -1;
+	state = SRF02_STATE_IDLE;
+	stateTime = 0;
+	timestamp = 0;
+	count = 0;
   smoothing = SRF02_DEFAULT_SMOOTHING;
 }
 
 SRF02_US::~SRF02_US() {
-	if (this->handle > 0) close(this->handle);
+	if (this->bus) this->bus->release();
 }
 
 int SRF02_US::init(int i2c_bus) {
@@ -36,43 +38,17 @@ int SRF02_US::init(int i2c_bus) {
 	
 	// Return: 1 if successful, 0 if not
 	
-	char filename[20];
-	
-	if (this->handle) return 0; // Already init
-	snprintf(filename, 20, "/dev/i2c/%d", i2c_bus);
-	filename[19] = '\0';
-
-	// Find the correct file and open it
-	this->handle = open(filename, O_RDWR);
-
-	if (this->handle < 0 && (errno == ENOENT || errno == ENOTDIR)) {
-		sprintf(filename, "/dev/i2c-%d", i2c_bus);
-		this->handle = open(filename, O_RDWR);
-	}
-
-	if (this->handle < 0 && !SRF02_QUIET) {
-		if (errno == ENOENT) {
-			fprintf(stderr, "Error SRF02: Could not open handle "
-				"`/dev/i2c-%d' or `/dev/i2c/%d': %s\n",
-				i2c_bus, i2c_bus, strerror(ENOENT));
-		} else {
-			fprintf(stderr, "Error SRF02: Could not open handle "
-				"`%s': %s\n", filename, strerror(errno));
-			if (errno == EACCES)
-				fprintf(stderr, "Run as root?\n");
-		}
-	}
-	if (this->handle < 0) return 0;
+	if (this->bus) return 0; // Already init
+	this->bus = I2CBus::open(i2c_bus);
+	if (!this->bus) return 0;
 	
 	// Set the address of the slave
-	/* With force, let the user read from/write to the registers
-	   even when a driver is also running */
-	if (ioctl(this->handle, SRF02_FORCE ? I2C_SLAVE_FORCE : I2C_SLAVE, SRF02_ADDRESS) < 0) {
+	if (this->bus->setSlave(this->address>>1, SRF02_FORCE) < 0) {
 		if (!SRF02_QUIET) {
-			fprintf(stderr,
-				"Error SRF02: Could not set address to 0x%02x: %s\n",
-				SRF02_ADDRESS, strerror(errno));
+			fprintf(stderr, "Error SRF02: Could not set address to 0x%02x\n", this->address);
 		}
+		this->bus->release();
+		this->bus = NULL;
 		return 0;
 	}
 
@@ -82,6 +58,8 @@ int SRF02_US::init(int i2c_bus) {
 		if (!SRF02_QUIET) {
 			fprintf(stderr, "Error SRF02: Reading the test register (address 0x01) failed\n");
 		}
+		this->bus->release();
+		this->bus = NULL;
 		return 0;
 	}
 	if (res != SRF02_VERIFICATION) {
@@ -90,65 +68,136 @@ int SRF02_US::init(int i2c_bus) {
 				"Error SRF02: Test register value does not match. Read 0x%02x, should be 0x%02x.\n", 
 				res, SRF02_VERIFICATION);
 		}
+		this->bus->release();
+		this->bus = NULL;
 		return 0;
 	}
 	
 	return 1;
 }
 
+int SRF02_US::poll() {
+	if (!this->bus || this->grouped) return 0;
+	uint64_t now = monotonic_ns();
+	uint64_t elapsed = now - this->stateTime;
+	int res = 0;
+	switch (this->state) {
+		case SRF02_STATE_IDLE:
+			this->startMeasurement(now);
+			break;
+		case SRF02_STATE_RANGING:
+			if (elapsed < (uint64_t)(SRF02_RANGING_TIME*1e9)) break;
+			res = this->saveMeasurement(now);
+			break;
+		case SRF02_STATE_FADE:
+			if (elapsed < (uint64_t)(SRF02_FADE_TIME*1e9)) break;
+			this->startMeasurement(now);
+			break;
+	}
+	metrics_latency(METRIC_LAT_SRF02, monotonic_ns() - now);
+	return res;
+}
+
 unsigned int SRF02_US::getRange() {
-	if (!this->measurementBusy && (clock()>this->endWait)) {
-		this->startMeasurement();
+	this->poll();
+	return (this->lastRange>0) ? this->lastRange : 0;
+}
+
+uint64_t SRF02_US::getTimestamp() const {
+	return this->timestamp;
+}
+
+uint64_t SRF02_US::getAge() const {
+	if (this->count == 0) return 0;
+	return monotonic_ns() - this->timestamp;
+}
+
+unsigned long SRF02_US::getCount() const {
+	return this->count;
+}
+
+int SRF02_US::getState() const {
+	return this->state;
+}
+
+int SRF02_US::storeRange(int range, uint64_t ping) {
+	if (range<=0 || range>SRF02_RANGE_LIMIT) {
+		// 0 means no echo, nothing to store
+		metrics_count(METRIC_SRF02_ERRORS);
+		if (range!=0 && !SRF02_QUIET) metrics_log("Error SRF02: Unrealistic range measurement: %d", range);
+		return 0;
 	}
-	if (this->measurementBusy && (clock()>this->endWait)) {
-		this->saveMeasurement();
+	if (this->lastRange<0) {
+		this->lastRange = range;
+	} else {
+		this->lastRange = smoothing * this->lastRange + (1-smoothing) * range;
 	}
-	return (this->lastRange>0) ? this->lastRange : 0;
+	// The sound hit the ground half way through the round trip, one range / speed after the ping
+	this->timestamp = ping + (uint64_t)(range * 0.01 / SRF02_SOUND_SPEED * 1e9);
+	this->count++;
+	metrics_count(METRIC_SRF02_RANGES);
+	return 1;
 }
 
 /********************
  * PRIVATE FUNCTIONS
  ********************/
 
-void SRF02_US::startMeasurement() {
-	if (!(this->handle>0)) {
+void SRF02_US::startMeasurement(uint64_t now) {
+	if (!this->bus) {
 		if (!SRF02_QUIET) {
 			fprintf(stderr, "Error SRF02: Cannot start measurement when not connected.\n");
 		}
 		return;
 	}
-	this->measurementBusy = 1;
-	this->writeByte(SRF02_ADDR_CMD, SRF02_CMD_RANGE);
-	// Now make sure we wait 70ms before asking for the result
-	this->endWait = clock() + SRF02_DELAY * CLOCKS_PER_SEC;
-	return;
+	if (this->writeByte(SRF02_ADDR_CMD, SRF02_CMD_RANGE) < 0) {
+		// Retry after the fade time, so a missing sensor does not take bus time on every poll
+		this->state = SRF02_STATE_FADE;
+		this->stateTime = now;
+		return;
+	}
+	this->state = SRF02_STATE_RANGING;
+	this->stateTime = now;
 }
 
-void SRF02_US::saveMeasurement() {
-	if (!(this->handle>0)) {
+int SRF02_US::saveMeasurement(uint64_t now) {
+	if (!this->bus) {
 		if (!SRF02_QUIET) {
 			fprintf(stderr, "Error SRF02: Cannot save measurement when not connected.\n");
 		}
-		return;
+		return 0;
 	}
-	if (!(clock()>this->endWait)) return;	// Wait some more time!
 	
-	int range = i2c_smbus_read_word_data(this->handle, SRF02_ADDR_RANGE);
-	if (range<0 || range>SRF02_RANGE_LIMIT) {
-		if (!SRF02_QUIET) {
-			fprintf(stderr, "Error SRF02: Unrealistic range measurement: %d\n", range);
-		}	
-		range = -1;
+	// The range is big endian: MSB in SRF02_ADDR_RANGE, LSB in the next register.
+	// The sensor does not answer while ranging: a failed read just means try again on the next
+	// poll. Only the first transaction can be NAKed that way, so a busy sensor costs one.
+	unsigned char buffer[2];
+	int range = -1;
+	if (this->bus->supportsBurst()) {
+		if (this->bus->readBlock(this->address>>1, SRF02_ADDR_RANGE, buffer, 2) == 2) range = (buffer[0]<<8) | buffer[1];
+	} else {
+		int msb = this->bus->readByte(this->address>>1, SRF02_ADDR_RANGE);
+		int lsb = (msb>=0) ? this->bus->readByte(this->address>>1, SRF02_ADDR_RANGE+1) : -1;
+		if (msb>=0 && lsb>=0) range = (msb<<8) | lsb;
+	}
+	if (range < 0) {
+		if (now - this->stateTime < (uint64_t)(SRF02_READ_TIMEOUT*1e9)) return 0;
+		// Unplugged or stuck: ping again after the fade instead of waiting forever
+		metrics_count(METRIC_SRF02_ERRORS);
+		if (!SRF02_QUIET) metrics_log("Error SRF02: Sensor 0x%02x did not answer after ranging", this->address);
+		this->state = SRF02_STATE_FADE;
+		this->stateTime = now;
+		return -1;
 	}
-	this->lastRange = smoothing * this->lastRange + (1-smoothing) * range;
-	this->measurementBusy = 0;
-	this->endWait = clock() + SRF02_DELAY * CLOCKS_PER_SEC;	// Wait for echo to fade away
-	return;
+	uint64_t ping = this->stateTime;
+	this->state = SRF02_STATE_FADE;
+	this->stateTime = now;
+	return this->storeRange(range, ping);
 }
 
 int SRF02_US::readByte(int address) {
-	if (!(this->handle>0)) return 0;	// Not connected to sensor
-	int res = i2c_smbus_read_byte_data(this->handle, address);
+	if (!this->bus) return 0;	// Not connected to sensor
+	int res = this->bus->readByte(this->address>>1, address);
 	if (res<0) {
 		if (!SRF02_QUIET) {
 			fprintf(stderr, 
@@ -162,16 +211,134 @@ int SRF02_US::readByte(int address) {
 }
 
 int SRF02_US::writeByte(int address, unsigned char data) {
-	if (!(this->handle>0)) return 0;	// Not connected to sensor
-	int res = i2c_smbus_write_word_data(this->handle, address, data);
+	if (!this->bus) return 0;	// Not connected to sensor
+	int res = this->bus->writeByte(this->address>>1, address, data);
 	if (res<0) {
 		if (!SRF02_QUIET) {
-			fprintf(stderr, 
-				"Error SRF02: Could not write some data register (0x%02x) on the sensor.\n",
-				address);
+			metrics_log("Error SRF02: Could not write some data register (0x%02x) on the sensor.", address);
 		}
 		return -1;
 	} else {
 		return 1;
 	}
 }
+
+/********************
+ * SRF02_GROUP
+ ********************/
+
+SRF02_GROUP::SRF02_GROUP() {
+	count = 0;
+	numSlots = 0;
+	bus = NULL;
+	slot = 0;
+	state = SRF02_STATE_IDLE;
+	stateTime = 0;
+	pending = 0;
+	broadcasts = 0;
+}
+
+int SRF02_GROUP::add(SRF02_US* sensor, int slot) {
+	if (count >= SRF02_GROUP_MAX || !sensor || !sensor->bus || slot < 0) return -1;
+	if (bus && sensor->bus != bus) {
+		if (!SRF02_QUIET) {
+			fprintf(stderr, "Error SRF02: All sensors of a group must be on the same bus\n");
+		}
+		return -1;
+	}
+	bus = sensor->bus;
+	sensor->grouped = 1;
+	sensors[count] = sensor;
+	slots[count] = slot;
+	if (slot >= numSlots) numSlots = slot + 1;
+	return count++;
+}
+
+int SRF02_GROUP::poll() {
+	if (count == 0) return 0;
+	uint64_t now = monotonic_ns();
+	uint64_t elapsed = now - stateTime;
+	int fresh = 0;
+	
+	switch (state) {
+		case SRF02_STATE_IDLE:
+			this->fire(now);
+			break;
+		case SRF02_STATE_RANGING:
+			if (elapsed < (uint64_t)(SRF02_RANGING_TIME*1e9)) break;
+			// Read every sensor of the slot that has finished, the others NAK and are retried next
+			// poll, until they time out (SRF02_READ_TIMEOUT)
+			for (int i=0; i<count; i++) {
+				if (!(pending & (1<<i))) continue;
+				if (sensors[i]->saveMeasurement(now) > 0) fresh |= (1<<i);
+				if (sensors[i]->state == SRF02_STATE_FADE) pending &= ~(1<<i);
+			}
+			if (!pending) {
+				state = SRF02_STATE_FADE;
+				stateTime = now;
+			}
+			break;
+		case SRF02_STATE_FADE:
+			if (elapsed < (uint64_t)(SRF02_FADE_TIME*1e9)) break;
+			slot = (slot + 1) % numSlots;
+			this->fire(now);
+			break;
+	}
+	return fresh;
+}
+
+SRF02_US* SRF02_GROUP::get(int index) {
+	return (index >= 0 && index < count) ? sensors[index] : NULL;
+}
+
+int SRF02_GROUP::size() const {
+	return count;
+}
+
+int SRF02_GROUP::getSlots() const {
+	return numSlots;
+}
+
+unsigned long SRF02_GROUP::getBroadcasts() const {
+	return broadcasts;
+}
+
+void SRF02_GROUP::fire(uint64_t now) {
+	int members = 0;
+	for (int i=0; i<count; i++) {
+		if (slots[i] == slot) members |= (1<<i);
+	}
+	if (!members) {
+		// Empty slot, nothing to wait for
+		state = SRF02_STATE_FADE;
+		stateTime = now - (uint64_t)(SRF02_FADE_TIME*1e9);
+		return;
+	}
+	
+	if (members == (1<<count) - 1 && count > 1) {
+		// Whole group in this slot: one general call fires them all.
+		// PLEASE NOTE: this also fires SRF02s on the bus that are not in the group.
+		if (bus->generalCall(SRF02_ADDR_CMD, SRF02_CMD_RANGE) < 0) {
+			if (!SRF02_QUIET) metrics_log("Error SRF02: General call failed");
+			// Idle, so the next poll fires the same slot again instead of moving on
+			state = SRF02_STATE_IDLE;
+			stateTime = now;
+			return;
+		}
+		broadcasts++;
+		for (int i=0; i<count; i++) {
+			sensors[i]->state = SRF02_STATE_RANGING;
+			sensors[i]->stateTime = now;
+		}
+	} else {
+		for (int i=0; i<count; i++) {
+			if (!(members & (1<<i))) continue;
+			sensors[i]->startMeasurement(now);
+			// One that does not take the command is simply not waited for
+			if (sensors[i]->state != SRF02_STATE_RANGING) members &= ~(1<<i);
+		}
+	}
+	pending = members;
+	state = SRF02_STATE_RANGING;
+	stateTime = now;
+}
@@ -8,46 +8,107 @@
 
 #define SRF02_QUIET 0				// Should we shut up if we screw up?
 #define SRF02_FORCE 0				// Force use of i2c bus even if device driver is running?
-#define SRF02_ADDRESS 0xE0	// Address of the sensor on the bus
+#define SRF02_ADDRESS 0xE0	// Address of the sensor on the bus, 8 bit form as in the datasheet (Linux uses >>1)
 #define SRF02_VERIFICATION 0x80	// Read value of register 0x01, to test communication
-#define SRF02_DELAY 0.07		// Minimum delay in seconds between communications with sensor
+#define SRF02_RANGING_TIME 0.07	// Wait after a ranging command before reading the result [s], 65ms in the datasheet
+#define SRF02_FADE_TIME 0.07		// Wait after reading for the echo to fade before the next ping [s]
+#define SRF02_SOUND_SPEED 343.0	// [m/s], for the time of flight in the measurement timestamp
+#define SRF02_READ_TIMEOUT 0.1		// Give up on a sensor still NAKing this long after the ping [s]
+#define SRF02_GROUP_MAX 8				// Sensors in one ranging group
 #define SRF02_DEFAULT_SMOOTHING 0.3		// New_range = smoothing * old_range + (1-smoothing) * current_range
-#define SRF02_ADDR_RANGE 0x2		// Address of the register containing the LSB of the X value
+#define SRF02_ADDR_RANGE 0x2		// Address of the register containing the MSB of the range, LSB follows
 #define SRF02_ADDR_CMD	 0x0		// Address to write command to	
 
 #define SRF02_CMD_RANGE 0x51 		// Command for doing ranging in [cm]
 #define SRF02_RANGE_LIMIT 1000 	// Values above this one are not realistic (1000 = 1000cm = 10m)
 
-#include <time.h>
+// States of the ranging cycle
+#define SRF02_STATE_IDLE 0			// Free to start a measurement
+#define SRF02_STATE_RANGING 1		// Command sent, waiting for the sensor to finish
+#define SRF02_STATE_FADE 2			// Result read, waiting for the echo to fade
+
+#include <stdint.h>
+#include "I2CBus.h"
 
 class SRF02_US {
+	friend class SRF02_GROUP;
 	public:
-		SRF02_US();
+		SRF02_US(int address = SRF02_ADDRESS);	// 8 bit form, 0xE0-0xFE
 		~SRF02_US();
     // init(): Open connection, test, set the range to default value. 
     // Always call before doing other things
 		int init(int i2c_bus);
     /*
-		getRange(): Returns the most recent range in cm.
+		poll(): Advance the ranging cycle (idle -> ranging -> echo fade -> idle) on the monotonic
+		clock. Never blocks: at most one short bus transaction per call, nothing while waiting.
+		Returns 1 if a new range was stored by this call, 0 if not, -1 if the sensor did not answer
+		SRF02_READ_TIMEOUT after the ping (it is pinged again after the fade). Call it as often as
+		you like, a measurement takes SRF02_RANGING_TIME + SRF02_FADE_TIME.
+    */
+    int poll();
+    /*
+		getRange(): Polls, then returns the most recent (smoothed) range in cm, 0 if none yet.
     PLEASE NOTE: This is the raw range, so not corrected for pitch & roll, which effect the measured range.
-		Since the sensor is slow (measuring takes 65ms, another 65ms needed for echo to fade)
-		we will return the previous value, and check if we can start a new measurement.
-		If a measurement has been initiated more than 70ms ago, the result is loaded from the
-		sensor and returned. In this way, the function call to getRange() is fast and measurements
-		are done in the background. Drawback is a small lag in the measurements. 
     */
     unsigned int getRange();
+    uint64_t getTimestamp() const;	// When the most recent range was measured: ping + time of flight [ns, CLOCK_MONOTONIC]
+    uint64_t getAge() const;			// Time since getTimestamp() [ns], 0 if no range yet
+    unsigned long getCount() const;	// Number of ranges measured, to spot new ones
+    int getState() const;				// SRF02_STATE_*
+    // storeRange(): Check, smooth and store a raw range [cm] as if just read from the sensor,
+    // pinged at 'ping' [ns]. Returns 1 if stored, 0 if rejected (no echo or unrealistic).
+    int storeRange(int range, uint64_t ping);
     float smoothing;
   
 	private:
-		int handle;								// Handle to the bus
+		I2CBus* bus;							// Shared bus, NULL if not connected
+		int address;							// 8 bit form
+		int grouped;							// Fired by an SRF02_GROUP, own poll() does nothing
 		int lastRange;						// -1 if no value is present
-		int measurementBusy;			// Measurement currently in progress?
-		clock_t endWait;					// Used to save when we are free to use the sensor
-		void startMeasurement();	// Initiate new measurement
-		void saveMeasurement();		// Load value from sensor into lastRange.
+		int state;								// SRF02_STATE_*
+		uint64_t stateTime;				// When the current state was entered [ns]
+		uint64_t timestamp;				// See getTimestamp()
+		unsigned long count;
+		void startMeasurement(uint64_t now);	// Initiate new measurement
+		int saveMeasurement(uint64_t now);		// Load value from sensor into lastRange, 1 if done, -1 on timeout
 		int readByte(int address);
 		int writeByte(int address, unsigned char data);
 };
 
+/*
+	SRF02_GROUP: Several rangers on one bus, fired together with a single general call
+	instead of one command each, then all read after one ranging window.
+	Sensors are assigned to firing slots: sensors in the same slot ping together, slots
+	take turns (with the echo fade in between) so a ping cannot be heard by a sensor of
+	another slot. Put sensors that look at the same surface in different slots.
+	Poll the group; the members' own poll() does nothing once added, getRange() etc. still work.
+*/
+class SRF02_GROUP {
+	public:
+		SRF02_GROUP();
+		// add(): Add an initialized sensor (not owned) to firing slot 'slot'.
+		// Returns its index in the group, -1 if full, not connected or on another bus.
+		int add(SRF02_US* sensor, int slot = 0);
+		// poll(): Advance the firing cycle, never blocks. Returns a bitmask (1<<index)
+		// of the sensors with a new range. Read those with get(index)->getRange() etc.
+		int poll();
+		SRF02_US* get(int index);
+		int size() const;
+		int getSlots() const;
+		unsigned long getBroadcasts() const;	// Slots fired with one general call
+		
+	private:
+		SRF02_US* sensors[SRF02_GROUP_MAX];
+		int slots[SRF02_GROUP_MAX];
+		int count;
+		int numSlots;
+		I2CBus* bus;
+		int slot;						// Slot being fired
+		int state;						// SRF02_STATE_*
+		uint64_t stateTime;
+		int pending;					// Sensors of the slot not read yet, bitmask
+		unsigned long broadcasts;
+		void fire(uint64_t now);
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,60 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Wait-free single-producer/single-consumer ring buffer
+ * One thread may push, one (other) thread may pop. Neither ever blocks or locks:
+ * when the ring is full the new item is dropped and counted as an overflow.
+ */
+ 
+#ifndef _SPSCRING_H
+#define _SPSCRING_H
+
+#include <atomic>
+
+#define SPSCRING_CACHELINE 64		// Keep producer and consumer indices on separate lines
+
+template <class T, unsigned int N>
+class SpscRing {
+	static_assert(N >= 2 && (N & (N-1)) == 0, "SpscRing size must be a power of two");
+	public:
+		SpscRing() : head(0), tail(0), overflows(0) {}
+		
+		// Producer side
+		int push(const T& item) {		// 1 on success, 0 if full (item dropped)
+			unsigned int h = head.load(std::memory_order_relaxed);
+			if (h - tail.load(std::memory_order_acquire) >= N) {
+				overflows.store(overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				return 0;
+			}
+			items[h & (N-1)] = item;
+			head.store(h + 1, std::memory_order_release);
+			return 1;
+		}
+		
+		// Consumer side
+		int pop(T* item) {				// 1 if an item was popped, 0 if empty
+			return this->popBatch(item, 1);
+		}
+		unsigned int popBatch(T* out, unsigned int max) {	// Oldest first, returns the number popped
+			unsigned int t = tail.load(std::memory_order_relaxed);
+			unsigned int available = head.load(std::memory_order_acquire) - t;
+			if (available > max) available = max;
+			for (unsigned int i=0; i<available; i++) out[i] = items[(t + i) & (N-1)];
+			tail.store(t + available, std::memory_order_release);
+			return available;
+		}
+		
+		// Either side
+		unsigned int size() const {
+			return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+		}
+		static unsigned int capacity() { return N; }
+		unsigned long getOverflows() const { return overflows.load(std::memory_order_relaxed); }
+		
+	private:
+		alignas(SPSCRING_CACHELINE) std::atomic<unsigned int> head;		// Next slot to write, producer only
+		alignas(SPSCRING_CACHELINE) std::atomic<unsigned int> tail;		// Next slot to read, consumer only
+		alignas(SPSCRING_CACHELINE) std::atomic<unsigned long> overflows;	// Producer only
+		T items[N];
+};
+
+#endif
@@ -0,0 +1,636 @@
+// Benchmark of the hot paths, run it on the target board:
+//	make bench && ./bench [-f text|csv|json] [-r runs] [-b filter] [-l]
+//	-f: output format, csv and json print one result per line on stdout (the rest goes to stderr)
+//	-r: repeat every benchmark this many times, default BENCH_RUNS
+//	-b: only run the benchmarks whose name contains this text
+//	-l: list the benchmarks
+// Every sample times a batch of calls: fast operations use big batches so the clock is
+// not what gets measured, the slow ones are timed per call so the worst case shows up.
+// All numbers are ns per call. Drivers run against the simulated bus (I2CSim), so no
+// hardware is needed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include "IMU.h"
+#include "Acquisition.h"
+#include "LoopRunner.h"
+#include "Metrics.h"
+#include "Recorder.h"
+#include "BMA020.h"
+#include "ITG3200.h"
+#include "HMC5883L.h"
+#include "SRF02.h"
+#include "I2CBus.h"
+#include "I2CSim.h"
+#include "matrix.h"
+
+#define BENCH_RUNS 5					// Repetitions of every benchmark
+#define BENCH_WARMUP 0.1				// Untimed fraction of the samples before each run
+#define BENCH_SAMPLES 2000				// Timed batches per run
+#define BENCH_DRIVER_SAMPLES 500		// Timed driver calls per run, each one costs bus time
+#define BENCH_RATE 1000					// Loop rate we have to sustain [Hz]
+#define BENCH_ACQ_TICKS 1000			// Loop ticks draining the acquisition thread
+#define BENCH_RECORD_FILE "/tmp/bench.rec"	// Scratch flight recorder file
+#define BENCH_MAX_CASES 32
+#define BENCH_GROUP_BUS 4				// Simulated bus of its own for the ranger group runs
+#define BENCH_GROUP_TIME 1.0			// Length of each ranger group run [s]
+#define BENCH_GROUP_BROADCAST "SRF02_GROUP::poll, 2 rangers in one slot (sim 400kHz)"
+#define BENCH_GROUP_SLOTS "SRF02_GROUP::poll, 2 rangers in 2 slots (sim 400kHz)"
+#define BENCH_ACQ_POLLED "IMU::update draining acquisition (sim 400kHz)"
+#define BENCH_ACQ_DRDY "IMU::update draining acquisition, data-ready edges (sim 400kHz)"
+
+#define BENCH_TEXT 0
+#define BENCH_CSV 1
+#define BENCH_JSON 2
+
+typedef void (*bench_fn)(void* state);
+
+struct bench_case {
+	const char* name;
+	bench_fn fn;					// One call of the operation
+	void* state;
+	int batch;						// Calls per timed sample
+	int samples;					// Timed samples per run
+};
+
+static bench_case cases[BENCH_MAX_CASES];
+static int num_cases = 0;
+static int format = BENCH_TEXT;
+static int runs = BENCH_RUNS;
+static FILE* info = stdout;			// Everything that is not a result
+volatile float bench_sink;			// Results go here, so nothing is optimized away
+
+static double now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void* a, const void* b) {
+	double d = *(const double*)a - *(const double*)b;
+	return (d>0) - (d<0);
+}
+
+static void add(const char* name, bench_fn fn, void* state, int batch, int samples = BENCH_SAMPLES) {
+	if (num_cases >= BENCH_MAX_CASES) return;
+	bench_case c = {name, fn, state, batch, samples};
+	cases[num_cases++] = c;
+}
+
+static void header() {
+	if (format == BENCH_CSV) {
+		printf("name,batch,samples,runs,min_ns,p50_ns,p90_ns,p99_ns,max_ns,mean_ns,run_p50_min_ns,run_p50_max_ns\n");
+	} else if (format == BENCH_TEXT) {
+		printf("%-46s %6s %7s %9s %9s %9s %9s %10s  %s\n", "[ns per call]", "batch", "samples",
+			"min", "p50", "p90", "p99", "max", "p50 of runs");
+	}
+}
+
+// report(): times holds 'runs' runs of n samples each, run_p50 the median of every run. Sorts times.
+static void report(const char* name, int batch, double* times, int n, const double* run_p50) {
+	int total = n*runs;
+	double run_min = run_p50[0], run_max = run_p50[0];
+	for (int r=1; r<runs; r++) {
+		if (run_p50[r] < run_min) run_min = run_p50[r];
+		if (run_p50[r] > run_max) run_max = run_p50[r];
+	}
+	qsort(times, total, sizeof(double), compare_double);
+	double sum = 0;
+	for (int i=0; i<total; i++) sum += times[i];
+	double p50 = times[(int)(total*0.5)], p90 = times[(int)(total*0.9)], p99 = times[(int)(total*0.99)];
+
+	if (format == BENCH_CSV) {
+		printf("\"%s\",%d,%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", name, batch, total, runs,
+			times[0], p50, p90, p99, times[total-1], sum/total, run_min, run_max);
+	} else if (format == BENCH_JSON) {
+		printf("{\"name\": \"%s\", \"batch\": %d, \"samples\": %d, \"runs\": %d, \"min_ns\": %.1f, "
+			"\"p50_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, \"max_ns\": %.1f, \"mean_ns\": %.1f, "
+			"\"run_p50_min_ns\": %.1f, \"run_p50_max_ns\": %.1f}\n", name, batch, total, runs,
+			times[0], p50, p90, p99, times[total-1], sum/total, run_min, run_max);
+	} else {
+		printf("%-46s %6d %7d %9.1f %9.1f %9.1f %9.1f %10.1f  %.1f..%.1f\n", name, batch, total,
+			times[0], p50, p90, p99, times[total-1], run_min, run_max);
+	}
+	fflush(stdout);
+}
+
+static void run(const bench_case* c, double* times, double* run_p50, double* sorted) {
+	int warmup = (int)(c->samples*BENCH_WARMUP);
+	for (int r=0; r<runs; r++) {
+		double* t = times + r*c->samples;
+		for (int s=-warmup; s<c->samples; s++) {
+			double start = now_ns();
+			for (int i=0; i<c->batch; i++) c->fn(c->state);
+			double elapsed = (now_ns() - start) / c->batch;
+			if (s >= 0) t[s] = elapsed;
+		}
+		memcpy(sorted, t, c->samples*sizeof(double));
+		qsort(sorted, c->samples, sizeof(double), compare_double);
+		run_p50[r] = sorted[c->samples/2];
+	}
+	report(c->name, c->batch, times, c->samples, run_p50);
+}
+
+/********************
+ * BENCHMARKS
+ ********************/
+
+struct fixed_state {
+	Vec3 a, b;
+	Mat3 M, N;
+	fmatrix<4,8> A;
+	fmatrix<4,4> S;		// Symmetric positive definite, AAᵀ
+	fvector<8> y;
+};
+
+static void bench_vexpr(void* p) {
+	fixed_state* s = (fixed_state*)p;
+	Vec3 r = s->a + s->b*0.5f - s->a*0.25f;
+	bench_sink += r[0];
+	s->a[0] += 1e-7f;
+}
+
+static void bench_matvec3(void* p) {
+	fixed_state* s = (fixed_state*)p;
+	Vec3 r = s->M*s->a + s->b;
+	bench_sink += r[1];
+	s->a[1] += 1e-7f;
+}
+
+static void bench_matmul3(void* p) {
+	fixed_state* s = (fixed_state*)p;
+	Mat3 r = s->M*s->N;
+	bench_sink += r(2,2);
+	s->N(0,0) += 1e-7f;
+}
+
+static void bench_invert3(void* p) {
+	fixed_state* s = (fixed_state*)p;
+	Mat3 r = s->M;
+	r.invert();
+	bench_sink += r(1,1);
+}
+
+static void bench_pinv48(void* p) {
+	fixed_state* s = (fixed_state*)p;
+	fmatrix<8,4> r = s->A.pseudo_inverse();
+	bench_sink += r(3,3);
+}
+
+static void bench_lu3(void* p) {
+	fixed_state* s = (fixed_state*)p;
+	Mat3 LU = s->M;
+	unsigned int piv[3];
+	Vec3 x = s->a;
+	lu_factor(LU, piv);
+	lu_solve(LU, piv, x);
+	bench_sink += x[2];
+}
+
+static void bench_cholesky4(void* p) {
+	fixed_state* s = (fixed_state*)p;
+	fmatrix<4,4> L = s->S;
+	fvector<4> x;
+	for (int i=0; i<4; i++) x[i] = s->y[i];
+	cholesky_factor(L);
+	cholesky_solve(L, x);
+	bench_sink += x[3];
+}
+
+static void bench_qr84(void* p) {
+	fixed_state* s = (fixed_state*)p;
+	fmatrix<8,4> QR = s->A.transposed();
+	float tau[4];
+	qr_factor(QR, tau);
+	fvector<4> x = qr_solve(QR, tau, s->y);
+	bench_sink += x[3];
+}
+
+struct dynamic_state {
+	vector* u;
+	vector* v;
+	matrix* M;			// Square
+	matrix* A;			// Wide, calibrator shape
+};
+
+static void bench_vector_sum(void* p) {
+	dynamic_state* s = (dynamic_state*)p;
+	vector r = *s->u + *s->v*0.5f;
+	bench_sink += r[0];
+}
+
+static void bench_matrix_vector(void* p) {
+	dynamic_state* s = (dynamic_state*)p;
+	vector r = *s->M * *s->u;
+	bench_sink += r[0];
+}
+
+static void bench_matrix_affine(void* p) {
+	dynamic_state* s = (dynamic_state*)p;
+	vector r = *s->M * *s->u + *s->v;
+	bench_sink += r[0];
+}
+
+static void bench_matrix_matrix(void* p) {
+	dynamic_state* s = (dynamic_state*)p;
+	matrix r = *s->M * s->M->transposed();
+	bench_sink += r(0,0);
+}
+
+static void bench_matrix_invert(void* p) {
+	dynamic_state* s = (dynamic_state*)p;
+	matrix r(*s->M);
+	r.invert();
+	bench_sink += r(0,0);
+}
+
+static void bench_matrix_pinv(void* p) {
+	dynamic_state* s = (dynamic_state*)p;
+	matrix r = s->A->pseudo_inverse();
+	bench_sink += r(0,0);
+}
+
+struct block_state {
+	vec3_block* in;
+	vec3_block* out;
+	float* norms;
+	Mat3 M;
+	Vec3 offset;
+};
+
+static void bench_block_affine(void* p) {
+	block_state* s = (block_state*)p;
+	vec3_block_affine(s->M, s->offset, *s->in, *s->out);
+	bench_sink += s->out->x[0];
+}
+
+static void bench_block_norm(void* p) {
+	block_state* s = (block_state*)p;
+	vec3_block_norm(*s->in, s->norms);
+	bench_sink += s->norms[0];
+}
+
+struct bma020_state {
+	BMA020_ACCEL* accel;
+	unsigned char raw[BMA020_DATA_LENGTH];
+};
+
+static void bench_bma020_decode(void* p) {
+	bma020_state* s = (bma020_state*)p;
+	Vec3 m;
+	s->accel->decode(s->raw, &m);
+	bench_sink += m[2];
+	s->raw[0] += 0x40;		// Walk through the 2 low bits
+}
+
+static void bench_bma020_read(void* p) {
+	bma020_state* s = (bma020_state*)p;
+	Vec3 m;
+	s->accel->getMeasurement(&m);
+	bench_sink += m[2];
+}
+
+struct itg3200_state {
+	ITG3200_GYRO* gyro;
+	unsigned char raw[ITG3200_DATA_LENGTH];
+};
+
+static void bench_itg3200_decode(void* p) {
+	itg3200_state* s = (itg3200_state*)p;
+	Vec3 m;
+	s->gyro->decode(s->raw, &m);
+	bench_sink += m[2];
+	s->raw[5] += 3;			// Low byte of Z, mostly at rest for the bias tracker
+}
+
+static void bench_itg3200_read(void* p) {
+	itg3200_state* s = (itg3200_state*)p;
+	Vec3 m[ITG3200_FIFO_BATCH];
+	if (s->gyro->getMeasurements(m, ITG3200_FIFO_BATCH) > 0) bench_sink += m[0][2];
+}
+
+struct hmc5883l_state {
+	HMC5883L_COMPASS* compass;
+	unsigned char raw[HMC5883L_DATA_LENGTH];
+};
+
+static void bench_hmc5883l_decode(void* p) {
+	hmc5883l_state* s = (hmc5883l_state*)p;
+	Vec3 m;
+	s->compass->decode(s->raw, &m);
+	bench_sink += m[2];
+	s->raw[1] += 5;			// Low byte of X
+}
+
+struct srf02_state {
+	SRF02_US* ranger;
+	int range;
+};
+
+static void bench_srf02_store(void* p) {
+	srf02_state* s = (srf02_state*)p;
+	s->range = (s->range * 13 + 7) % 400 + 20;	// Pseudo random 20..419 cm
+	s->ranger->storeRange(s->range, 0);
+	bench_sink += s->ranger->getRange();
+}
+
+struct imu_state {
+	IMU* imu;
+	int n;
+};
+
+static void bench_imu_update(void* p) {
+	imu_state* s = (imu_state*)p;
+	// Synthetic flight: slow wobble around x and y, gravity seen by the accelerometer
+	float dt = 1.0f/BENCH_RATE;
+	float t = (s->n++)*dt;
+	Vec3 gyro(0.5f*cosf(t), 0.3f*sinf(0.7f*t), 0.1f);
+	Vec3 accel = s->imu->getAttitude().conjugate().rotate(Vec3(0, 0, 1));
+	s->imu->update(gyro, accel, dt);
+	bench_sink += s->imu->getHeight();
+}
+
+static void bench_record(void* p) {
+	static float state[8] = {1, 0, 0, 0, 0.5f, 0, 0, 0};
+	((FlightRecorder*)p)->record(RECORD_IMU, 0, state, 8);
+}
+
+static void bench_srf02_group(double* times, const char* name, int second_slot) {
+	// Two rangers in one SRF02_GROUP, polled every ms for BENCH_GROUP_TIME: with both in
+	// slot 0 every cycle is one general call, with the second in slot 1 they take turns.
+	// Its own bus, so the general calls don't fire the ranger of the acquisition runs.
+	I2CSim* sim = new I2CSim();
+	sim->bitrate = 400000;
+	SRF02_SIM* near = new SRF02_SIM(SRF02_ADDRESS>>1);
+	SRF02_SIM* far = new SRF02_SIM((SRF02_ADDRESS>>1) + 1);
+	near->range = 100;
+	far->range = 150;
+	sim->addDevice(near);
+	sim->addDevice(far);
+	int bus = BENCH_GROUP_BUS + second_slot;
+	I2CBus::attach(bus, sim);
+	SRF02_US a(SRF02_ADDRESS), b(SRF02_ADDRESS + 2);
+	SRF02_GROUP group;
+	if (!a.init(bus) || !b.init(bus) || group.add(&a, 0) < 0 || group.add(&b, second_slot) < 0) {
+		fprintf(stderr, "Init of the simulated SRF02 group failed\n");
+		return;
+	}
+	int n = 0;
+	unsigned long ranges[2] = {0, 0};
+	double end = now_ns() + BENCH_GROUP_TIME*1e9;
+	while (now_ns() < end && n < BENCH_ACQ_TICKS) {
+		double start = now_ns();
+		int fresh = group.poll();
+		times[n++] = now_ns() - start;
+		for (int i=0; i<2; i++) if (fresh & (1<<i)) ranges[i]++;
+		usleep(1000);
+	}
+
+	int saved = runs;
+	runs = 1;
+	double* sorted = new double[n];
+	memcpy(sorted, times, n*sizeof(double));
+	qsort(sorted, n, sizeof(double), compare_double);
+	double p50 = sorted[n/2];
+	delete[] sorted;
+	report(name, 1, times, n, &p50);
+	runs = saved;
+	fprintf(info, "SRF02_GROUP: %d slots, %lu general calls, %lu + %lu ranges, last %u / %u cm\n",
+		group.getSlots(), group.getBroadcasts(), ranges[0], ranges[1], a.getRange(), b.getRange());
+}
+
+struct acq_bench {
+	IMU* imu;
+	LoopRunner* loop;
+	double* times;
+	int n;
+};
+
+static void acqBenchTask(void* arg, float dt) {
+	acq_bench* b = (acq_bench*)arg;
+	double start = now_ns();
+	b->imu->update(dt);
+	b->times[b->n++] = now_ns() - start;
+	if (b->n >= BENCH_ACQ_TICKS) b->loop->stop();
+}
+
+static void bench_acquisition(double* times, const char* name, I2CSimEdge* drdy) {
+	// Consumer side of the acquisition thread: what the control loop pays per tick.
+	// A whole-system run with its own timing, once. With drdy, the simulated INT line
+	// of the accelerometer paces the acquisition instead of its timer.
+	SensorAcquisition acq;
+	if (!acq.init(I2CBUS_SENSORS) || (drdy && (!drdy->start() || !acq.useDataReadyFd(drdy->getFd())))
+		|| !acq.start()) {
+		fprintf(stderr, "Start of the acquisition thread failed\n");
+		if (drdy) drdy->stop();
+		return;
+	}
+	IMU imu;
+	imu.attach(acq.getRing());
+	LoopRunner loop(BENCH_RATE);
+	acq_bench b = {&imu, &loop, times, 0};
+	loop.addTask(acqBenchTask, &b, 1);
+	metrics_snapshot before;
+	metrics_take(&before);
+	loop.run();
+	acq.stop();
+	if (drdy) drdy->stop();
+
+	int saved = runs;
+	runs = 1;
+	double* sorted = new double[b.n];
+	memcpy(sorted, times, b.n*sizeof(double));
+	qsort(sorted, b.n, sizeof(double), compare_double);
+	double p50 = sorted[b.n/2];
+	delete[] sorted;
+	report(name, 1, times, b.n, &p50);
+	runs = saved;
+
+	fprintf(info, "Acquisition: %lu cycles, %lu overruns, %lu read errors, %lu ring overflows\n",
+		acq.getCycles(), acq.getOverruns(), acq.getReadErrors(), acq.getRing()->getOverflows());
+	loop.printStats(info);
+	// What the instrumented code saw itself during the run
+	metrics_snapshot after, interval;
+	metrics_take(&after);
+	metrics_diff(&after, &before, &interval);
+	metrics_print(&interval, info);
+}
+
+int main(int argc, char *argv[]) {
+	const char* filter = NULL;
+	int list = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:r:b:l")) != -1) {
+		switch (opt) {
+			case 'f':
+				if (!strcmp(optarg, "csv")) format = BENCH_CSV;
+				else if (!strcmp(optarg, "json")) format = BENCH_JSON;
+				else if (!strcmp(optarg, "text")) format = BENCH_TEXT;
+				else opt = '?';
+				break;
+			case 'r': runs = atoi(optarg); break;
+			case 'b': filter = optarg; break;
+			case 'l': list = 1; break;
+		}
+		if (opt == '?' || runs < 1) {
+			fprintf(stderr, "Usage: %s [-f text|csv|json] [-r runs] [-b filter] [-l]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (format != BENCH_TEXT) info = stderr;
+
+	// Fixed size math
+	fixed_state fixed;
+	fixed.a = Vec3(0.1f, -0.2f, 0.98f);
+	fixed.b = Vec3(0.3f, 0.1f, -0.1f);
+	for (int i=0; i<3; i++)
+		for (int j=0; j<3; j++) {
+			fixed.M(i,j) = (i==j) ? 2.0f : 0.1f*(i+1) - 0.05f*j;
+			fixed.N(i,j) = 0.2f*i + 0.1f*j + (i==j);
+		}
+	for (int i=0; i<4; i++)
+		for (int j=0; j<8; j++) fixed.A(i,j) = (i==3) ? 1.0f : sinf(1.0f + (i+1)*j);
+	fixed.S = fixed.A * fixed.A.transposed();
+	for (int i=0; i<8; i++) fixed.y[i] = cosf(i);
+	add("fvector<3> a + b*s - a*s", bench_vexpr, &fixed, 1000);
+	add("fmatrix<3,3> * fvector<3> + fvector<3>", bench_matvec3, &fixed, 1000);
+	add("fmatrix<3,3> * fmatrix<3,3>", bench_matmul3, &fixed, 1000);
+	add("fmatrix<3,3>::invert", bench_invert3, &fixed, 100);
+	add("fmatrix<4,8>::pseudo_inverse", bench_pinv48, &fixed, 100);
+	add("fmatrix<3,3> LU solve", bench_lu3, &fixed, 100);
+	add("fmatrix<4,4> Cholesky solve", bench_cholesky4, &fixed, 100);
+	add("fmatrix<8,4> QR least squares", bench_qr84, &fixed, 100);
+
+	// Dynamic size math, calibrator sizes
+	dynamic_state dynamic;
+	dynamic.u = new vector(16);
+	dynamic.v = new vector(16);
+	dynamic.M = new matrix(16, 16);
+	dynamic.A = new matrix(4, 8);
+	for (int i=0; i<16; i++) {
+		dynamic.u->set(i, 0.1f*i);
+		dynamic.v->set(i, 1.0f - 0.05f*i);
+		for (int j=0; j<16; j++) (*dynamic.M)(i,j) = (i==j) ? 4.0f : sinf(i*16 + j);
+	}
+	for (int i=0; i<4; i++)
+		for (int j=0; j<8; j++) (*dynamic.A)(i,j) = fixed.A(i,j);
+	add("vector(16) + vector(16)*s", bench_vector_sum, &dynamic, 100);
+	add("matrix(16x16) * vector(16)", bench_matrix_vector, &dynamic, 100);
+	add("matrix(16x16) * vector(16) + vector(16)", bench_matrix_affine, &dynamic, 100);
+	add("matrix(16x16) * transposed view", bench_matrix_matrix, &dynamic, 10);
+	add("matrix(16x16)::invert", bench_matrix_invert, &dynamic, 10);
+	add("matrix(4x8)::pseudo_inverse", bench_matrix_pinv, &dynamic, 10);
+
+	// Batch kernels
+	block_state block;
+	block.in = new vec3_block(256);
+	block.out = new vec3_block(256);
+	block.norms = new float[256];
+	block.M = fixed.M;
+	block.offset = fixed.b;
+	for (int i=0; i<256; i++) block.in->push(Vec3(sinf(i), cosf(i), 1.0f));
+	add("vec3_block_affine, 256 samples", bench_block_affine, &block, 10);
+	add("vec3_block_norm, 256 samples", bench_block_norm, &block, 10);
+
+	// Estimator and recorder
+	imu_state imu = {new IMU(), 0};
+	add((IMU_FILTER == IMU_FILTER_EKF) ? "IMU::update (EKF)" : "IMU::update (Mahony)", bench_imu_update, &imu, 1, 50000);
+	FlightRecorder recorder;		// A ring, wrapping around is part of the test
+	if (!list && !recorder.open(BENCH_RECORD_FILE, 60000)) return 1;
+	add("FlightRecorder::record, 8 values", bench_record, &recorder, 1, 50000);
+
+	// Drivers on a simulated 400 kHz bus
+	I2CSim* sim = new I2CSim();
+	sim->bitrate = 400000;
+	BMA020_SIM* bma020_sim = new BMA020_SIM();
+	sim->addDevice(bma020_sim);
+	sim->addDevice(new ITG3200_SIM());
+	sim->addDevice(new HMC5883L_SIM());
+	sim->addDevice(new SRF02_SIM(SRF02_ADDRESS>>1));
+	I2CBus::attach(I2CBUS_SENSORS, sim);
+	BMA020_ACCEL accel;
+	if (!list && !accel.init(I2CBUS_SENSORS)) {
+		fprintf(stderr, "Init of simulated BMA020 failed\n");
+		return 1;
+	}
+	bma020_state bma020 = {&accel, {0x00, 0x10, 0xC0, 0xF2, 0x40, 0x7E}};
+	add("BMA020::decode + calibration", bench_bma020_decode, &bma020, 1000);
+	add("BMA020::getMeasurement (sim 400kHz)", bench_bma020_read, &bma020, 1, BENCH_DRIVER_SAMPLES);
+	ITG3200_GYRO gyro;
+	if (!list && !gyro.init(I2CBUS_SENSORS)) {
+		fprintf(stderr, "Init of simulated ITG3200 failed\n");
+		return 1;
+	}
+	itg3200_state itg3200 = {&gyro, {0x00, 0x10, 0xFF, 0xF2, 0x00, 0x00}};
+	add("ITG3200::decode + calibration + bias", bench_itg3200_decode, &itg3200, 1000);
+	add("ITG3200::getMeasurements, FIFO (sim 400kHz)", bench_itg3200_read, &itg3200, 1, BENCH_DRIVER_SAMPLES);
+	HMC5883L_COMPASS compass;
+	if (!list && !compass.init(I2CBUS_SENSORS)) {
+		fprintf(stderr, "Init of simulated HMC5883L failed\n");
+		return 1;
+	}
+	hmc5883l_state hmc5883l = {&compass, {0x00, 0xDA, 0xFE, 0x4F, 0x00, 0x12}};
+	add("HMC5883L::decode + calibration", bench_hmc5883l_decode, &hmc5883l, 1000);
+	SRF02_US ranger;
+	srf02_state srf02 = {&ranger, 100};
+	add("SRF02::storeRange (check + smoothing)", bench_srf02_store, &srf02, 1000);
+
+	if (list) {
+		for (int i=0; i<num_cases; i++) printf("%s\n", cases[i].name);
+		printf("%s\n%s\n%s\n%s\n", BENCH_GROUP_BROADCAST, BENCH_GROUP_SLOTS, BENCH_ACQ_POLLED, BENCH_ACQ_DRDY);
+		return 0;
+	}
+
+	int most = BENCH_ACQ_TICKS;
+	for (int i=0; i<num_cases; i++) if (cases[i].samples > most) most = cases[i].samples;
+	double* times = new double[most*runs];
+	double* sorted = new double[most];
+	double* run_p50 = new double[runs];
+
+	header();
+	for (int i=0; i<num_cases; i++) {
+		if (filter && !strstr(cases[i].name, filter)) continue;
+		if (cases[i].fn == bench_bma020_read) {
+			// Once per read mode: the fallback is what we get on adapters without burst reads
+			accel.read_mode = BMA020_READ_BURST;
+			run(&cases[i], times, run_p50, sorted);
+			accel.read_mode = BMA020_READ_WORD;
+			cases[i].name = "BMA020::getMeasurement, word reads (sim 400kHz)";
+			run(&cases[i], times, run_p50, sorted);
+			accel.read_mode = BMA020_READ_BURST;
+			continue;
+		}
+		if (cases[i].fn == bench_itg3200_read) {
+			// FIFO count + data, then status + latest sample on a chip or adapter without the FIFO
+			int mode = gyro.read_mode;
+			run(&cases[i], times, run_p50, sorted);
+			gyro.read_mode = ITG3200_READ_BURST;
+			cases[i].name = "ITG3200::getMeasurements, burst (sim 400kHz)";
+			run(&cases[i], times, run_p50, sorted);
+			gyro.read_mode = mode;
+			continue;
+		}
+		run(&cases[i], times, run_p50, sorted);
+	}
+	recorder.close();
+	unlink(BENCH_RECORD_FILE);
+
+	if (!filter || strstr(BENCH_GROUP_BROADCAST, filter)) bench_srf02_group(times, BENCH_GROUP_BROADCAST, 0);
+	if (!filter || strstr(BENCH_GROUP_SLOTS, filter)) bench_srf02_group(times, BENCH_GROUP_SLOTS, 1);
+	if (!filter || strstr(BENCH_ACQ_POLLED, filter)) bench_acquisition(times, BENCH_ACQ_POLLED, NULL);
+	if (!filter || strstr(BENCH_ACQ_DRDY, filter)) {
+		usleep(100000);		// The ranger NAKs its init until the last run's ranging is done
+		I2CSimEdge drdy(bma020_sim);
+		bench_acquisition(times, BENCH_ACQ_DRDY, &drdy);
+	}
+	metrics_flush_log(stderr);
+
+	delete[] run_p50;
+	delete[] sorted;
+	delete[] times;
+	return 0;
+}
@@ -1,4 +1,12 @@
 // Tool to calibrate the sensors of the quadcopter
+//	./calibrator [-a] [-c samples]
+//	-a: automatic, no keys to press: put the quad in the positions in any order and hold it
+//	    still, each one is recognized and captured until its mean is known well enough
+//	-c: calibrate the compass instead, from raw magnetometer samples in a text file
+//	    ("x y z" per line, '#' comments, - for stdin) taken while tumbling the airframe
+//	    through all orientations. Writes calibrate/compass.txt
+//	    "-c live" reads the magnetometer (HMC5883L) itself for COMPASS_LIVE_SAMPLES samples
+// The result also goes into calibrate/calibration.bin, where the drivers read it from.
 // Quadcopter axis (right hand): 
 //	- x towards front (nose)
 //	- y towards left (west) 
@@ -7,27 +15,62 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "BMA020.h"
+#include "HMC5883L.h"
+#include "Calibration.h"
+#include "LeastSquares.h"
 #include "matrix.h"
 
-#define NUM_MEASUREMENTS 100				// Number of measurements in each position to average
+#define NUM_MEASUREMENTS 2000				// Number of measurements in each position, all go into the fit
 #define NUM_POSITIONS 8							// Number of positions for accel/compass
+#define AUTO_POSES 6								// Distinct gravity directions among the positions (the first 6)
+#define AUTO_RATE 200								// Sample rate in automatic mode [Hz], about the sensor's output rate
+#define STILL_WINDOW 50							// Samples in the stillness window
+#define STILL_STDDEV 0.01						// At rest if every axis varies less over the window [g]
+#define POSE_ALIGN 0.95							// Cosine between measured and expected gravity to be in a position
+#define CAPTURE_CI 0.0005						// Done when the 95% confidence interval of the mean is within +/- this [g]
+#define CAPTURE_MIN 100							// Samples per position at least...
+#define CAPTURE_MAX NUM_MEASUREMENTS	// ...and at most
+#define COMPASS_MIN_SAMPLES 100			// Before the compass fit is trusted
+#define COMPASS_REPORT 1000					// Print the fit every this many compass samples
+#define COMPASS_LIVE_SAMPLES 4500			// Samples read from the sensor with "-c live", a minute at 75 Hz
 
 BMA020_ACCEL* accel;
-matrix* A_opt;
-matrix* A_raw;
-vector* myFavoritePositions[NUM_POSITIONS];	// Pitch, Roll, Yaw
+fmatrix<3,NUM_POSITIONS> A_opt;		// The 'should be' values for the accelerometer
+lsq_accumulator<4,3> accelFit;		// accelCalib * [raw; 1] = A_opt column, over every sample
+Vec3 myFavoritePositions[NUM_POSITIONS];	// Pitch, Roll, Yaw
 
 void collectData();
+void collectDataAuto();
+int classifyPose(const Vec3& mean);
 void waitKey();
 void init();	// Fill all the matrices & stuff
+int calibrateCompass(const char* samples);
+int writeCalibration(int sensor, const char* file, const Mat3x4& calib);
 
 int main(int argc, char *argv[]) {
-	FILE * calibFile;
+	const char* compassSamples = NULL;
+	int automatic = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "ac:")) != -1) {
+		switch (opt) {
+			case 'a': automatic = 1; break;
+			case 'c': compassSamples = optarg; break;
+			default:
+				fprintf(stderr, "Usage: %s [-a] [-c samples]\n", argv[0]);
+				return 1;
+		}
+	}
 	printf("Welcome to the calibration tool for the quadcopter\n");
+	if (compassSamples) {
+		printf("Active calibration functions: COMPASS\n\n");
+		return calibrateCompass(compassSamples) ? 0 : -1;
+	}
 	printf("Active calibration functions: ACCELEROMETER\n");
-	printf("Please type 'q' to quit if you lose your patience. Good luck!\n\n");
+	if (automatic) printf("Press Ctrl-C to quit if you lose your patience. Good luck!\n\n");
+	else printf("Please type 'q' to quit if you lose your patience. Good luck!\n\n");
 	
 	init();
 	
@@ -42,68 +85,131 @@ int main(int argc, char *argv[]) {
 		return -1;
 	}
 	
-	// Fill A_raw with data from different orientations:
-	collectData();
+	// Feed accelFit with data from different orientations:
+	if (automatic) collectDataAuto();
+	else collectData();
 	
 	printf("\nTHANKS Buddy! Now going to calculate optimal calibration values...\n\n");
 	
-	// Calculate accelCalib matrix by finding the least squares solution (pseudo-inverse)
+	// Calculate accelCalib matrix by finding the least squares solution
 	// accelCalib is a 3x4 matrix
 	//  - The first 3x3 part is the calibration matrix
 	//  - Te last column is the offset vector
-	matrix accelCalib = (*A_opt) * (*A_raw).pseudo_inverse();
+	Mat3x4 accelCalib;
+	if (!accelFit.solve(&accelCalib)) {
+		printf("The positions do not determine the calibration, nothing written!!\n");
+		delete accel;
+		return -1;
+	}
+	printf("Fit over %lu samples, rms error %.4f [g]\n", accelFit.count(), accelFit.rms(accelCalib));
 	// Write the values to calibrate/accel.txt:
-	remove("calibrate/accel.txt");
-  calibFile = fopen ("calibrate/accel.txt","w");
-  for (int i=0; i<3; i++) {
-  	for (int j=0; j<3; j++) {
-			fprintf(calibFile, "%.4f\n", accelCalib.data[i][j]);
+	int written = writeCalibration(CALIB_ACCEL, "calibrate/accel.txt", accelCalib);
+	
+	// One should clean up his own crap:
+	delete accel;
+	return written ? 0 : -1;
+}
+
+int writeCalibration(int sensor, const char* file, const Mat3x4& calib) {
+	// The calibration store, a running raptor reloads it. And the text file as before:
+	// 3x3 matrix row by row, then the offset.
+	if (!calibration_write(sensor, calib)) return 0;
+	printf("Written to calibrate/%s\n", CALIBRATION_FILE);
+	FILE * calibFile;
+	remove(file);
+	calibFile = fopen(file, "w");
+	if (calibFile == NULL) {
+		printf("Could not write %s!!\n", file);
+		return 0;
+	}
+	for (int i=0; i<3; i++) {
+		for (int j=0; j<3; j++) {
+			fprintf(calibFile, "%.4f\n", calib.data[i][j]);
 		}
 	}
 	for (int i=0; i<3; i++) {
-		fprintf(calibFile, "%.4f\n", accelCalib.data[i][3]);
+		fprintf(calibFile, "%.4f\n", calib.data[i][3]);
 	}
 	fclose(calibFile);
-	
-	// One should clean up his own crap:
-	delete accel;
-	// Things that are loaded in init():
-	for (int i=0; i<NUM_POSITIONS; i++) delete myFavoritePositions[i];
-	delete A_opt;
-	delete A_raw;
-	return 0;
+	printf("Written to %s\n", file);
+	return 1;
+}
+
+int calibrateCompass(const char* samples) {
+	// Streaming ellipsoid fit: every sample goes into the sums and is forgotten,
+	// the fit is shown every COMPASS_REPORT samples to see it settle.
+	HMC5883L_COMPASS* compass = NULL;
+	FILE* in = NULL;
+	if (strcmp(samples, "live") == 0) {
+		compass = new HMC5883L_COMPASS;
+		compass->use_calibration = 0;	// Raw measurements, the old calibration is what we replace
+		if (!compass->init(3)) {
+			printf("Init of compass failed!!\n");
+			delete compass;
+			return 0;
+		}
+		printf("Tumble the quad slowly through all orientations for the next %d samples\n", COMPASS_LIVE_SAMPLES);
+	} else {
+		in = strcmp(samples, "-") ? fopen(samples, "r") : stdin;
+		if (in == NULL) {
+			printf("Could not open %s!!\n", samples);
+			return 0;
+		}
+	}
+	ellipsoid_fit fit;
+	Mat3x4 compassCalib;
+	float field;
+	char line[128];
+	while (compass ? fit.count() < COMPASS_LIVE_SAMPLES : fgets(line, sizeof(line), in) != NULL) {
+		Vec3 raw;
+		if (compass) {
+			// Not due yet or stale: wait a bit. The chip sets the pace.
+			int res = compass->getMeasurement(&raw);
+			if (res <= 0) {
+				usleep(1000);
+				continue;
+			}
+		} else if (line[0] == '#' || sscanf(line, "%f %f %f", &raw[0], &raw[1], &raw[2]) != 3) {
+			continue;
+		}
+		fit.add(raw);
+		if (fit.count() % COMPASS_REPORT == 0 && fit.solve(&compassCalib, &field)) {
+			printf("%6lu samples: offset %8.3f %8.3f %8.3f, field %.3f, fit rms %.4f\n", fit.count(),
+				compassCalib.data[0][3], compassCalib.data[1][3], compassCalib.data[2][3], field, fit.rms());
+		}
+	}
+	if (in && in != stdin) fclose(in);
+	delete compass;
+
+	if (fit.count() < COMPASS_MIN_SAMPLES || !fit.solve(&compassCalib, &field)) {
+		printf("%lu samples do not determine the compass calibration, tumble it through all orientations!!\n",
+			fit.count());
+		return 0;
+	}
+	printf("Fit over %lu samples, field %.3f, fit rms %.4f\n", fit.count(), field, fit.rms());
+	return writeCalibration(CALIB_COMPASS, "calibrate/compass.txt", compassCalib);
 }
 
 void init() {
 	// Positions (pitch, roll, yaw) in degrees
-	myFavoritePositions[0] = new vector(0,0,0);			// BeagleBone on top
-	myFavoritePositions[1] = new vector(90,0,0);
-	myFavoritePositions[2] = new vector(180,0,0);		// Zippy on top
-	myFavoritePositions[3] = new vector(-90,0,0);
-	myFavoritePositions[4] = new vector(0,90,0);
-	myFavoritePositions[5] = new vector(0,-90,0);
-	myFavoritePositions[6] = new vector(0,0,90);
-	myFavoritePositions[7] = new vector(0,0,-90);
+	myFavoritePositions[0] = Vec3(0,0,0);			// BeagleBone on top
+	myFavoritePositions[1] = Vec3(90,0,0);
+	myFavoritePositions[2] = Vec3(180,0,0);		// Zippy on top
+	myFavoritePositions[3] = Vec3(-90,0,0);
+	myFavoritePositions[4] = Vec3(0,90,0);
+	myFavoritePositions[5] = Vec3(0,-90,0);
+	myFavoritePositions[6] = Vec3(0,0,90);
+	myFavoritePositions[7] = Vec3(0,0,-90);
 	
 	
-	A_opt = new matrix(3,NUM_POSITIONS);	// The 'should be' values for the accelerometer
-	A_opt->data[0][0] = 0; 	A_opt->data[1][0] = 0; 	A_opt->data[2][0] = 1;
-	A_opt->data[0][1] = 1; 	A_opt->data[1][1] = 0; 	A_opt->data[2][1] = 0;
-	A_opt->data[0][2] = 0; 	A_opt->data[1][2] = 0; 	A_opt->data[2][2] = -1;
-	A_opt->data[0][3] = -1; A_opt->data[1][3] = 0; 	A_opt->data[2][3] = 0;
-	A_opt->data[0][4] = 0; 	A_opt->data[1][4] = 1; 	A_opt->data[2][4] = 0;
-	A_opt->data[0][5] = 0; 	A_opt->data[1][5] = -1; A_opt->data[2][5] = 0;
-	A_opt->data[0][6] = 0; 	A_opt->data[1][6] = 0; 	A_opt->data[2][6] = 1;
-	A_opt->data[0][7] = 0; 	A_opt->data[1][7] = 0; 	A_opt->data[2][7] = 1;
-	
-	A_raw = new matrix(4,NUM_POSITIONS);
-	for (int i=0; i<NUM_POSITIONS; i++) {
-		// Initiate x,y,z to 0 because we sum the outputs to average multiple measurements
-		A_raw->data[0][i] = 0;	// x
-		A_raw->data[1][i] = 0;	// y
-		A_raw->data[2][i] = 0;	// z
-		A_raw->data[3][i] = 1;	// For offset calculation
-	}
+	A_opt.data[0][0] = 0; 	A_opt.data[1][0] = 0; 	A_opt.data[2][0] = 1;
+	A_opt.data[0][1] = 1; 	A_opt.data[1][1] = 0; 	A_opt.data[2][1] = 0;
+	A_opt.data[0][2] = 0; 	A_opt.data[1][2] = 0; 	A_opt.data[2][2] = -1;
+	A_opt.data[0][3] = -1; A_opt.data[1][3] = 0; 	A_opt.data[2][3] = 0;
+	A_opt.data[0][4] = 0; 	A_opt.data[1][4] = 1; 	A_opt.data[2][4] = 0;
+	A_opt.data[0][5] = 0; 	A_opt.data[1][5] = -1; A_opt.data[2][5] = 0;
+	A_opt.data[0][6] = 0; 	A_opt.data[1][6] = 0; 	A_opt.data[2][6] = 1;
+	A_opt.data[0][7] = 0; 	A_opt.data[1][7] = 0; 	A_opt.data[2][7] = 1;
 	
 	return;
 }
@@ -122,26 +228,92 @@ void collectData() {
 	/*
 	 * Collect orientation data for accelerometer + compass
 	 */
-	float avgScale = 1/NUM_MEASUREMENTS;
-	vector* accelMeasure = new vector(3);
+	Vec3 accelMeasure;
+	running_stats<3> pose;
 	
 	for (int i=0; i<NUM_POSITIONS; i++) {
-		printf("\nPut the quad in the position roll=%.2f deg, pitch=%.2f deg, yaw=%.2f deg.\nPress key when ready...\n", (*myFavoritePositions[i])[0], (*myFavoritePositions[i])[1], (*myFavoritePositions[i])[2]);
+		printf("\nPut the quad in the position roll=%.2f deg, pitch=%.2f deg, yaw=%.2f deg.\nPress key when ready...\n", myFavoritePositions[i][0], myFavoritePositions[i][1], myFavoritePositions[i][2]);
 		waitKey();
 		printf(">> Measuring, keep still!!\n");
+		Vec3 expected(A_opt.data[0][i], A_opt.data[1][i], A_opt.data[2][i]);
+		pose.reset();
 		for (int n=0;n<NUM_MEASUREMENTS;n++) {
-			// Accelerometer
-			if (!accel->getMeasurement(accelMeasure)) exit(1);
-			A_raw->data[0][i] += (*accelMeasure)[0];
-			A_raw->data[1][i] += (*accelMeasure)[1];
-			A_raw->data[2][i] += (*accelMeasure)[2];
+			// Accelerometer, every sample is folded in and forgotten
+			if (!accel->getMeasurement(&accelMeasure)) exit(1);
+			float raw[4] = {accelMeasure[0], accelMeasure[1], accelMeasure[2], 1};	// 1 for the offset
+			accelFit.add(raw, expected.data);
+			pose.add(accelMeasure.data);
 		}
-		// Multiply by avgScale to get the true average instead of the sum of samples
-		A_raw->data[0][i] = A_raw->data[0][i]*avgScale;
-		A_raw->data[1][i] = A_raw->data[0][i]*avgScale;
-		A_raw->data[2][i] = A_raw->data[0][i]*avgScale;
+		Vec3 mean = pose.mean();
+		Vec3 noise = pose.stddev();
+		printf("Mean %.4f %.4f %.4f, noise %.4f %.4f %.4f\n", mean[0], mean[1], mean[2], noise[0], noise[1], noise[2]);
 	}
-	delete accelMeasure;
+	return;
+}
+
+void collectDataAuto() {
+	/*
+	 * Watch the accelerometer: whenever the quad is at rest in one of the positions that
+	 * is not done yet, its samples go into the fit until the mean is accurate enough.
+	 */
+	Vec3 accelMeasure;
+	window_stats<3,STILL_WINDOW> window;
+	running_stats<3> pose[AUTO_POSES];
+	int done[AUTO_POSES] = {0};
+	int remaining = AUTO_POSES;
+	int current = -2;	// -1 moving or in between, otherwise the position at rest in
 	
+	printf("Put the quad in these positions, in any order, and hold it still until it is captured:\n");
+	for (int i=0; i<AUTO_POSES; i++) {
+		printf("  %d: roll=%.2f deg, pitch=%.2f deg\n", i, myFavoritePositions[i][0], myFavoritePositions[i][1]);
+	}
+	while (remaining > 0) {
+		if (!accel->getMeasurement(&accelMeasure)) exit(1);
+		usleep(1000000/AUTO_RATE);		// Repeated readings of one conversion would fake a tight interval
+		window.add(accelMeasure.data);
+		
+		int p = -1;
+		if (window.full()) {
+			Vec3 var = window.variance();
+			float maxVar = fmaxf(var[0], fmaxf(var[1], var[2]));
+			if (maxVar < STILL_STDDEV*STILL_STDDEV) p = classifyPose(window.mean());
+		}
+		if (p != current) {
+			if (p < 0) printf(">> Moving\n");
+			else if (done[p]) printf(">> Position %d, already done\n", p);
+			else printf(">> Position %d, measuring, keep still!!\n", p);
+			fflush(stdout);
+			current = p;
+		}
+		if (p < 0 || done[p]) continue;
+		
+		Vec3 expected(A_opt.data[0][p], A_opt.data[1][p], A_opt.data[2][p]);
+		float raw[4] = {accelMeasure[0], accelMeasure[1], accelMeasure[2], 1};	// 1 for the offset
+		accelFit.add(raw, expected.data);
+		pose[p].add(accelMeasure.data);
+		
+		// 95% confidence half width of the mean, worst axis
+		unsigned long n = pose[p].count();
+		Vec3 noise = pose[p].stddev();
+		float ci = 1.96f * fmaxf(noise[0], fmaxf(noise[1], noise[2])) / sqrtf(n);
+		if ((n >= CAPTURE_MIN && ci < CAPTURE_CI) || n >= CAPTURE_MAX) {
+			Vec3 mean = pose[p].mean();
+			printf("Position %d captured: %lu samples, mean %.4f %.4f %.4f, +/- %.4f\n", p, n, mean[0], mean[1], mean[2], ci);
+			done[p] = 1;
+			remaining--;
+			if (remaining > 0) printf("%d to go\n", remaining);
+		}
+	}
 	return;
-}
\ No newline at end of file
+}
+
+int classifyPose(const Vec3& mean) {
+	// Which position gravity points to, -1 if none is close enough
+	float norm = mean.norm();
+	if (!(norm > 0)) return -1;
+	for (int i=0; i<AUTO_POSES; i++) {
+		float cosine = (A_opt.data[0][i]*mean[0] + A_opt.data[1][i]*mean[1] + A_opt.data[2][i]*mean[2]) / norm;
+		if (cosine > POSE_ALIGN) return i;
+	}
+	return -1;
+}
@@ -1,37 +1,214 @@
-// This is just a test file for the BMA020_ACCEL class
+// Main program of the raptor: reads the sensors, runs the IMU at a fixed rate
+//	./raptor [-r rate] [-p priority] [-c cpu] [-m] [-o file] [-i chip:line]
+//	-r: loop rate [Hz], default RAPTOR_RATE
+//	-p: run with SCHED_FIFO at this priority (needs root)
+//	-c: pin the loop to this cpu
+//	-m: lock all memory, no page faults in the loop
+//	-o: record all samples, the IMU state and the loop timing to this file (see Recorder.h)
+//	-i: sample when the accelerometer's INT pin, wired to this GPIO (/dev/gpiochipN, line),
+//	    says a new sample is there, instead of polling it at ACQ_DEFAULT_RATE
+// Ctrl-C stops the loop and prints its timing statistics and metrics.
+// The status line and driver errors are printed by a thread of its own at normal priority:
+// the loop only hands it the angles, it never waits on the terminal.
+// A new calibrate/calibration.bin (from the calibrator) is picked up while running.
 
 #include <stdio.h>
-#include "BMA020.h"
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include "IMU.h"
+#include "Acquisition.h"
+#include "Calibration.h"
+#include "LoopRunner.h"
+#include "Metrics.h"
+#include "Recorder.h"
 #include "matrix.h"
 
+#define RAPTOR_RATE 250				// Control loop rate [Hz]
+#define RAPTOR_STATUS_RATE 1		// Status print rate [Hz]
+#define RAPTOR_GROUND_HEIGHT 0.3	// Above this the quad is flying, no gyro bias tracking [m] (the SRF02 reads ~16 cm at least)
+
+static LoopRunner* runner = NULL;
+
+// Written by the loop, printed by the status thread. A line mixing two updates is harmless.
+static std::atomic<float> status_angles[3];
+static std::atomic<float> status_height(0);
+static int status_running = 0;
+static pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t status_stop = PTHREAD_COND_INITIALIZER;
+
+static void onSignal(int sig) {
+	if (runner) runner->stop();
+}
+
+struct raptor_state {
+	IMU* imu;
+	SensorAcquisition* acquisition;
+};
+
+static void imuTask(void* arg, float dt) {
+	raptor_state* state = (raptor_state*)arg;
+	state->imu->update(dt);
+	// A slow level yaw in flight keeps the accelerometer still, it would be taken for bias.
+	// Without a ranger the height stays 0: tracked all the time, as on the bench.
+	state->acquisition->setTrackBias(state->imu->getHeight() < RAPTOR_GROUND_HEIGHT);
+}
+
+static void statusTask(void* arg, float dt) {
+	IMU* imu = (IMU*)arg;
+	const Vec3& angles = imu->getAngles();
+	for (int i=0; i<3; i++) status_angles[i].store(angles[i], std::memory_order_relaxed);
+	status_height.store(imu->getHeight(), std::memory_order_relaxed);
+}
+
+static void* statusThread(void* arg) {
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	pthread_mutex_lock(&status_lock);
+	while (status_running) {
+		next.tv_nsec += 1000000000 / RAPTOR_STATUS_RATE;
+		next.tv_sec += next.tv_nsec / 1000000000;
+		next.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&status_stop, &status_lock, &next);
+		if (!status_running) break;
+		pthread_mutex_unlock(&status_lock);
+		printf("Pitch %6.1f  roll %6.1f  yaw %6.1f [deg]  height %5.2f [m]\n",
+			status_angles[0].load(std::memory_order_relaxed)*57.2958f,
+			status_angles[1].load(std::memory_order_relaxed)*57.2958f,
+			status_angles[2].load(std::memory_order_relaxed)*57.2958f,
+			status_height.load(std::memory_order_relaxed));
+		fflush(stdout);
+		metrics_flush_log(stderr);
+		pthread_mutex_lock(&status_lock);
+	}
+	pthread_mutex_unlock(&status_lock);
+	return NULL;
+}
+
+// startStatus(): Normal scheduling whatever the loop runs with, so a slow terminal only
+// delays the status line. Returns 1 if successful, 0 if not.
+static int startStatus(pthread_t* thread) {
+	pthread_condattr_t condattr;
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&status_stop, &condattr);
+	pthread_condattr_destroy(&condattr);
+
+	pthread_attr_t attr;
+	struct sched_param param;
+	param.sched_priority = 0;
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	pthread_attr_setschedparam(&attr, &param);
+	status_running = 1;
+	int res = pthread_create(thread, &attr, statusThread, NULL);
+	pthread_attr_destroy(&attr);
+	if (res != 0) status_running = 0;
+	return res == 0;
+}
+
+static void stopStatus(pthread_t thread) {
+	pthread_mutex_lock(&status_lock);
+	status_running = 0;
+	pthread_cond_signal(&status_stop);
+	pthread_mutex_unlock(&status_lock);
+	pthread_join(thread, NULL);
+}
+
 int main(int argc, char *argv[]) {
-	BMA020_ACCEL* mySensor = new BMA020_ACCEL;
-	
-	if (mySensor->init(3)) {
-		printf("Init of sensor successful!!\n\n");
-	} else {
-		printf("Init of sensor failed!!\n\n");
-		delete mySensor;
+	int rate = RAPTOR_RATE;
+	int priority = 0;
+	int cpu = -1;
+	int lock = 0;
+	const char* record = NULL;
+	int gpio_chip = -1, gpio_line = -1;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:p:c:mo:i:")) != -1) {
+		switch (opt) {
+			case 'r': rate = atoi(optarg); break;
+			case 'p': priority = atoi(optarg); break;
+			case 'c': cpu = atoi(optarg); break;
+			case 'm': lock = 1; break;
+			case 'o': record = optarg; break;
+			case 'i':
+				if (sscanf(optarg, "%d:%d", &gpio_chip, &gpio_line) == 2) break;
+				// Fall through
+			default:
+				fprintf(stderr, "Usage: %s [-r rate] [-p priority] [-c cpu] [-m] [-o file] [-i chip:line]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	// Opened first: its mapping is then locked by -m too
+	FlightRecorder recorder;
+	if (record && !recorder.open(record)) {
+		printf("Could not open the flight recorder!!\n");
 		return -1;
 	}
-	
-	vector myMeasurement = new vector(3);
-	char key;
-	printf("Starting measurements. Press any key to continue, press q to quit\n\n");
-		
-	while (scanf("%c",&key)) {
-		if (key=='q') break;
-		if (mySensor->getMeasurement(&myMeasurement)) {
-			printf("Measurement (x,y,z) = (%.2f,%.2f,%.2f)\n",
-				myMeasurement[0],
-				myMeasurement[1],
-				myMeasurement[2]);
-		} else {
-			printf("Measurement failed!!\n");
-		}
+
+	// Before the drivers, they share it
+	calibration_open();
+	calibration_watch();
+
+	LoopRunner loop(rate);
+	// Before starting the acquisition thread, so it inherits the scheduling and affinity
+	if (lock) loop.lockMemory();
+	if (priority > 0) loop.setRealtime(priority);
+	if (cpu >= 0) loop.setAffinity(cpu);
+
+	SensorAcquisition acquisition;
+	if (record) acquisition.setRecorder(&recorder);
+	if (!acquisition.init(I2CBUS_SENSORS)) {
+		printf("Init of sensors failed!!\n");
+		return -1;
+	}
+	if (gpio_chip >= 0 && !acquisition.useDataReady(gpio_chip, gpio_line)) {
+		printf("No data-ready interrupt, polling the sensors instead\n");
+	}
+	if (!acquisition.start()) {
+		printf("Init of sensors failed!!\n");
+		return -1;
 	}
-	
-	delete mySensor;
-	
+	IMU imu;
+	imu.attach(acquisition.getRing());
+	if (record) {
+		imu.setRecorder(&recorder);
+		loop.setRecorder(&recorder);
+	}
+
+	raptor_state state = { &imu, &acquisition };
+	loop.addTask(imuTask, &state, 1);
+	int divider = loop.getRate() / RAPTOR_STATUS_RATE;
+	loop.addTask(statusTask, &imu, divider > 0 ? divider : 1);
+
+	pthread_t status;
+	if (!startStatus(&status)) printf("No status thread, status lines are not printed\n");
+
+	runner = &loop;
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	loop.run();
+	runner = NULL;
+	if (status_running) stopStatus(status);
+
+	acquisition.stop();
+	loop.printStats(stdout);
+	printf("Acquisition: %lu cycles, %lu overruns, %lu read errors, %lu ring overflows\n",
+		acquisition.getCycles(), acquisition.getOverruns(), acquisition.getReadErrors(),
+		acquisition.getRing()->getOverflows());
+	metrics_flush_log(stderr);
+	metrics_snapshot snapshot;
+	metrics_take(&snapshot);
+	metrics_print(&snapshot, stdout);
+	if (record) {
+		recorder.close();
+		printf("Recorded %lu records to %s\n", recorder.getWritten(), record);
+	}
+	calibration_close();
+
 	return 0;
-}
\ No newline at end of file
+}
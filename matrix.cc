@@ -6,9 +6,55 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 
 #include "matrix.h"
 
+// Pick the batch kernel set from the target flags
+#if defined(MATRIX_NO_SIMD)
+#define MATRIX_SIMD_SCALAR
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define MATRIX_SIMD_AVX
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define MATRIX_SIMD_SSE
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MATRIX_SIMD_NEON
+#else
+#define MATRIX_SIMD_SCALAR
+#endif
+
+
+/********************
+ * Storage helpers
+ ********************/
+
+static void* alloc_block(unsigned int count, size_t size) {
+	// One aligned block, zeroed. Never returns NULL.
+	void* ptr = NULL;
+	size_t bytes = (count ? count : 1) * size;
+	if (posix_memalign(&ptr, MATRIX_ALIGNMENT, bytes) != 0) {
+		fprintf(stderr, "Out of memory allocating %u elements\n", count);
+		exit(1);
+	}
+	memset(ptr, 0, bytes);
+	return ptr;
+}
+
+static float* alloc_floats(unsigned int count) {
+	return (float*)alloc_block(count, sizeof(float));
+}
+
+/********************
+ * Expression templates
+ ********************/
+
+void vexpr_length_mismatch() {
+	fprintf(stderr, "Vectors in expression don't match in length\n");
+	exit(1);
+}
 
 /********************
  * vector Class
@@ -16,12 +62,12 @@
 		
 vector::vector(unsigned int length) {
 	this->n = length;
-	this->data = new float[length];
+	this->data = alloc_floats(length);
 }
 
 vector::vector(float x, float y, float z) {
 	this->n = 3;
-	this->data = new float[3];
+	this->data = alloc_floats(3);
 	
 	this->data[0] = x;
 	this->data[1] = y;
@@ -30,23 +76,56 @@ vector::vector(float x, float y, float z) {
 
 vector::vector(vector* src) {
 	this->n = src->length();
-	this->data = new float[n];
-	for (unsigned int i=0; i<n; i++)
-		this->data[i] = (*src)[i];
+	this->data = alloc_floats(n);
+	memcpy(this->data, src->data, n*sizeof(float));
+}
+
+vector::vector(const vector& src) {
+	this->n = src.n;
+	this->data = alloc_floats(n);
+	memcpy(this->data, src.data, n*sizeof(float));
+}
+
+vector::vector(vector&& src) {
+	this->n = src.n;
+	this->data = src.data;
+	src.n = 0;
+	src.data = NULL;
+}
+
+vector::~vector() {
+	free(this->data);
+}
+
+vector& vector::operator= (const vector& src) {
+	if (this == &src) return *this;
+	if (this->n != src.n) {
+		free(this->data);
+		this->n = src.n;
+		this->data = alloc_floats(n);
+	}
+	memcpy(this->data, src.data, n*sizeof(float));
+	return *this;
+}
+
+vector& vector::operator= (vector&& src) {
+	if (this == &src) return *this;
+	free(this->data);
+	this->n = src.n;
+	this->data = src.data;
+	src.n = 0;
+	src.data = NULL;
+	return *this;
 }
 
 void vector::set(unsigned int index, float value) {
-	if (index>n) {
+	if (index>=n) {
 		fprintf(stderr, "Index exceeds vector dimensions\n");
 		exit(1);
 	}
 	this->data[index] = value;
 }
 
-unsigned int vector::length() const {
-	return this->n;
-}
-
 void vector::normalize() {
 	// Normalize the vector
 	float scale = 0;
@@ -68,46 +147,18 @@ void vector::print() const {
 	return;
 }
 
-// Overloaded operators
-
-vector vector::operator+ (const vector param) const {
-	// Elementwise adding
-	if (n!=param.length()) {
-		fprintf(stderr, "Vectors to add don't match in length\n");
-		exit(1);
-	}
-	vector temp = new vector(n);
-	for (unsigned int i=0; i<n; i++)
-		temp.set(i, this->data[i] + param[i]);
-	return (temp);
-}
-
-vector vector::operator- (const vector param) const {
-	// Elementwise substraction
-	if (n!=param.length()) {
-		fprintf(stderr, "Vectors to add don't match in length\n");
-		exit(1);
-	}
-	vector temp = new vector(n);
-	for (unsigned int i=0; i<n; i++)
-		temp.set(i, this->data[i] - param[i]);
-	return (temp);
+void vector::resize(unsigned int length) {
+	if (this->data && this->n == length) return;
+	free(this->data);
+	this->n = length;
+	this->data = alloc_floats(length);
 }
 
-vector vector::operator* (float scale) const {
-	// Multiply with scalar
-	vector temp = new vector(n);
-	for (unsigned int i=0; i<n; i++)
-		temp.set(i, data[i] * scale);
-	return (temp);
-}
+// Overloaded operators
 
-float vector::operator[] (const unsigned int index) const {
-	if (index>n-1) {
-		fprintf(stderr, "Index out of range for vector\n");
-		exit(1);
-	}
-	return data[index];
+void vector_index_error() {
+	fprintf(stderr, "Index out of range for vector\n");
+	exit(1);
 }
 		
 // Vector helper functions
@@ -130,32 +181,74 @@ float vector_innerprod (vector* v1, vector* v2) {
 matrix::matrix(unsigned int rows, unsigned int cols) {
 	this->n = rows;
 	this->m = cols;
-	this->data = new float*[n];
-
-	for (unsigned int i=0; i<n; i++) {
-		this->data[i] = new float[n];
-	}
-
+	this->data = alloc_floats(n*m);
 }
 
 matrix::matrix(matrix* src) {
 	this->n = src->rows();
 	this->m = src->cols();
-	this->data = new float*[n];
+	this->data = alloc_floats(n*m);
+	memcpy(this->data, src->data, n*m*sizeof(float));
+}
+
+matrix::matrix(const matrix& src) {
+	this->n = src.n;
+	this->m = src.m;
+	this->data = alloc_floats(n*m);
+	memcpy(this->data, src.data, n*m*sizeof(float));
+}
+
+matrix::matrix(matrix&& src) {
+	this->n = src.n;
+	this->m = src.m;
+	this->data = src.data;
+	src.n = 0;
+	src.m = 0;
+	src.data = NULL;
+}
+
+matrix::matrix(const matrix_view& src) {
+	this->n = src.rows();
+	this->m = src.cols();
+	this->data = alloc_floats(n*m);
 	for (unsigned int i=0; i<n; i++)
-		this->data[i] = new float[m];
-	for (unsigned int i=0; i<n; i++) {
-		for (unsigned int j=0; j<m; j++) {
-			this->data[i][j] = src->data[i][j];
-		}
+		for (unsigned int j=0; j<m; j++)
+			this->data[i*m + j] = src(i,j);
+}
+
+matrix::~matrix() {
+	free(this->data);
+}
+
+matrix& matrix::operator= (const matrix& src) {
+	if (this == &src) return *this;
+	if (this->n*this->m != src.n*src.m) {
+		free(this->data);
+		this->data = alloc_floats(src.n*src.m);
 	}
+	this->n = src.n;
+	this->m = src.m;
+	memcpy(this->data, src.data, n*m*sizeof(float));
+	return *this;
+}
+
+matrix& matrix::operator= (matrix&& src) {
+	if (this == &src) return *this;
+	free(this->data);
+	this->n = src.n;
+	this->m = src.m;
+	this->data = src.data;
+	src.n = 0;
+	src.m = 0;
+	src.data = NULL;
+	return *this;
 }
 
-unsigned int matrix::cols() {
+unsigned int matrix::cols() const {
 	return m;
 }
 
-unsigned int matrix::rows() {
+unsigned int matrix::rows() const {
 	return n;
 }
 	
@@ -163,166 +256,348 @@ void matrix::print() const {
 	for (unsigned int i=0;i<n;i++) {
 		printf("[");
 		for (unsigned int j=0;j<m;j++)
-			printf("\t%f\t", data[i][j]);
+			printf("\t%f\t", data[i*m + j]);
 		printf("]\n");
 	}
 	printf("\n");
 	return;
 }
 
+matrix_view matrix::view() const {
+	return matrix_view(data, n, m, m, 1);
+}
+
+matrix_view matrix::transposed() const {
+	return matrix_view(data, m, n, 1, m);
+}
+
 void matrix::transpose() {
-	float ** newdata = new float*[m];
-	for (unsigned int i=0; i<m; i++)
-		newdata[i] = new float[n];
-		
-	for (unsigned int i=0; i<n; i++) {
-		for (unsigned int j=0; j<m; j++) {
-			newdata[j][i] = this->data[i][j];
+	// In-place transpose of the contiguous buffer.
+	// Square: swap across the diagonal. Otherwise follow the permutation cycles:
+	// the element at linear index k moves to (k*n) mod (n*m-1). Each cycle is
+	// rotated once, starting from its smallest index, so no extra storage is needed.
+	if (n == m) {
+		for (unsigned int i=0; i<n; i++) {
+			for (unsigned int j=i+1; j<m; j++) {
+				float tmp = data[i*m + j];
+				data[i*m + j] = data[j*m + i];
+				data[j*m + i] = tmp;
+			}
+		}
+	} else if (n > 1 && m > 1) {
+		unsigned long last = (unsigned long)n*m - 1;
+		for (unsigned long start=1; start<last; start++) {
+			// Only rotate if start is the smallest index of its cycle
+			unsigned long k = (start*n) % last;
+			while (k > start) k = (k*n) % last;
+			if (k != start) continue;
+			
+			float carry = data[start];
+			k = start;
+			do {
+				unsigned long next = (k*n) % last;
+				float tmp = data[next];
+				data[next] = carry;
+				carry = tmp;
+				k = next;
+			} while (k != start);
 		}
 	}
 	unsigned int m_old = this->m;
 	this->m = this->n;
 	this->n = m_old;
-	delete this->data;
-	this->data = newdata;
 	return;
 }
 
 int matrix::invert() {
-	// Matrix Inversion Routine from http://www.arduino.cc/playground/Code/MatrixMath
-	// * This function inverts a matrix based on the Gauss Jordan method.
-	// * Specifically, it uses partial pivoting to improve numeric stability.
-	// * The algorithm is drawn from those presented in 
-	//       NUMERICAL RECIPES: The Art of Scientific Computing.
-	// * The function returns 1 on success, 0 on failure.
-	// * NOTE: The result is written in the source matrix!
+	// LU with partial pivoting, then solve for the columns of the identity.
+	// The function returns 1 on success, 0 on failure.
+	// NOTE: The result is written in the source matrix!
 	if (m!=n) {
 		fprintf(stderr, "Cannot invert non-square matrix! You might want to use pseudo_invert().\n");
 		exit(1);		
 	}
-	unsigned int pivrow;	// keeps track of current pivot row
-	unsigned int k,i,j;     // k: overall index along diagonal; i: row index; j: col index
-	unsigned int pivrows[n]; // keeps track of rows swaps to undo at end
-	float tmp;              // used for finding max value and making column swaps
-	
-	for (k = 0; k < n; k++) {
-		// find pivot row, the row with biggest entry in current column
-		tmp = 0;
-		for (i = k; i < n; i++)
-		{
-			if (fabs(data[i][k]) >= tmp)      // 'Avoid using other functions inside abs()?'
-			{
-				tmp = fabs(data[i][k]);
-				pivrow = i;
-			}
-		}
-		
-		// check for singular matrix
-		if (data[pivrow][k] == 0.0f)
-		{
-			//Inversion failed due to singular matrix
-			return 0;
-		}
-		
-		// Execute pivot (row swap) if needed
-		if (pivrow != k)
-		{
-			// swap row k with pivrow
-			for (j = 0; j < n; j++)
-			{
-				tmp = data[k][j];
-				data[k][j] = data[pivrow][j];
-				data[pivrow][j] = tmp;
-			}
-		}
-		pivrows[k] = pivrow;    // record row swap (even if no swap happened)
-		
-		tmp = 1.0f/data[k][k];  // invert pivot element
-		data[k][k] = 1.0f;		// This element of input matrix becomes result matrix
-		
-		// Perform row reduction (divide every element by pivot)
-		for (j = 0; j < n; j++)
-		{
-			data[k][j] *= tmp;
-		}
-		
-		// Now eliminate all other entries in this column
-		for (i = 0; i < n; i++)
-		{
-			if (i != k)
-			{
-				tmp = data[i][k];
-				data[i][k] = 0.0f;  // The other place where in matrix becomes result mat
-				for (j = 0; j < n; j++)
-				{
-					data[i][j] = data[i][j] - data[k][j]*tmp;
-				}
+	// Workspace on the heap like the copy, its size is only known at run time
+	matrix LU(*this);
+	unsigned int* piv = (unsigned int*)alloc_block(n, sizeof(unsigned int));
+	if (!lu_factor<0>(LU.data, n, m, piv)) {
+		free(piv);
+		return 0;
+	}
+	memset(data, 0, n*m*sizeof(float));
+	for (unsigned int j = 0; j < n; j++) {
+		data[j*m + j] = 1.0f;
+		lu_solve<0>(LU.data, n, m, piv, data + j, m);
+	}
+	free(piv);
+	return 1;
+}
+
+matrix matrix::pseudo_inverse() const {
+	// Tall (n>=m): column i is the least squares solution of M*x = e_i, so pseudo_inv(M)*M = I
+	// Wide (m>n):  the transpose of that for MT, so M*pseudo_inv(M) = I
+	// Householder QR, never the normal equations. Zero if M is rank deficient.
+	unsigned int rows = (n >= m) ? n : m;
+	unsigned int cols = (n >= m) ? m : n;
+	matrix QR(*this);
+	if (n < m) QR.transpose();
+	matrix result(m, n);
+	float* tau = alloc_floats(cols + rows);
+	float* b = tau + cols;
+	if (qr_factor<0,0>(QR.data, rows, cols, cols, tau)) {
+		for (unsigned int i = 0; i < rows; i++) {
+			for (unsigned int k = 0; k < rows; k++) b[k] = (k == i);
+			qr_solve<0,0>(QR.data, rows, cols, cols, tau, b);
+			for (unsigned int k = 0; k < cols; k++) {
+				if (n >= m) result(k, i) = b[k];
+				else result(i, k) = b[k];
 			}
 		}
 	}
+	free(tau);
+	return result;
+}
 
-	// Done, now need to undo pivot row swaps by doing column swaps in reverse order
-	for (k = n-1; (k >= 0)&&(k<n); k--)	// Hack because k is unsigned int
-	{
-		if (pivrows[k] != k)
-		{
-			for (i = 0; i < n; i++)
-			{
-				tmp = data[i][k];
-				data[i][k] = data[i][pivrows[k]];
-				data[i][pivrows[k]] = tmp;
+/********************
+ * Products
+ ********************/
+
+matrix operator* (const matrix_view& A, const matrix_view& B) {
+	// Matrix * Matrix
+	if (A.cols()!=B.rows()) {
+		fprintf(stderr, "Matrix dimensions don't match\n");
+		exit(1);
+	}	
+	matrix result(A.rows(),B.cols());
+	for (unsigned int i=0; i<A.rows(); i++) {
+		float* row = result[i];
+		for (unsigned int j=0; j<B.cols(); j++) {
+			float temp = 0;
+			for (unsigned int k=0; k<A.cols(); k++) {
+				temp += A(i,k) * B(k,j);
 			}
+			row[j] = temp;
 		}
 	}
+	return result;
+}
+
+/********************
+ * vec3_block Class
+ ********************/
+
+// Samples per SIMD register, blocks are padded to a multiple of this
+#if defined(MATRIX_SIMD_AVX)
+#define SIMD_WIDTH 8
+#elif defined(MATRIX_SIMD_SSE) || defined(MATRIX_SIMD_NEON)
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
+vec3_block::vec3_block(unsigned int capacity) {
+	this->cap = capacity;
+	this->count = 0;
+	unsigned int padded = (capacity + SIMD_WIDTH-1) / SIMD_WIDTH * SIMD_WIDTH;
+	this->x = alloc_floats(padded);
+	this->y = alloc_floats(padded);
+	this->z = alloc_floats(padded);
+}
+
+vec3_block::~vec3_block() {
+	free(this->x);
+	free(this->y);
+	free(this->z);
+}
 
+unsigned int vec3_block::capacity() const {
+	return cap;
+}
+
+void vec3_block::clear() {
+	count = 0;
+}
+
+int vec3_block::push(const Vec3& sample) {
+	if (count >= cap) return 0;
+	x[count] = sample[0];
+	y[count] = sample[1];
+	z[count] = sample[2];
+	count++;
 	return 1;
 }
 
-matrix matrix::pseudo_inverse() {
-	//pseudo_inverse(M) = inv(MT*M)*MT
-	// If matrix is tall (n>m), this results in the left inverse: pseudo_inv(m)*m = I
-	// If matrix is wide (m>n), this results in the right inverse: m*pseudo_inv(m) = I
+Vec3 vec3_block::get(unsigned int index) const {
+	return Vec3(x[index], y[index], z[index]);
+}
 
-	matrix MT = matrix(this);
-	MT.transpose();			// MT is transposed of myself
-	matrix temp = MT*this;
-	temp.invert();
-	matrix result = temp*MT;
-	return result;
+/********************
+ * Batch kernels
+ * Each kernel is written once against the small simd_* wrapper set below and
+ * finishes the last count % SIMD_WIDTH samples with scalar code. Loads and
+ * stores are aligned: blocks start on MATRIX_ALIGNMENT and we step by whole registers.
+ ********************/
+
+#if defined(MATRIX_SIMD_AVX)
+typedef __m256 simd_f;
+static inline simd_f simd_load(const float* p) { return _mm256_load_ps(p); }
+static inline void simd_store(float* p, simd_f a) { _mm256_store_ps(p, a); }
+static inline simd_f simd_set1(float a) { return _mm256_set1_ps(a); }
+static inline simd_f simd_zero() { return _mm256_setzero_ps(); }
+static inline simd_f simd_add(simd_f a, simd_f b) { return _mm256_add_ps(a, b); }
+static inline simd_f simd_mul(simd_f a, simd_f b) { return _mm256_mul_ps(a, b); }
+static inline simd_f simd_sqrt(simd_f a) { return _mm256_sqrt_ps(a); }
+static inline float simd_hsum(simd_f a) {
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
 }
+#elif defined(MATRIX_SIMD_SSE)
+typedef __m128 simd_f;
+static inline simd_f simd_load(const float* p) { return _mm_load_ps(p); }
+static inline void simd_store(float* p, simd_f a) { _mm_store_ps(p, a); }
+static inline simd_f simd_set1(float a) { return _mm_set1_ps(a); }
+static inline simd_f simd_zero() { return _mm_setzero_ps(); }
+static inline simd_f simd_add(simd_f a, simd_f b) { return _mm_add_ps(a, b); }
+static inline simd_f simd_mul(simd_f a, simd_f b) { return _mm_mul_ps(a, b); }
+static inline simd_f simd_sqrt(simd_f a) { return _mm_sqrt_ps(a); }
+static inline float simd_hsum(simd_f a) {
+	__m128 s = _mm_add_ps(a, _mm_movehl_ps(a, a));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+#elif defined(MATRIX_SIMD_NEON)
+typedef float32x4_t simd_f;
+static inline simd_f simd_load(const float* p) { return vld1q_f32(p); }
+static inline void simd_store(float* p, simd_f a) { vst1q_f32(p, a); }
+static inline simd_f simd_set1(float a) { return vdupq_n_f32(a); }
+static inline simd_f simd_zero() { return vdupq_n_f32(0); }
+static inline simd_f simd_add(simd_f a, simd_f b) { return vaddq_f32(a, b); }
+static inline simd_f simd_mul(simd_f a, simd_f b) { return vmulq_f32(a, b); }
+static inline simd_f simd_sqrt(simd_f a) {
+#if defined(__aarch64__)
+	return vsqrtq_f32(a);
+#else
+	// ARMv7 has no vector sqrt: a * rsqrt(a), estimate refined by two Newton steps.
+	// rsqrt(0) is inf, so zero lanes are masked back to 0.
+	simd_f r = vrsqrteq_f32(a);
+	r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(a, r), r));
+	r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(a, r), r));
+	uint32x4_t nonzero = vcgtq_f32(a, vdupq_n_f32(0));
+	return vbslq_f32(nonzero, vmulq_f32(a, r), vdupq_n_f32(0));
+#endif
+}
+static inline float simd_hsum(simd_f a) {
+	float32x2_t s = vadd_f32(vget_low_f32(a), vget_high_f32(a));
+	return vget_lane_f32(vpadd_f32(s, s), 0);
+}
+#endif
 
-vector matrix::operator* (vector param) {
-	// Matrix * column vector
-	if (m!=param.length()) {
-		fprintf(stderr, "Matrix/vector dimensions don't match\n");
+void vec3_block_affine(const Mat3& M, const Vec3& offset, const vec3_block& in, vec3_block& out) {
+	if (out.capacity() < in.count) {
+		fprintf(stderr, "Output block too small for affine transform\n");
 		exit(1);
-	}	
-	vector result(n);
-	float temp;
-	for (unsigned int i=0; i<n; i++) {
-		temp = 0;
-		for (unsigned int j=0; j<m; j++) {
-			temp += data[i][j]*param[j];
-		}
-		result.set(i,temp);
 	}
-	return result;
+	unsigned int i = 0;
+#if !defined(MATRIX_SIMD_SCALAR)
+	simd_f m[3][3], o[3];
+	for (unsigned int r=0; r<3; r++) {
+		for (unsigned int c=0; c<3; c++) m[r][c] = simd_set1(M.data[r][c]);
+		o[r] = simd_set1(offset[r]);
+	}
+	for (; i + SIMD_WIDTH <= in.count; i += SIMD_WIDTH) {
+		simd_f x = simd_load(in.x + i);
+		simd_f y = simd_load(in.y + i);
+		simd_f z = simd_load(in.z + i);
+		// Compute all three rows before storing, in case out is in
+		simd_f rx = simd_add(o[0], simd_add(simd_mul(m[0][0], x), simd_add(simd_mul(m[0][1], y), simd_mul(m[0][2], z))));
+		simd_f ry = simd_add(o[1], simd_add(simd_mul(m[1][0], x), simd_add(simd_mul(m[1][1], y), simd_mul(m[1][2], z))));
+		simd_f rz = simd_add(o[2], simd_add(simd_mul(m[2][0], x), simd_add(simd_mul(m[2][1], y), simd_mul(m[2][2], z))));
+		simd_store(out.x + i, rx);
+		simd_store(out.y + i, ry);
+		simd_store(out.z + i, rz);
+	}
+#endif
+	for (; i < in.count; i++) {
+		float x = in.x[i], y = in.y[i], z = in.z[i];
+		out.x[i] = M.data[0][0]*x + M.data[0][1]*y + M.data[0][2]*z + offset[0];
+		out.y[i] = M.data[1][0]*x + M.data[1][1]*y + M.data[1][2]*z + offset[1];
+		out.z[i] = M.data[2][0]*x + M.data[2][1]*y + M.data[2][2]*z + offset[2];
+	}
+	out.count = in.count;
 }
 
-matrix matrix::operator* (matrix param) {
-	// Matrix * Matrix
-	if (m!=param.rows()) {
-		fprintf(stderr, "Matrix dimensions don't match\n");
+void vec3_block_norm(const vec3_block& in, float* out) {
+	unsigned int i = 0;
+#if !defined(MATRIX_SIMD_SCALAR)
+	for (; i + SIMD_WIDTH <= in.count; i += SIMD_WIDTH) {
+		simd_f x = simd_load(in.x + i);
+		simd_f y = simd_load(in.y + i);
+		simd_f z = simd_load(in.z + i);
+		simd_f sq = simd_add(simd_mul(x, x), simd_add(simd_mul(y, y), simd_mul(z, z)));
+		simd_f r = simd_sqrt(sq);
+		float lanes[SIMD_WIDTH] __attribute__((aligned(MATRIX_ALIGNMENT)));
+		simd_store(lanes, r);	// out is caller memory, alignment unknown
+		for (unsigned int k=0; k<SIMD_WIDTH; k++) out[i+k] = lanes[k];
+	}
+#endif
+	for (; i < in.count; i++)
+		out[i] = sqrtf(in.x[i]*in.x[i] + in.y[i]*in.y[i] + in.z[i]*in.z[i]);
+}
+
+void vec3_block_dot(const vec3_block& a, const vec3_block& b, float* out) {
+	if (a.count != b.count) {
+		fprintf(stderr, "Blocks for dot product don't match in length\n");
 		exit(1);
-	}	
-	matrix result(n,param.cols());
-	for (unsigned int i=0; i<n; i++) {
-		for (unsigned int j=0; j<param.cols(); j++) {
-			result.data[i][j] = 0;
-			for (unsigned int k=0; k<m; k++) {
-				result.data[i][j] += data[i][k] * param.data[k][j];
-			}
-		}
 	}
-	return result;
+	unsigned int i = 0;
+#if !defined(MATRIX_SIMD_SCALAR)
+	for (; i + SIMD_WIDTH <= a.count; i += SIMD_WIDTH) {
+		simd_f r = simd_add(simd_mul(simd_load(a.x + i), simd_load(b.x + i)),
+		           simd_add(simd_mul(simd_load(a.y + i), simd_load(b.y + i)),
+		                    simd_mul(simd_load(a.z + i), simd_load(b.z + i))));
+		float lanes[SIMD_WIDTH] __attribute__((aligned(MATRIX_ALIGNMENT)));
+		simd_store(lanes, r);
+		for (unsigned int k=0; k<SIMD_WIDTH; k++) out[i+k] = lanes[k];
+	}
+#endif
+	for (; i < a.count; i++)
+		out[i] = a.x[i]*b.x[i] + a.y[i]*b.y[i] + a.z[i]*b.z[i];
+}
+
+Vec3 vec3_block_mean(const vec3_block& in) {
+	if (in.count == 0) return Vec3();
+	float sx = 0, sy = 0, sz = 0;
+	unsigned int i = 0;
+#if !defined(MATRIX_SIMD_SCALAR)
+	simd_f ax = simd_zero(), ay = simd_zero(), az = simd_zero();
+	for (; i + SIMD_WIDTH <= in.count; i += SIMD_WIDTH) {
+		ax = simd_add(ax, simd_load(in.x + i));
+		ay = simd_add(ay, simd_load(in.y + i));
+		az = simd_add(az, simd_load(in.z + i));
+	}
+	sx = simd_hsum(ax);
+	sy = simd_hsum(ay);
+	sz = simd_hsum(az);
+#endif
+	for (; i < in.count; i++) {
+		sx += in.x[i];
+		sy += in.y[i];
+		sz += in.z[i];
+	}
+	float scale = 1.0f/in.count;
+	return Vec3(sx*scale, sy*scale, sz*scale);
+}
+
+const char* vec3_block_kernels() {
+#if defined(MATRIX_SIMD_AVX)
+	return "avx";
+#elif defined(MATRIX_SIMD_SSE)
+	return "sse";
+#elif defined(MATRIX_SIMD_NEON)
+	return "neon";
+#else
+	return "scalar";
+#endif
 }
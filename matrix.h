@@ -6,12 +6,138 @@
 #ifndef _MATRIX_H
 #define _MATRIX_H
 
-class vector {
+#include <stdio.h>
+#include <math.h>
+#include <limits>
+
+#define MATRIX_ALIGNMENT 32		// Byte alignment of vector/matrix/block storage (AVX register width)
+
+/********************
+ * Expression templates
+ * Vector arithmetic returns lightweight nodes instead of temporaries. Assigning
+ * a node to a vector/fvector evaluates the whole chain in one loop, e.g.
+ * 	out = M*raw + offset;	// one pass, no intermediate vectors
+ * Leaves (vector, fvector) are held by reference, inner nodes by value, so a node
+ * must not outlive the full expression it was built in.
+ ********************/
+
+template <class E>
+class vexpr {
+	public:
+		const E& self() const { return static_cast<const E&>(*this); }
+};
+
+template <unsigned int N> class fvector;
+class vector;
+class matrix_view;
+
+// How a node holds its operands: leaves by reference, nodes by value
+template <class E> struct vexpr_operand { typedef const E type; };
+template <unsigned int N> struct vexpr_operand< fvector<N> > { typedef const fvector<N>& type; };
+template <> struct vexpr_operand<vector> { typedef const vector& type; };
+
+// Matrices of a product are held by reference, views by value (a view is often a temporary)
+template <class M> struct vexpr_matrix_operand { typedef const M& type; };
+template <> struct vexpr_matrix_operand<matrix_view> { typedef const matrix_view type; };
+
+void vexpr_length_mismatch();		// Prints an error and exits
+void vector_index_error();			// Same
+
+template <class L, class R>
+class vexpr_sum : public vexpr< vexpr_sum<L,R> > {
+	public:
+		vexpr_sum(const L& l, const R& r) : l(l), r(r) {
+			if (l.length() != r.length()) vexpr_length_mismatch();
+		}
+		unsigned int length() const { return l.length(); }
+		float operator [] (unsigned int i) const { return l[i] + r[i]; }
+	private:
+		typename vexpr_operand<L>::type l;
+		typename vexpr_operand<R>::type r;
+};
+
+template <class L, class R>
+class vexpr_diff : public vexpr< vexpr_diff<L,R> > {
+	public:
+		vexpr_diff(const L& l, const R& r) : l(l), r(r) {
+			if (l.length() != r.length()) vexpr_length_mismatch();
+		}
+		unsigned int length() const { return l.length(); }
+		float operator [] (unsigned int i) const { return l[i] - r[i]; }
+	private:
+		typename vexpr_operand<L>::type l;
+		typename vexpr_operand<R>::type r;
+};
+
+template <class E>
+class vexpr_scale : public vexpr< vexpr_scale<E> > {
+	public:
+		vexpr_scale(const E& e, float scale) : e(e), scale(scale) {}
+		unsigned int length() const { return e.length(); }
+		float operator [] (unsigned int i) const { return e[i] * scale; }
+	private:
+		typename vexpr_operand<E>::type e;
+		float scale;
+};
+
+// Matrix * vector. Every row reads all of v, so if v is itself a long chain,
+// evaluate it into a vector first.
+template <class M, class E>
+class vexpr_matvec : public vexpr< vexpr_matvec<M,E> > {
+	public:
+		vexpr_matvec(const M& mat, const E& v) : mat(mat), v(v) {
+			if (mat.cols() != v.length()) vexpr_length_mismatch();
+		}
+		unsigned int length() const { return mat.rows(); }
+		float operator [] (unsigned int i) const {
+			float sum = 0;
+			for (unsigned int j=0; j<mat.cols(); j++) sum += mat(i,j) * v[j];
+			return sum;
+		}
+	private:
+		typename vexpr_matrix_operand<M>::type mat;
+		typename vexpr_operand<E>::type v;
+};
+
+template <class L, class R>
+inline vexpr_sum<L,R> operator + (const vexpr<L>& l, const vexpr<R>& r) {	// Elementwise adding
+	return vexpr_sum<L,R>(l.self(), r.self());
+}
+template <class L, class R>
+inline vexpr_diff<L,R> operator - (const vexpr<L>& l, const vexpr<R>& r) {	// Elementwise subtracting
+	return vexpr_diff<L,R>(l.self(), r.self());
+}
+template <class E>
+inline vexpr_scale<E> operator * (const vexpr<E>& e, float scale) {		// Multiply with scalar
+	return vexpr_scale<E>(e.self(), scale);
+}
+template <class E>
+inline vexpr_scale<E> operator * (float scale, const vexpr<E>& e) {
+	return vexpr_scale<E>(e.self(), scale);
+}
+template <class L, class R>
+inline float innerprod(const vexpr<L>& v1, const vexpr<R>& v2) {
+	const L& a = v1.self();
+	const R& b = v2.self();
+	if (a.length() != b.length()) vexpr_length_mismatch();
+	float sum = 0;
+	for (unsigned int i=0; i<a.length(); i++) sum += a[i] * b[i];
+	return sum;
+}
+
+class vector : public vexpr<vector> {
 	public:
 		// Methods
-		vector(unsigned int length);		// n-dimensional vector
+		vector(unsigned int length);		// n-dimensional vector, zeroed
 		vector(float x, float y, float z);	// 3d vector
 		vector(vector* src);				// Copy src
+		vector(const vector& src);
+		vector(vector&& src);				// Steals the buffer of src
+		~vector();
+		vector& operator = (const vector& src);
+		vector& operator = (vector&& src);
+		template <class E> vector(const vexpr<E>& src);				// Evaluate an expression
+		template <class E> vector& operator = (const vexpr<E>& src);
 		
 		void set(unsigned int index, float value);	// Set an element
 		unsigned int length() const;				
@@ -19,45 +145,636 @@ class vector {
 		
 		void print() const;
 		
-		// Overloaded operators
-		vector operator + (const vector param) const;				// Elementwise adding
-		vector operator - (const vector param) const;				// Elementwise subtracting
-		vector operator * (float scale) const;				// Multiply with scalar
+		// Overloaded operators (+, - and * scalar are the expression templates above)
 		float operator [] (const unsigned int index) const;		// Return indexed element
 		
 	private:
 		float* data;
 		unsigned int n;
+		void resize(unsigned int length);	// Drops the contents unless the length is unchanged
 
 };
 
+// Inline: expression nodes call these for every element
+inline unsigned int vector::length() const {
+	return this->n;
+}
+
+inline float vector::operator[] (const unsigned int index) const {
+	if (index>n-1) vector_index_error();
+	return data[index];
+}
+
+template <class E>
+vector::vector(const vexpr<E>& src) : data(NULL), n(0) {
+	*this = src;
+}
+
+template <class E>
+vector& vector::operator= (const vexpr<E>& src) {
+	// Elementwise nodes only read index i before writing it, so v = v*2 + w is safe
+	const E& e = src.self();
+	this->resize(e.length());
+	for (unsigned int i=0; i<n; i++) data[i] = e[i];
+	return *this;
+}
+
 // Vector helper functions
 float vector_innerprod (vector* v1, vector* v2);
 
 
+class matrix_view;
+
 class matrix {
 	public:
-		// Variables
-		float** data;
-
 		// Methods
-		matrix(unsigned int rows, unsigned int cols);
+		matrix(unsigned int rows, unsigned int cols);	// Zeroed
 		matrix(matrix* src);
+		matrix(const matrix& src);
+		matrix(matrix&& src);				// Steals the buffer of src
+		explicit matrix(const matrix_view& src);	// Materialize a view
+		~matrix();
+		matrix& operator = (const matrix& src);
+		matrix& operator = (matrix&& src);
 		
-		unsigned int cols();
-		unsigned int rows();
+		unsigned int cols() const;
+		unsigned int rows() const;
 
 		void print() const;
-		void transpose();
+		void transpose();				// In place, no reallocation
 		int invert();
-		matrix pseudo_inverse();		// Moore-Penrose pseudo inverse
+		matrix pseudo_inverse() const;	// Moore-Penrose pseudo inverse (full rank)
+		
+		matrix_view view() const;		// Non-owning view of the whole matrix
+		matrix_view transposed() const;	// Non-owning transposed view, nothing is copied
 		
 		// Overloaded operators
-		vector operator * (vector);		// Matrix * column vector
-		matrix operator * (matrix);		// Matrix * Matrix
+		float* operator [] (unsigned int row) { return data + row*m; }				// M[i][j]
+		const float* operator [] (unsigned int row) const { return data + row*m; }
+		float& operator () (unsigned int row, unsigned int col) { return data[row*m + col]; }
+		float operator () (unsigned int row, unsigned int col) const { return data[row*m + col]; }
 	private:
+		float* data;	// Row-major, one contiguous aligned block of n*m floats
 		unsigned int m;	// Columns
 		unsigned int n;	// Rows
 };
 
+// Strided read-only window on matrix storage. Only valid while the matrix it came from lives.
+class matrix_view {
+	public:
+		matrix_view(const float* data, unsigned int rows, unsigned int cols,
+		            unsigned int row_stride, unsigned int col_stride)
+			: data(data), n(rows), m(cols), row_stride(row_stride), col_stride(col_stride) {}
+		matrix_view(const matrix& src) : matrix_view(src.view()) {}
+		
+		unsigned int cols() const { return m; }
+		unsigned int rows() const { return n; }
+		matrix_view transposed() const { return matrix_view(data, m, n, col_stride, row_stride); }
+		
+		float operator () (unsigned int row, unsigned int col) const {
+			return data[row*row_stride + col*col_stride];
+		}
+	private:
+		const float* data;
+		unsigned int n;	// Rows
+		unsigned int m;	// Columns
+		unsigned int row_stride;
+		unsigned int col_stride;
+};
+
+// Matrix * column vector, lazy as for fmatrix: M*v + offset is one loop. Don't assign it
+// back to v (v = M*v), every element reads all of v. M may be a matrix or a view.
+template <class E>
+inline vexpr_matvec<matrix_view,E> operator * (const matrix_view& M, const vexpr<E>& v) {
+	return vexpr_matvec<matrix_view,E>(M, v.self());
+}
+matrix operator * (const matrix_view& A, const matrix_view& B);	// Matrix * Matrix, both may be views
+
+/********************
+ * Linear solvers
+ * Factor in place and solve without forming an inverse. Everything works on caller
+ * storage: a row-major array with a row stride (matrix: &M(0,0) and M.cols()), plus
+ * the small pivot/tau arrays named below, so nothing is ever allocated. T is float or
+ * double. N (R, C) is the size when it is known at compile time, or 0 to use n (rows,
+ * cols) at run time; fixed sizes get loops the compiler can unroll. Solves overwrite
+ * the right hand side b (elements bstride apart, for a matrix column) with x.
+ * Factorizations return 1 on success, 0 if the matrix is singular (or not positive
+ * definite / rank deficient) to working precision.
+ ********************/
+
+// LU with partial pivoting, PA = LU. L (unit diagonal) below, U on and above the diagonal.
+// piv: n rows, the row swapped with at each step
+template <unsigned int N, class T>
+int lu_factor(T* A, unsigned int n, unsigned int stride, unsigned int* piv) {
+	if (N) n = N;
+	for (unsigned int k=0; k<n; k++) {
+		unsigned int p = k;
+		T max = 0;
+		for (unsigned int i=k; i<n; i++) {
+			T a = fabs(A[i*stride + k]);
+			if (a > max) { max = a; p = i; }
+		}
+		if (max == 0) return 0;
+		piv[k] = p;
+		if (p != k) {
+			for (unsigned int j=0; j<n; j++) {
+				T tmp = A[k*stride + j];
+				A[k*stride + j] = A[p*stride + j];
+				A[p*stride + j] = tmp;
+			}
+		}
+		T inv = 1/A[k*stride + k];
+		for (unsigned int i=k+1; i<n; i++) {
+			T l = (A[i*stride + k] *= inv);
+			for (unsigned int j=k+1; j<n; j++) A[i*stride + j] -= l*A[k*stride + j];
+		}
+	}
+	return 1;
+}
+
+template <unsigned int N, class T>
+void lu_solve(const T* LU, unsigned int n, unsigned int stride, const unsigned int* piv, T* b, unsigned int bstride = 1) {
+	if (N) n = N;
+	for (unsigned int k=0; k<n; k++) {
+		if (piv[k] != k) {
+			T tmp = b[k*bstride];
+			b[k*bstride] = b[piv[k]*bstride];
+			b[piv[k]*bstride] = tmp;
+		}
+	}
+	for (unsigned int i=1; i<n; i++) {
+		T sum = b[i*bstride];
+		for (unsigned int k=0; k<i; k++) sum -= LU[i*stride + k]*b[k*bstride];
+		b[i*bstride] = sum;
+	}
+	for (unsigned int i=n; i-- > 0; ) {
+		T sum = b[i*bstride];
+		for (unsigned int k=i+1; k<n; k++) sum -= LU[i*stride + k]*b[k*bstride];
+		b[i*bstride] = sum/LU[i*stride + i];
+	}
+}
+
+// Cholesky, A = LLᵀ for symmetric positive definite A. Reads and writes the lower triangle only.
+template <unsigned int N, class T>
+int cholesky_factor(T* A, unsigned int n, unsigned int stride) {
+	if (N) n = N;
+	const T eps = n*std::numeric_limits<T>::epsilon();
+	for (unsigned int j=0; j<n; j++) {
+		T d = A[j*stride + j];
+		for (unsigned int k=0; k<j; k++) d -= A[j*stride + k]*A[j*stride + k];
+		if (!(d > eps*A[j*stride + j])) return 0;	// Lost all significance: (semi-)definite
+		d = sqrt(d);
+		A[j*stride + j] = d;
+		T inv = 1/d;
+		for (unsigned int i=j+1; i<n; i++) {
+			T sum = A[i*stride + j];
+			for (unsigned int k=0; k<j; k++) sum -= A[i*stride + k]*A[j*stride + k];
+			A[i*stride + j] = sum*inv;
+		}
+	}
+	return 1;
+}
+
+template <unsigned int N, class T>
+void cholesky_solve(const T* L, unsigned int n, unsigned int stride, T* b, unsigned int bstride = 1) {
+	if (N) n = N;
+	for (unsigned int i=0; i<n; i++) {
+		T sum = b[i*bstride];
+		for (unsigned int k=0; k<i; k++) sum -= L[i*stride + k]*b[k*bstride];
+		b[i*bstride] = sum/L[i*stride + i];
+	}
+	for (unsigned int i=n; i-- > 0; ) {
+		T sum = b[i*bstride];
+		for (unsigned int k=i+1; k<n; k++) sum -= L[k*stride + i]*b[k*bstride];
+		b[i*bstride] = sum/L[i*stride + i];
+	}
+}
+
+// LDLᵀ, A = LDLᵀ for symmetric A with nonzero leading minors (also indefinite), no square roots.
+// L (unit diagonal) below the diagonal, D on it. Reads and writes the lower triangle only.
+template <unsigned int N, class T>
+int ldlt_factor(T* A, unsigned int n, unsigned int stride) {
+	if (N) n = N;
+	const T eps = n*std::numeric_limits<T>::epsilon();
+	for (unsigned int j=0; j<n; j++) {
+		T d = A[j*stride + j];
+		for (unsigned int k=0; k<j; k++) d -= A[j*stride + k]*A[j*stride + k]*A[k*stride + k];
+		if (!(fabs(d) > eps*fabs(A[j*stride + j]))) return 0;
+		A[j*stride + j] = d;
+		T inv = 1/d;
+		for (unsigned int i=j+1; i<n; i++) {
+			T sum = A[i*stride + j];
+			for (unsigned int k=0; k<j; k++) sum -= A[i*stride + k]*A[j*stride + k]*A[k*stride + k];
+			A[i*stride + j] = sum*inv;
+		}
+	}
+	return 1;
+}
+
+template <unsigned int N, class T>
+void ldlt_solve(const T* LD, unsigned int n, unsigned int stride, T* b, unsigned int bstride = 1) {
+	if (N) n = N;
+	for (unsigned int i=1; i<n; i++) {
+		T sum = b[i*bstride];
+		for (unsigned int k=0; k<i; k++) sum -= LD[i*stride + k]*b[k*bstride];
+		b[i*bstride] = sum;
+	}
+	for (unsigned int i=0; i<n; i++) b[i*bstride] /= LD[i*stride + i];
+	for (unsigned int i=n; i-- > 0; ) {
+		T sum = b[i*bstride];
+		for (unsigned int k=i+1; k<n; k++) sum -= LD[k*stride + i]*b[k*bstride];
+		b[i*bstride] = sum;
+	}
+}
+
+// Householder QR of a tall matrix (rows >= cols), A = QR. R on and above the diagonal, the
+// reflectors below it (their leading 1 implied) with their scale factors in tau: cols entries.
+// Unlike the normal equations this does not square the condition number.
+template <unsigned int R, unsigned int C, class T>
+int qr_factor(T* A, unsigned int rows, unsigned int cols, unsigned int stride, T* tau) {
+	if (R) rows = R;
+	if (C) cols = C;
+	T scale = 0;		// Largest column norm, for the rank test
+	for (unsigned int j=0; j<cols; j++) {
+		T sum = 0;
+		for (unsigned int i=0; i<rows; i++) sum += A[i*stride + j]*A[i*stride + j];
+		if (sum > scale) scale = sum;
+	}
+	const T eps = rows*std::numeric_limits<T>::epsilon()*sqrt(scale);
+	for (unsigned int k=0; k<cols; k++) {
+		T norm = 0;
+		for (unsigned int i=k; i<rows; i++) norm += A[i*stride + k]*A[i*stride + k];
+		norm = sqrt(norm);
+		if (!(norm > eps)) return 0;
+		// Reflect the column onto alpha*e1, sign chosen to avoid cancellation in v0
+		T alpha = (A[k*stride + k] > 0) ? -norm : norm;
+		T v0 = A[k*stride + k] - alpha;
+		T inv = 1/v0;
+		for (unsigned int i=k+1; i<rows; i++) A[i*stride + k] *= inv;
+		tau[k] = -v0/alpha;
+		A[k*stride + k] = alpha;
+		for (unsigned int j=k+1; j<cols; j++) {
+			T s = A[k*stride + j];
+			for (unsigned int i=k+1; i<rows; i++) s += A[i*stride + k]*A[i*stride + j];
+			s *= tau[k];
+			A[k*stride + j] -= s;
+			for (unsigned int i=k+1; i<rows; i++) A[i*stride + j] -= s*A[i*stride + k];
+		}
+	}
+	return 1;
+}
+
+// Least squares min |Ax - b|: b has rows entries, x is left in the first cols of them
+template <unsigned int R, unsigned int C, class T>
+void qr_solve(const T* QR, unsigned int rows, unsigned int cols, unsigned int stride, const T* tau,
+              T* b, unsigned int bstride = 1) {
+	if (R) rows = R;
+	if (C) cols = C;
+	for (unsigned int k=0; k<cols; k++) {		// b = Qᵀb
+		T s = b[k*bstride];
+		for (unsigned int i=k+1; i<rows; i++) s += QR[i*stride + k]*b[i*bstride];
+		s *= tau[k];
+		b[k*bstride] -= s;
+		for (unsigned int i=k+1; i<rows; i++) b[i*bstride] -= s*QR[i*stride + k];
+	}
+	for (unsigned int i=cols; i-- > 0; ) {		// Rx = b
+		T sum = b[i*bstride];
+		for (unsigned int k=i+1; k<cols; k++) sum -= QR[i*stride + k]*b[k*bstride];
+		b[i*bstride] = sum/QR[i*stride + i];
+	}
+}
+
+// Symmetric eigendecomposition by cyclic Jacobi rotations, A = V diag(values) Vᵀ. Uses the
+// full matrix and destroys it. V (n x n, row stride vstride) gets the eigenvectors as columns.
+// Returns 0 if it did not converge.
+template <unsigned int N, class T>
+int jacobi_eigen(T* A, unsigned int n, unsigned int stride, T* values, T* V, unsigned int vstride) {
+	if (N) n = N;
+	for (unsigned int i=0; i<n; i++)
+		for (unsigned int j=0; j<n; j++) V[i*vstride + j] = (i == j);
+	int converged = 0;
+	for (int sweep=0; sweep<50 && !converged; sweep++) {
+		T off = 0, diag = 0;
+		for (unsigned int p=0; p<n; p++) {
+			diag += A[p*stride + p]*A[p*stride + p];
+			for (unsigned int q=p+1; q<n; q++) off += A[p*stride + q]*A[p*stride + q];
+		}
+		if (!(off > std::numeric_limits<T>::epsilon()*std::numeric_limits<T>::epsilon()*diag)) {
+			converged = 1;
+			break;
+		}
+		for (unsigned int p=0; p<n; p++) {
+			for (unsigned int q=p+1; q<n; q++) {
+				T apq = A[p*stride + q];
+				if (apq == 0) continue;
+				// Rotation that zeroes A(p,q), the smaller of the two angles
+				T theta = (A[q*stride + q] - A[p*stride + p])/(2*apq);
+				T t = 1/(fabs(theta) + sqrt(theta*theta + 1));
+				if (theta < 0) t = -t;
+				T c = 1/sqrt(t*t + 1), s = t*c;
+				for (unsigned int k=0; k<n; k++) {		// A = AJ
+					T akp = A[k*stride + p], akq = A[k*stride + q];
+					A[k*stride + p] = c*akp - s*akq;
+					A[k*stride + q] = s*akp + c*akq;
+				}
+				for (unsigned int k=0; k<n; k++) {		// A = JᵀA
+					T apk = A[p*stride + k], aqk = A[q*stride + k];
+					A[p*stride + k] = c*apk - s*aqk;
+					A[q*stride + k] = s*apk + c*aqk;
+				}
+				for (unsigned int k=0; k<n; k++) {		// V = VJ
+					T vkp = V[k*vstride + p], vkq = V[k*vstride + q];
+					V[k*vstride + p] = c*vkp - s*vkq;
+					V[k*vstride + q] = s*vkp + c*vkq;
+				}
+			}
+		}
+	}
+	for (unsigned int i=0; i<n; i++) values[i] = A[i*stride + i];
+	return converged;
+}
+
+/********************
+ * Fixed-size types
+ * Dimensions are template parameters and the storage lives inside the object,
+ * so nothing here ever touches the heap. Use these on the sensor hot path;
+ * vector/matrix above are for offline work of arbitrary size.
+ ********************/
+
+template <unsigned int N>
+class fvector : public vexpr< fvector<N> > {
+	public:
+		// Variables
+		float data[N];
+
+		// Methods
+		constexpr fvector() : data() {}						// Zero vector
+		constexpr fvector(float x, float y, float z) : data{x, y, z} {}	// 3d vector
+
+		static constexpr unsigned int length() { return N; }
+		void set(unsigned int index, float value) { data[index] = value; }
+
+		float norm() const {
+			float sum = 0;
+			for (unsigned int i=0; i<N; i++) sum += data[i]*data[i];
+			return sqrtf(sum);
+		}
+		void normalize() {
+			float scale = 1/this->norm();
+			for (unsigned int i=0; i<N; i++) data[i] *= scale;
+		}
+
+		void print() const {
+			printf("[");
+			for (unsigned int i=0; i<N; i++)
+				printf("\t%f\t", data[i]);
+			printf("]\n");
+		}
+
+		// Overloaded operators
+		float& operator [] (unsigned int index) { return data[index]; }
+		constexpr float operator [] (unsigned int index) const { return data[index]; }
+
+		// +, - and * scalar are the expression templates, assigning evaluates them
+		template <class E> fvector(const vexpr<E>& src) { *this = src; }
+		template <class E> fvector& operator = (const vexpr<E>& src) {
+			// Evaluate into a temporary first: a matrix product reads all of its
+			// operand, so v = M*v would otherwise see half-updated values.
+			// For N this small the copy stays in registers.
+			const E& e = src.self();
+			if (e.length() != N) vexpr_length_mismatch();
+			float temp[N];
+			for (unsigned int i=0; i<N; i++) temp[i] = e[i];
+			for (unsigned int i=0; i<N; i++) data[i] = temp[i];
+			return *this;
+		}
+};
+
+inline fvector<3> crossprod(const fvector<3>& a, const fvector<3>& b) {
+	return fvector<3>(a[1]*b[2] - a[2]*b[1],
+	                  a[2]*b[0] - a[0]*b[2],
+	                  a[0]*b[1] - a[1]*b[0]);
+}
+
+
+template <unsigned int R, unsigned int C>
+class fmatrix {
+	public:
+		// Variables
+		float data[R][C];
+
+		// Methods
+		constexpr fmatrix() : data() {}						// Zero matrix
+
+		static fmatrix identity() {
+			fmatrix result;
+			for (unsigned int i=0; i<R && i<C; i++) result.data[i][i] = 1;
+			return result;
+		}
+
+		static constexpr unsigned int rows() { return R; }
+		static constexpr unsigned int cols() { return C; }
+
+		float& operator () (unsigned int row, unsigned int col) { return data[row][col]; }
+		constexpr float operator () (unsigned int row, unsigned int col) const { return data[row][col]; }
+
+		void print() const {
+			for (unsigned int i=0; i<R; i++) {
+				printf("[");
+				for (unsigned int j=0; j<C; j++)
+					printf("\t%f\t", data[i][j]);
+				printf("]\n");
+			}
+			printf("\n");
+		}
+
+		fmatrix<C,R> transposed() const {
+			fmatrix<C,R> result;
+			for (unsigned int i=0; i<R; i++)
+				for (unsigned int j=0; j<C; j++)
+					result.data[j][i] = data[i][j];
+			return result;
+		}
+
+		int invert();							// In place, square only. 1 on success, 0 if singular
+		fmatrix<C,R> pseudo_inverse() const;	// Moore-Penrose pseudo inverse (full rank)
+
+		// Overloaded operators
+		template <class E>
+		vexpr_matvec<fmatrix,E> operator * (const vexpr<E>& param) const {	// Matrix * column vector
+			return vexpr_matvec<fmatrix,E>(*this, param.self());
+		}
+
+		template <unsigned int K>
+		fmatrix<R,K> operator * (const fmatrix<C,K>& param) const {	// Matrix * Matrix
+			fmatrix<R,K> result;
+			for (unsigned int i=0; i<R; i++) {
+				for (unsigned int j=0; j<K; j++) {
+					float temp = 0;
+					for (unsigned int k=0; k<C; k++) temp += data[i][k] * param.data[k][j];
+					result.data[i][j] = temp;
+				}
+			}
+			return result;
+		}
+};
+
+template <unsigned int R, unsigned int C>
+int fmatrix<R,C>::invert() {
+	// LU with partial pivoting, then solve for the columns of the identity.
+	// The result is written in the source matrix, returns 1 on success, 0 on failure.
+	static_assert(R==C, "Cannot invert non-square matrix, use pseudo_inverse()");
+	fmatrix LU = *this;
+	unsigned int piv[R];
+	if (!lu_factor<R>(&LU.data[0][0], R, R, piv)) return 0;
+	*this = identity();
+	for (unsigned int j=0; j<R; j++) lu_solve<R>(&LU.data[0][0], R, R, piv, &data[0][j], C);
+	return 1;
+}
+
+template <unsigned int R, unsigned int C>
+fmatrix<C,R> fmatrix<R,C>::pseudo_inverse() const {
+	// Tall (R>=C): column i is the least squares solution of M*x = e_i, so pseudo_inv(M)*M = I
+	// Wide (R<C):  the transpose of that for MT, so M*pseudo_inv(M) = I
+	// Householder QR, never the normal equations. Zero if M is rank deficient.
+	fmatrix<C,R> result;
+	if (R >= C) {
+		fmatrix QR = *this;
+		float tau[C], b[R];
+		if (!qr_factor<R,C>(&QR.data[0][0], R, C, C, tau)) return result;
+		for (unsigned int i=0; i<R; i++) {
+			for (unsigned int k=0; k<R; k++) b[k] = (k == i);
+			qr_solve<R,C>(&QR.data[0][0], R, C, C, tau, b);
+			for (unsigned int k=0; k<C; k++) result.data[k][i] = b[k];
+		}
+	} else {
+		fmatrix<C,R> QR = this->transposed();
+		float tau[R], b[C];
+		if (!qr_factor<C,R>(&QR.data[0][0], C, R, R, tau)) return result;
+		for (unsigned int i=0; i<C; i++) {
+			for (unsigned int k=0; k<C; k++) b[k] = (k == i);
+			qr_solve<C,R>(&QR.data[0][0], C, R, R, tau, b);
+			for (unsigned int k=0; k<R; k++) result.data[i][k] = b[k];
+		}
+	}
+	return result;
+}
+
+// Fixed-size solvers, see Linear solvers above. The factors replace A.
+template <unsigned int N>
+int lu_factor(fmatrix<N,N>& A, unsigned int piv[N]) { return lu_factor<N>(&A.data[0][0], N, N, piv); }
+template <unsigned int N>
+void lu_solve(const fmatrix<N,N>& LU, const unsigned int piv[N], fvector<N>& b) {
+	lu_solve<N>(&LU.data[0][0], N, N, piv, b.data);
+}
+template <unsigned int N>
+int cholesky_factor(fmatrix<N,N>& A) { return cholesky_factor<N>(&A.data[0][0], N, N); }
+template <unsigned int N>
+void cholesky_solve(const fmatrix<N,N>& L, fvector<N>& b) { cholesky_solve<N>(&L.data[0][0], N, N, b.data); }
+template <unsigned int N>
+int ldlt_factor(fmatrix<N,N>& A) { return ldlt_factor<N>(&A.data[0][0], N, N); }
+template <unsigned int N>
+void ldlt_solve(const fmatrix<N,N>& LD, fvector<N>& b) { ldlt_solve<N>(&LD.data[0][0], N, N, b.data); }
+template <unsigned int R, unsigned int C>
+int qr_factor(fmatrix<R,C>& A, float tau[C]) {
+	static_assert(R>=C, "QR least squares needs at least as many rows as columns");
+	return qr_factor<R,C>(&A.data[0][0], R, C, C, tau);
+}
+template <unsigned int R, unsigned int C>
+fvector<C> qr_solve(const fmatrix<R,C>& QR, const float tau[C], fvector<R> b) {
+	qr_solve<R,C>(&QR.data[0][0], R, C, C, tau, b.data);
+	fvector<C> x;
+	for (unsigned int i=0; i<C; i++) x[i] = b[i];
+	return x;
+}
+template <unsigned int N>
+int jacobi_eigen(fmatrix<N,N> A, fvector<N>* values, fmatrix<N,N>* V) {
+	return jacobi_eigen<N>(&A.data[0][0], N, N, values->data, &V->data[0][0], N);
+}
+
+typedef fvector<3> Vec3;
+typedef fmatrix<3,3> Mat3;
+typedef fmatrix<3,4> Mat3x4;	// [Mat3 | offset], an affine transform of a Vec3
+
+/********************
+ * Unit quaternion for attitude, w + xi + yj + zk. Rotates body frame to earth frame.
+ ********************/
+
+class quaternion {
+	public:
+		// Variables
+		float w, x, y, z;
+
+		// Methods
+		constexpr quaternion() : w(1), x(0), y(0), z(0) {}		// No rotation
+		constexpr quaternion(float w, float x, float y, float z) : w(w), x(x), y(y), z(z) {}
+
+		void normalize() {
+			float scale = 1/sqrtf(w*w + x*x + y*y + z*z);
+			w *= scale; x *= scale; y *= scale; z *= scale;
+		}
+		quaternion conjugate() const { return quaternion(w, -x, -y, -z); }
+
+		Vec3 rotate(const Vec3& v) const {		// Body -> earth
+			// v + 2*r x (r x v + w*v), with r the vector part
+			Vec3 r(x, y, z);
+			Vec3 t = crossprod(r, v) + v*w;
+			return v + crossprod(r, t)*2.0f;
+		}
+		Vec3 earth_z() const {					// Earth z-axis (up) seen in the body frame
+			return Vec3(2*(x*z - w*y), 2*(w*x + y*z), w*w - x*x - y*y + z*z);
+		}
+		Vec3 euler() const {					// (pitch, roll, yaw) in radians, ZYX convention
+			float sinp = 2*(w*y - z*x);
+			if (sinp > 1) sinp = 1;
+			if (sinp < -1) sinp = -1;
+			return Vec3(asinf(sinp),
+			            atan2f(2*(w*x + y*z), 1 - 2*(x*x + y*y)),
+			            atan2f(2*(w*z + x*y), 1 - 2*(y*y + z*z)));
+		}
+
+		quaternion operator * (const quaternion& q) const {	// Hamilton product
+			return quaternion(w*q.w - x*q.x - y*q.y - z*q.z,
+			                  w*q.x + x*q.w + y*q.z - z*q.y,
+			                  w*q.y - x*q.z + y*q.w + z*q.x,
+			                  w*q.z + x*q.y - y*q.x + z*q.w);
+		}
+};
+
+/********************
+ * Blocks of 3-axis samples
+ * Structure-of-arrays storage so the batch kernels below can run SIMD over many
+ * samples at once (logging, replay, averaging). The kernel set is picked at build
+ * time from the target flags: AVX, SSE, NEON or plain scalar (-DMATRIX_NO_SIMD).
+ ********************/
+
+class vec3_block {
+	public:
+		// Variables
+		float* x;				// Aligned to MATRIX_ALIGNMENT, padded to a whole SIMD register
+		float* y;
+		float* z;
+		unsigned int count;		// Number of valid samples
+
+		// Methods
+		vec3_block(unsigned int capacity);
+		~vec3_block();
+
+		unsigned int capacity() const;
+		void clear();
+		int push(const Vec3& sample);		// 1 on success, 0 if the block is full
+		Vec3 get(unsigned int index) const;
+	private:
+		unsigned int cap;
+		vec3_block(const vec3_block&);				// Not copyable
+		vec3_block& operator = (const vec3_block&);
+};
+
+// Batch kernels, out/in may be the same block
+void vec3_block_affine(const Mat3& M, const Vec3& offset, const vec3_block& in, vec3_block& out);	// out = M*in + offset
+void vec3_block_norm(const vec3_block& in, float* out);							// out[i] = |in[i]|
+void vec3_block_dot(const vec3_block& a, const vec3_block& b, float* out);		// out[i] = a[i].b[i]
+Vec3 vec3_block_mean(const vec3_block& in);
+const char* vec3_block_kernels();		// Name of the kernel set compiled in
+
 #endif
@@ -0,0 +1,225 @@
+// Tool to replay a flight log (raptor -o) through the IMU, as fast as the CPU allows
+//	./replay [-a weights] [-m weights] [-j threads] [-n passes] flight.rec
+//	-a: comma separated weight_accel values to try, default IMU_STDWEIGHT_ACCEL
+//	-m: comma separated weight_magneto values to try, default IMU_STDWEIGHT_MAGNETO
+//	-j: run the configurations on this many threads, default one per core
+//	-n: replay the log this many times per configuration, for stable timing on short logs
+// Every combination of -a and -m is a configuration. Per configuration it reports the
+// throughput, how well the attitude agrees with the accelerometer when that only sees
+// gravity, and how far it is from the attitude the IMU estimated in flight.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <atomic>
+#include "IMU.h"
+#include "Recorder.h"
+#include "Metrics.h"
+#include "timing.h"
+#include "matrix.h"
+
+#define REPLAY_MAX_WEIGHTS 32			// Values per weight list
+#define REPLAY_STATIC_MIN 0.95			// Accel norm band [g] in which it only measures gravity
+#define REPLAY_STATIC_MAX 1.05
+#define REPLAY_DEG 57.2957795
+
+struct replay_sample {
+	uint64_t timestamp;
+	unsigned long index;		// Position in the log, keeps the order of equal timestamps
+	const flight_record* record;
+};
+
+struct replay_config {
+	float weight_accel;
+	float weight_magneto;
+	// Results
+	unsigned long samples;		// Filter steps per pass
+	double seconds;				// Wall time of all passes
+	double tilt_sum2;			// Squared tilt error vs accel [rad^2]
+	unsigned long tilt_count;
+	double flight_sum2;			// Squared attitude difference vs the flight [rad^2]
+	unsigned long flight_count;
+	float height;				// At the end of the log
+};
+
+static replay_sample* samples;
+static unsigned long num_samples;
+static replay_config* configs;
+static int num_configs;
+static int passes = 1;
+static std::atomic<int> next_config(0);
+
+static int compare_sample(const void* a, const void* b) {
+	const replay_sample* x = (const replay_sample*)a;
+	const replay_sample* y = (const replay_sample*)b;
+	if (x->timestamp != y->timestamp) return (x->timestamp > y->timestamp) ? 1 : -1;
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+static int parseWeights(const char* list, float* weights) {
+	int n = 0;
+	char* end;
+	while (*list && n < REPLAY_MAX_WEIGHTS) {
+		weights[n] = strtof(list, &end);
+		if (end == list || !(weights[n] > 0)) return 0;
+		n++;
+		list = (*end == ',') ? end + 1 : end;
+	}
+	return n;
+}
+
+static void replay(replay_config* config) {
+	IMU imu;
+	imu.weight_accel = config->weight_accel;
+	imu.weight_magneto = config->weight_magneto;
+
+	for (int pass = 0; pass < passes; pass++) {
+		imu.reset();
+		uint64_t last_accel = 0;
+		int last = (pass == passes - 1);	// Only the last pass is scored, all are timed
+		config->samples = 0;
+
+		double start = monotonic_ns();
+		for (unsigned long i = 0; i < num_samples; i++) {
+			const flight_record* r = samples[i].record;
+			switch (r->type) {
+				case RECORD_GYRO:
+					imu.addGyro(Vec3(r->values[0], r->values[1], r->values[2]));
+					break;
+				case RECORD_ACCEL: {
+					Vec3 accel(r->values[0], r->values[1], r->values[2]);
+					// Same gyro averaging as in flight (IMU::update(dt) on the acquisition ring). The first
+					// sample has no dt: it only takes the gyro samples before it, without a step.
+					imu.updateAccel(accel, last_accel ? (r->timestamp - last_accel) * 1e-9f : 0);
+					if (last_accel) config->samples++;
+					last_accel = r->timestamp;
+					if (last) {
+						float norm = accel.norm();
+						if (norm > REPLAY_STATIC_MIN && norm < REPLAY_STATIC_MAX) {
+							float c = innerprod(accel, imu.getAttitude().earth_z()) / norm;
+							float angle = acosf(c > 1 ? 1 : (c < -1 ? -1 : c));
+							config->tilt_sum2 += angle*angle;
+							config->tilt_count++;
+						}
+					}
+					break;
+				}
+				case RECORD_RANGE:
+					imu.updateRange(r->values[0]);
+					break;
+				case RECORD_COMPASS:
+					imu.updateCompass(Vec3(r->values[0], r->values[1], r->values[2]));
+					break;
+				case RECORD_IMU:
+					if (last) {
+						const quaternion& q = imu.getAttitude();
+						float d = fabsf(q.w*r->values[0] + q.x*r->values[1] + q.y*r->values[2] + q.z*r->values[3]);
+						float angle = 2*acosf(d > 1 ? 1 : d);
+						config->flight_sum2 += angle*angle;
+						config->flight_count++;
+					}
+					break;
+			}
+		}
+		config->seconds += (monotonic_ns() - start) * 1e-9;
+	}
+	config->height = imu.getHeight();
+}
+
+static void* worker(void* arg) {
+	int i;
+	while ((i = next_config.fetch_add(1)) < num_configs) replay(&configs[i]);
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	float weights_accel[REPLAY_MAX_WEIGHTS] = {IMU_STDWEIGHT_ACCEL};
+	float weights_magneto[REPLAY_MAX_WEIGHTS] = {IMU_STDWEIGHT_MAGNETO};
+	int num_accel = 1, num_magneto = 1;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ((opt = getopt(argc, argv, "a:m:j:n:")) != -1) {
+		switch (opt) {
+			case 'a': num_accel = parseWeights(optarg, weights_accel); break;
+			case 'm': num_magneto = parseWeights(optarg, weights_magneto); break;
+			case 'j': threads = atoi(optarg); break;
+			case 'n': passes = atoi(optarg); break;
+		}
+		if (opt == '?' || num_accel == 0 || num_magneto == 0 || threads < 1 || passes < 1) {
+			fprintf(stderr, "Usage: %s [-a weights] [-m weights] [-j threads] [-n passes] flight.rec\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-a weights] [-m weights] [-j threads] [-n passes] flight.rec\n", argv[0]);
+		return 1;
+	}
+
+	FlightLog log;
+	if (!log.open(argv[optind])) return 1;
+
+	// Sort by timestamp: the acquisition thread and the loop write their records out of step
+	samples = new replay_sample[log.size()];
+	num_samples = 0;
+	unsigned long counts[RECORD_COMPASS + 1] = {0};
+	for (unsigned long i = 0; i < log.size(); i++) {
+		const flight_record* r = log.get(i);
+		if (r->type <= RECORD_COMPASS) counts[r->type]++;
+		if (r->type != RECORD_ACCEL && r->type != RECORD_GYRO && r->type != RECORD_RANGE
+			&& r->type != RECORD_COMPASS && r->type != RECORD_IMU) continue;
+		samples[num_samples].timestamp = r->timestamp;
+		samples[num_samples].index = i;
+		samples[num_samples].record = r;
+		num_samples++;
+	}
+	qsort(samples, num_samples, sizeof(replay_sample), compare_sample);
+	printf("Log %s: %lu records (%lu lost), %lu accel, %lu gyro, %lu compass, %lu range, %lu IMU states\n",
+		argv[optind], log.size(), log.getLost(), counts[RECORD_ACCEL], counts[RECORD_GYRO],
+		counts[RECORD_COMPASS], counts[RECORD_RANGE], counts[RECORD_IMU]);
+	if (num_samples > 1) {
+		printf("Flight time %.1f s\n", (samples[num_samples-1].timestamp - samples[0].timestamp) * 1e-9);
+	}
+
+	num_configs = num_accel * num_magneto;
+	configs = new replay_config[num_configs];
+	memset(configs, 0, num_configs * sizeof(replay_config));
+	for (int a = 0; a < num_accel; a++) {
+		for (int m = 0; m < num_magneto; m++) {
+			configs[a*num_magneto + m].weight_accel = weights_accel[a];
+			configs[a*num_magneto + m].weight_magneto = weights_magneto[m];
+		}
+	}
+
+	// Shared atomic counters would serialize the threads
+	metrics_enable(0);
+	if (threads > num_configs) threads = num_configs;
+	pthread_t* pool = new pthread_t[threads];
+	double start = monotonic_ns();
+	for (int t = 0; t < threads; t++) pthread_create(&pool[t], NULL, worker, NULL);
+	for (int t = 0; t < threads; t++) pthread_join(pool[t], NULL);
+	double wall = (monotonic_ns() - start) * 1e-9;
+
+	printf("%s filter, %d configurations, %d passes, %d threads\n",
+		(IMU_FILTER == IMU_FILTER_EKF) ? "EKF" : "Mahony", num_configs, passes, threads);
+	printf("weight_accel weight_magneto   updates  Mupdates/s  tilt rms [deg]  vs flight rms [deg]  height [m]\n");
+	unsigned long total = 0;
+	for (int i = 0; i < num_configs; i++) {
+		replay_config* c = &configs[i];
+		total += c->samples * passes;
+		printf("%12.4f %14.4f %9lu %11.2f %15.3f ", c->weight_accel, c->weight_magneto, c->samples,
+			c->seconds > 0 ? c->samples * passes / c->seconds * 1e-6 : 0,
+			c->tilt_count ? sqrt(c->tilt_sum2 / c->tilt_count) * REPLAY_DEG : 0);
+		if (c->flight_count) printf("%20.3f", sqrt(c->flight_sum2 / c->flight_count) * REPLAY_DEG);
+		else printf("%20s", "-");
+		printf(" %11.2f\n", c->height);
+	}
+	printf("Total %.2f Mupdates/s over %.2f s wall time\n", wall > 0 ? total / wall * 1e-6 : 0, wall);
+
+	delete[] pool;
+	delete[] configs;
+	delete[] samples;
+	return 0;
+}
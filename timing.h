@@ -0,0 +1,19 @@
+/*
+ * 5HC99 Quadcopter project, group 1.
+ * Monotonic time, the one clock every timestamp in the code is taken from
+ */
+ 
+#ifndef _TIMING_H
+#define _TIMING_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Nanoseconds of CLOCK_MONOTONIC: wall time that never jumps, unlike clock() (CPU time)
+static inline uint64_t monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+#endif